@@ -0,0 +1,287 @@
+#!/bin/bash
+# Cenários de medida citados nas mensagens de commit.  Cada cenário sobe
+# um mmu próprio, roda os clientes e imprime os tempos.  A saída do mmu
+# vai para $MMU_OUT.
+#
+# Uso: ./bench.sh CENARIO
+set -u
+
+MMU_OUT=${MMU_OUT:-/tmp/bench.mmu.out}
+
+make > /dev/null && make bench > /dev/null || exit 1
+
+# start_mmu ARGS...: sobe o mmu e espera o socket aparecer.
+start_mmu() {
+    rm -rf mmu.sock mmu.pmem.img.*
+    ./bin/mmu "$@" &> $MMU_OUT &
+    MMU_PID=$!
+    for i in $(seq 500); do
+        [ -S mmu.sock ] && break
+        sleep 0.01
+    done
+    sleep 0.1
+}
+
+stop_mmu() {
+    kill -SIGINT $MMU_PID
+    for i in $(seq 50); do
+        kill -0 $MMU_PID 2> /dev/null || break
+        sleep 0.1
+    done
+    kill -9 $MMU_PID 2> /dev/null
+    wait $MMU_PID 2> /dev/null
+    rm -rf mmu.sock mmu.pmem.img.*
+}
+
+# elapsed CMD...: roda CMD e imprime o tempo de parede.
+elapsed() {
+    local start=$(date +%s.%N)
+    "$@" > /dev/null
+    local end=$(date +%s.%N)
+    awk -v s=$start -v e=$end 'BEGIN { printf "%.3f s\n", e - s }'
+}
+
+case "${1:-}" in
+procs)
+    # test12: 64 processos com 32 páginas cada, em 256 frames.
+    for run in 1 2 3; do
+        start_mmu 256 1024
+        echo "test12: $(elapsed ./bin/test12)"
+        stop_mmu
+    done
+    ;;
+workers)
+    # test12 com pools de 1, 2, 4 e 8 workers.
+    for w in 1 2 4 8; do
+        start_mmu -w $w 256 1024
+        echo "test12 -w $w: $(elapsed ./bin/test12)"
+        stop_mmu
+    done
+    ;;
+transport)
+    # Três páginas alternadas em dois frames, pelo socket e pelos anéis.
+    for t in sock shm; do
+        for run in 1 2 3; do
+            start_mmu 2 8
+            UVM_TRANSPORT=$t ./bin/faultbench -n 3 -l 10000 cycle |
+                sed "s/^/$t: /"
+            stop_mmu
+        done
+    done
+    ;;
+cleaner)
+    # test21, só escritas, sem e com o cleaner.
+    for opts in "" "-o cleaner=1"; do
+        for run in 1 2 3; do
+            start_mmu -o stats=1 $opts 64 512
+            ./bin/test21 2>&1 > /dev/null | sed "s/^/${opts:-no cleaner}: /"
+            stop_mmu
+            grep pager_stats $MMU_OUT
+        done
+    done
+    ;;
+readahead)
+    # Leitura sequencial de 200 páginas novas, sem e com readahead.
+    for opts in "" "-o readahead=16"; do
+        for run in 1 2 3; do
+            start_mmu -o stats=1 $opts 256 1024
+            ./bin/faultbench -n 200 seq | sed "s/^/${opts:-no readahead}: /"
+            stop_mmu
+            grep pager_stats $MMU_OUT
+        done
+    done
+    ;;
+trace)
+    # Custo das faltas em cada nível de texto do mmu; sem argumento, o
+    # nível padrão (útil para comparar com versões sem -t).
+    for level in ${2:-full summary off}; do
+        [ "$level" = default ] && topt="" || topt="-t $level"
+        for run in 1 2 3; do
+            start_mmu $topt 2 8
+            ./bin/faultbench -n 3 -l 2000 cycle | sed "s/^/$level: /"
+            stop_mmu
+        done
+        for run in 1 2; do
+            start_mmu $topt 64 512
+            ./bin/test21 2>&1 > /dev/null | sed "s/^/$level: /"
+            stop_mmu
+        done
+    done
+    ;;
+swap)
+    # Primitivas de E/S de cada backend, depois um cliente varrendo 256
+    # páginas em 4 frames com cada backend.
+    ./bin/swapbench mem 65536
+    ./bin/swapbench bench.swap 65536
+    ./bin/swapbench -d bench.swap 65536
+    for opts in "" "-s bench.swap" "-s bench.swap -d"; do
+        for run in 1 2 3; do
+            start_mmu $opts 4 1024
+            ./bin/faultbench -n 256 -l 4 sweep | sed "s/^/${opts:-memory}: /"
+            stop_mmu
+        done
+    done
+    rm -f bench.swap
+    ;;
+diskio)
+    # Os motores de E/S isolados, depois 8 clientes em 16 frames com
+    # swap O_DIRECT em cada motor.
+    ./bin/diskiobench -d -b 16 bench.swap
+    ./bin/diskiobench -b 16 bench.swap
+    ./bin/diskiobench -b 1 bench.swap
+    ./bin/diskiobench -i -b 1 bench.swap
+    for e in sync threads uring; do
+        for run in 1 2 3; do
+            start_mmu -s bench.swap -d -i $e 16 1024
+            echo "$e: $(elapsed ./bin/faultbench -p 8 -n 32 -l 16 sweep)"
+            stop_mmu
+        done
+    done
+    rm -f bench.swap
+    ;;
+zswap)
+    # O codec isolado; um cliente varrendo 256 páginas em 16 frames, sem
+    # e com o pool; e quantas páginas o test12 derrama num pool de 1 KiB.
+    ./bin/zswapbench
+    for opts in "" "-z 64k"; do
+        for run in 1 2 3; do
+            start_mmu $opts 16 1024
+            ./bin/faultbench -n 256 -l 4 sweep | sed "s/^/${opts:-no pool}: /"
+            stop_mmu
+            grep zswap_stats $MMU_OUT
+        done
+    done
+    start_mmu -z 1k 256 1024
+    ./bin/test12 > /dev/null
+    stop_mmu
+    echo "test12: $(grep zswap_stats $MMU_OUT)"
+    ;;
+zeropage)
+    # Traço esparso no pagersim: 4 processos de 256 páginas, 400k
+    # acessos, leituras uniformes e 5% de escritas em 16 páginas de cada
+    # processo.  Depois um cliente que escreve 16 de 256 páginas e lê
+    # todas quatro vezes, em 16 frames.
+    awk 'BEGIN { srand(1); base = 1610612736
+        for (p = 1; p <= 4; p++) print "c", p
+        for (p = 1; p <= 4; p++) for (i = 0; i < 256; i++) print "e", p
+        for (i = 0; i < 400000; i++) {
+            p = 1 + int(rand() * 4)
+            if (rand() < 0.05)
+                printf "w %d %x\n", p, base + int(rand() * 16) * 16 * 4096
+            else
+                printf "r %d %x\n", p, base + int(rand() * 256) * 4096
+        }
+        for (p = 1; p <= 4; p++) print "x", p }' > bench.trace
+    for z in 0 1; do
+        echo "zeropage=$z:"
+        ./bin/pagersim -t bench.trace -P clock,arc -f 16,64 -o zeropage=$z
+    done
+    rm -f bench.trace
+    for z in 0 1; do
+        for run in 1 2 3; do
+            start_mmu -o stats=1 -o zeropage=$z 16 1024
+            ./bin/faultbench -n 256 -l 4 sparse | sed "s/^/zeropage=$z: /"
+            stop_mmu
+            grep pager_stats $MMU_OUT
+        done
+    done
+    # Páginas escritas só com o '0' do preenchimento são descartadas na
+    # evicção, sem escrita; as com dados voltam do disco intactas.
+    for opts in "" "-o cleaner=1 -s bench.swap" "-z 64k"; do
+        start_mmu -o stats=1 -o zeropage=1 $opts 16 1024
+        ./bin/faultbench -n 256 refill | sed "s/^/${opts:-zeropage=1}: /"
+        stop_mmu
+        grep pager_stats $MMU_OUT
+    done
+    rm -f bench.swap
+    ;;
+ksm)
+    # 8 processos com as mesmas 8 páginas (64 páginas, 8 conteúdos), em
+    # 16 e 32 frames, sem e com a fusão de páginas iguais.
+    for frames in 16 32; do
+        for opts in "-o ksm=0" "-o ksm=1 -o ksm_interval=5"; do
+            for run in 1 2 3; do
+                start_mmu -o stats=1 $opts $frames 1024
+                echo "$frames frames $opts: $(elapsed ./bin/faultbench -p 8 -n 8 -l 400 shared)"
+                stop_mmu
+                grep pager_stats $MMU_OUT | grep -o "clean_evictions [0-9]*\|ksm.*"
+            done
+        done
+    done
+    ;;
+faults)
+    # Latência de falta por transporte e por entrega (sinal ou
+    # userfaultfd): 256 faltas frias com 1 e 8 threads, e 64 páginas
+    # alternadas em 16 frames.
+    for t in sock shm; do
+        for f in sig uffd; do
+            for run in 1 2 3; do
+                for th in 1 8; do
+                    start_mmu 256 1024
+                    UVM_TRANSPORT=$t UVM_FAULTS=$f \
+                        ./bin/faultbench -n 256 -t $th cold | sed "s/^/$t $f: /"
+                    stop_mmu
+                done
+                start_mmu 16 1024
+                UVM_TRANSPORT=$t UVM_FAULTS=$f \
+                    ./bin/faultbench -n 64 -l 20 cycle | sed "s/^/$t $f: /"
+                stop_mmu
+            done
+        done
+    done
+    ;;
+concurrency)
+    # Um processo com 1 ou 8 threads sobre 128 páginas em 32 frames,
+    # lendo, escrevendo e chamando uvm_syslog, com 4 workers.
+    mixed() {
+        local name=$1 th=$2
+        shift 2
+        for run in 1 2 3; do
+            start_mmu -w 4 "$@" 32 1024
+            ./bin/faultbench -n 128 -l 16 -t $th mixed | sed "s/^/$name: /"
+            stop_mmu
+        done
+        rm -f bench.swap
+    }
+    mixed "memfd" 1
+    mixed "memfd" 8
+    UVM_TRANSPORT=shm UVM_FAULTS=uffd mixed "memfd, shm+uffd" 8
+    mixed "O_DIRECT swap" 8 -s bench.swap -d
+    UVM_TRANSPORT=shm UVM_FAULTS=uffd \
+        mixed "O_DIRECT swap, shm+uffd" 8 -s bench.swap -d
+    ;;
+remap)
+    # Custo de cada forma de remapear uma página no uvm.
+    for run in 1 2 3; do
+        ./bin/remapbench
+    done
+    ;;
+extend)
+    # 64 processos criam um uvm e alocam 32 páginas cada, uma a uma ou
+    # de uma vez, pelo socket e pelos anéis.
+    for t in sock shm; do
+        for b in "" -b; do
+            for run in 1 2 3; do
+                start_mmu -t off 256 4096
+                echo "$t ${b:-loop}: $(UVM_TRANSPORT=$t elapsed \
+                    ./bin/faultbench -p 64 -n 32 $b extend)"
+                stop_mmu
+            done
+        done
+    done
+    ;;
+release)
+    # Devolve 128 páginas residentes, uma a uma ou de uma vez, 20 vezes.
+    for b in "" -b; do
+        for run in 1 2 3; do
+            start_mmu -t off 256 256
+            ./bin/faultbench -n 128 -l 20 $b release
+            stop_mmu
+        done
+    done
+    ;;
+*)
+    echo "usage: $0 procs|workers|transport|cleaner|readahead|trace [LEVELS]|swap|diskio|zswap|zeropage|ksm|faults|concurrency|remap|extend|release"
+    exit 1
+    ;;
+esac
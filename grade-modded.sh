@@ -31,10 +31,15 @@ while read -r num frames blocks nodiff ; do
     echo "Running test$num (frames=$frames, blocks=$blocks, nodiff=$nodiff)"
     echo "----------------------------------------"
     
-    rm -rf mmu.sock mmu.pmem.img.*
-    ./bin/mmu $frames $blocks &> test$num.mmu.out &
+    rm -rf mmu.sock mmu.pmem.img.* mmu.ready
+    ./bin/mmu -r mmu.ready $frames $blocks &> test$num.mmu.out &
     MMU_PID=$!
-    sleep 1
+    # Espera o MMU sinalizar que está pronto (até 5s)
+    for i in $(seq 500); do
+        [ -e mmu.ready ] && break
+        kill -0 $MMU_PID 2>/dev/null || break
+        sleep 0.01
+    done
     
     # Verifica se MMU iniciou
     if ! kill -0 $MMU_PID 2>/dev/null; then
@@ -49,7 +54,7 @@ while read -r num frames blocks nodiff ; do
     
     kill -SIGINT $MMU_PID 2>/dev/null
     wait $MMU_PID 2>/dev/null
-    rm -rf mmu.sock mmu.pmem.img.*
+    rm -rf mmu.sock mmu.pmem.img.* mmu.ready
     
     # Verifica se o teste teve timeout
     if [ $TEST_STATUS -eq 124 ]; then
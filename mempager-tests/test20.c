@@ -0,0 +1,56 @@
+/* Test 20: client churn soak test
+ * Cria e destrói 10k clientes, no máximo `num_inflight` ao mesmo tempo.
+ * Cada cliente aloca e escreve uma página antes de sair, então ids,
+ * entradas de processo, frames e blocos precisam ser reciclados.  Para
+ * uma rodada mais longa, passe o número de clientes como argumento
+ * (100k levam uns 3.5 minutos, além do limite do grade). */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mmu.h"
+#include "uvm.h"
+
+int num_clients = 10000;
+int num_inflight = 64; /* run with ./mmu 256 1024 */
+
+static void client(void) {
+	pid_t pid = getpid();
+	uvm_create();
+	char *page = uvm_extend();
+	assert(page != NULL);
+	sprintf(page, "%010d", (int)pid);
+	exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv) {
+	if(argc > 1) num_clients = atoi(argv[1]);
+	int running = 0;
+	int failed = 0;
+	for(int i = 0; i < num_clients; ++i) {
+		if(running == num_inflight) {
+			int status;
+			wait(&status);
+			if(!WIFEXITED(status) || WEXITSTATUS(status)) failed++;
+			running--;
+		}
+		pid_t pid = fork();
+		assert(pid != -1);
+		if(pid == 0) client();
+		running++;
+	}
+	while(running > 0) {
+		int status;
+		wait(&status);
+		if(!WIFEXITED(status) || WEXITSTATUS(status)) failed++;
+		running--;
+	}
+	printf("%d clients, %d failed\n", num_clients, failed);
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,68 @@
+/* Test 21: concurrent fault stress test
+ * Vários processos escrevem e conferem mais páginas do que cabem na
+ * memória física, então faltas, segundas chances e evicções de páginas de
+ * outros processos acontecem ao mesmo tempo.  A vazão agregada (acessos
+ * por segundo) vai para stderr, para comparar execuções com -w
+ * diferentes. */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mmu.h"
+#include "uvm.h"
+
+int num_forks = 16;
+int num_pages = 16;
+int num_loops = 32; /* run with ./mmu 64 512 */
+
+static int client(void) {
+	pid_t pid = getpid();
+	uvm_create();
+	char **pages = malloc(num_pages * sizeof(pages[0]));
+	for(int i = 0; i < num_pages; ++i) {
+		pages[i] = uvm_extend();
+		assert(pages[i] != NULL);
+	}
+	int errors = 0;
+	char expected[32];
+	for(int i = 0; i < num_loops; ++i) {
+		for(int j = 0; j < num_pages; ++j) {
+			sprintf(pages[j], "%010d %06d", (int)pid, i);
+		}
+		for(int j = 0; j < num_pages; ++j) {
+			sprintf(expected, "%010d %06d", (int)pid, i);
+			if(strcmp(pages[j], expected) != 0) errors++;
+		}
+	}
+	return errors;
+}
+
+int main(void) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int i = 0; i < num_forks; ++i) {
+		pid_t pid = fork();
+		assert(pid != -1);
+		if(pid == 0) exit(client() ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+	int failed = 0;
+	for(int i = 0; i < num_forks; ++i) {
+		int status;
+		wait(&status);
+		if(!WIFEXITED(status) || WEXITSTATUS(status)) failed++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double secs = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+	double accesses = 2.0 * num_forks * num_pages * num_loops;
+	printf("%d processes, %d failed\n", num_forks, failed);
+	fprintf(stderr, "%.0f accesses/s\n", accesses / secs);
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
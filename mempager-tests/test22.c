@@ -0,0 +1,58 @@
+/* Test 22: concurrent faults on shared pages
+ * Três threads de um mesmo processo escrevem cada uma o seu byte em
+ * páginas compartilhadas que não cabem na memória física, então faltas
+ * na mesma página chegam ao pager ao mesmo tempo.  Nenhuma escrita pode
+ * se perder. */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "mmu.h"
+#include "uvm.h"
+
+#define NUM_THREADS 3
+#define NUM_PAGES 8
+
+int num_loops = 100; /* run with ./mmu 6 64 */
+
+static char *pages[NUM_PAGES];
+
+static void *writer(void *arg) {
+	int id = (int)(intptr_t)arg;
+	long errors = 0;
+	for(int i = 1; i <= num_loops; ++i) {
+		for(int j = 0; j < NUM_PAGES; ++j) {
+			if(pages[j][id] != (char)(i - 1)) errors++;
+			pages[j][id] = (char)i;
+		}
+	}
+	for(int j = 0; j < NUM_PAGES; ++j) {
+		if(pages[j][id] != (char)num_loops) errors++;
+	}
+	return (void *)errors;
+}
+
+int main(void) {
+	uvm_create();
+	for(int j = 0; j < NUM_PAGES; ++j) {
+		pages[j] = uvm_extend();
+		assert(pages[j] != NULL);
+		for(int t = 0; t < NUM_THREADS; ++t) pages[j][t] = 0;
+	}
+	pthread_t threads[NUM_THREADS];
+	for(int t = 0; t < NUM_THREADS; ++t) {
+		int rc = pthread_create(&threads[t], NULL, writer, (void *)(intptr_t)t);
+		assert(rc == 0);
+	}
+	long lost = 0;
+	for(int t = 0; t < NUM_THREADS; ++t) {
+		void *errors;
+		pthread_join(threads[t], &errors);
+		lost += (long)errors;
+	}
+	printf("%d threads, %ld lost writes\n", NUM_THREADS, lost);
+	exit(lost ? EXIT_FAILURE : EXIT_SUCCESS);
+}
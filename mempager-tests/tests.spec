@@ -17,3 +17,6 @@
 17 4 8 1
 18 4 8 1
 19 4 8 1
+20 256 1024 1
+21 64 512 1
+22 6 64 1
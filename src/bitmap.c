@@ -0,0 +1,145 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+/*****************************************************************************
+ * bitmap struct and helpers
+ ****************************************************************************/
+/* 64^6 slots is far more than anything we will ever manage. */
+#define BITMAP_MAX_LEVELS 6
+#define BITMAP_WORD_BITS 64
+
+struct bitmap {
+	unsigned nbits;
+	unsigned nfree;
+	int nlevels;
+	unsigned nwords[BITMAP_MAX_LEVELS];
+	uint64_t *level[BITMAP_MAX_LEVELS]; /* level[0] holds one bit per slot */
+};
+
+static inline unsigned bitmap_words(unsigned nbits)
+{
+	return (nbits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+}
+
+/*****************************************************************************
+ * bitmap function implementations
+ ****************************************************************************/
+struct bitmap * bitmap_create(unsigned nbits) /* {{{ */
+{
+	struct bitmap *bm = calloc(1, sizeof(*bm));
+	if(!bm) return NULL;
+	bm->nbits = nbits;
+	bm->nfree = nbits;
+
+	unsigned bits = nbits ? nbits : 1;
+	do {
+		if(bm->nlevels == BITMAP_MAX_LEVELS) goto out;
+		unsigned nwords = bitmap_words(bits);
+		bm->nwords[bm->nlevels] = nwords;
+		bm->level[bm->nlevels] = calloc(nwords, sizeof(uint64_t));
+		if(!bm->level[bm->nlevels]) goto out;
+		bm->nlevels++;
+		bits = nwords;
+	} while(bits > 1);
+
+	/* Mark every valid slot as free, then build the summaries. */
+	for(unsigned i = 0; i < nbits / BITMAP_WORD_BITS; i++)
+		bm->level[0][i] = ~(uint64_t)0;
+	if(nbits % BITMAP_WORD_BITS)
+		bm->level[0][nbits / BITMAP_WORD_BITS] =
+				((uint64_t)1 << (nbits % BITMAP_WORD_BITS)) - 1;
+	for(int l = 1; l < bm->nlevels; l++) {
+		for(unsigned i = 0; i < bm->nwords[l-1]; i++) {
+			if(!bm->level[l-1][i]) continue;
+			bm->level[l][i / BITMAP_WORD_BITS] |=
+					(uint64_t)1 << (i % BITMAP_WORD_BITS);
+		}
+	}
+	return bm;
+
+	out:
+	bitmap_destroy(bm);
+	return NULL;
+} /* }}} */
+
+void bitmap_destroy(struct bitmap *bm) /* {{{ */
+{
+	if(!bm) return;
+	for(int l = 0; l < bm->nlevels; l++)
+		free(bm->level[l]);
+	free(bm);
+} /* }}} */
+
+int bitmap_grow(struct bitmap *bm, unsigned nbits) /* {{{ */
+{
+	if(nbits <= bm->nbits) return 0;
+	struct bitmap *nbm = bitmap_create(nbits);
+	if(!nbm) return -1;
+	for(unsigned i = 0; i < bm->nbits; i++) {
+		if(!bitmap_isfree(bm, i)) bitmap_take(nbm, i);
+	}
+	/* Swap contents so callers keep their pointer. */
+	struct bitmap tmp = *bm;
+	*bm = *nbm;
+	*nbm = tmp;
+	bitmap_destroy(nbm);
+	return 0;
+} /* }}} */
+
+int bitmap_alloc(struct bitmap *bm) /* {{{ */
+{
+	if(bm->nfree == 0) return -1;
+	unsigned idx = 0;
+	for(int l = bm->nlevels - 1; l >= 0; l--) {
+		uint64_t word = bm->level[l][idx];
+		idx = idx * BITMAP_WORD_BITS + __builtin_ctzll(word);
+	}
+	bitmap_take(bm, idx);
+	return (int)idx;
+} /* }}} */
+
+void bitmap_take(struct bitmap *bm, unsigned idx) /* {{{ */
+{
+	if(idx >= bm->nbits || !bitmap_isfree(bm, idx)) return;
+	bm->nfree--;
+	for(int l = 0; l < bm->nlevels; l++) {
+		uint64_t *word = &bm->level[l][idx / BITMAP_WORD_BITS];
+		*word &= ~((uint64_t)1 << (idx % BITMAP_WORD_BITS));
+		/* Parent summaries only change when this word runs out. */
+		if(*word) break;
+		idx /= BITMAP_WORD_BITS;
+	}
+} /* }}} */
+
+void bitmap_release(struct bitmap *bm, unsigned idx) /* {{{ */
+{
+	if(idx >= bm->nbits || bitmap_isfree(bm, idx)) return;
+	bm->nfree++;
+	for(int l = 0; l < bm->nlevels; l++) {
+		uint64_t *word = &bm->level[l][idx / BITMAP_WORD_BITS];
+		int was_empty = (*word == 0);
+		*word |= (uint64_t)1 << (idx % BITMAP_WORD_BITS);
+		if(!was_empty) break;
+		idx /= BITMAP_WORD_BITS;
+	}
+} /* }}} */
+
+int bitmap_isfree(const struct bitmap *bm, unsigned idx) /* {{{ */
+{
+	if(idx >= bm->nbits) return 0;
+	uint64_t word = bm->level[0][idx / BITMAP_WORD_BITS];
+	return (word >> (idx % BITMAP_WORD_BITS)) & 1;
+} /* }}} */
+
+unsigned bitmap_nfree(const struct bitmap *bm) /* {{{ */
+{
+	return bm->nfree;
+} /* }}} */
+
+unsigned bitmap_size(const struct bitmap *bm) /* {{{ */
+{
+	return bm->nbits;
+} /* }}} */
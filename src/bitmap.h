@@ -0,0 +1,42 @@
+/* This module implements a hierarchical free-slot bitmap.  It keeps one bit
+ * per slot (set means free) plus summary levels where each bit tells whether
+ * the corresponding 64-bit word one level below has any free slot.  Finding
+ * the lowest-numbered free slot descends the summary levels with
+ * __builtin_ctzll, so allocation and release cost O(log64(nbits)) instead of
+ * a linear scan over all slots.
+ *
+ * These functions are not thread-safe; callers must serialize access. */
+
+#ifndef __BITMAP_HEADER__
+#define __BITMAP_HEADER__
+
+/* This function creates a bitmap with =nbits= slots, all of them free.
+ * Returns NULL if memory cannot be allocated. */
+struct bitmap * bitmap_create(unsigned nbits);
+
+/* This function frees all memory used by =bm=. */
+void bitmap_destroy(struct bitmap *bm);
+
+/* This function grows =bm= to =nbits= slots.  New slots are free; existing
+ * slots keep their state.  Returns 0 on success and -1 if memory cannot be
+ * allocated, in which case =bm= is unchanged. */
+int bitmap_grow(struct bitmap *bm, unsigned nbits);
+
+/* This function marks the lowest-numbered free slot as used and returns its
+ * index.  Returns -1 if there are no free slots. */
+int bitmap_alloc(struct bitmap *bm);
+
+/* These functions mark slot =idx= as used or free, respectively.  Marking a
+ * slot that is already in the requested state has no effect. */
+void bitmap_take(struct bitmap *bm, unsigned idx);
+void bitmap_release(struct bitmap *bm, unsigned idx);
+
+/* This function returns a nonzero value if slot =idx= is free. */
+int bitmap_isfree(const struct bitmap *bm, unsigned idx);
+
+/* These functions return the number of free slots and the total number of
+ * slots in =bm=, respectively. */
+unsigned bitmap_nfree(const struct bitmap *bm);
+unsigned bitmap_size(const struct bitmap *bm);
+
+#endif
@@ -0,0 +1,90 @@
+/* Microbenchmark for the free-slot bitmap.  For each size, all slots are
+ * taken and then one random slot is released and allocated again, as
+ * when a full set of frames or blocks turns over.  Compares the bitmap
+ * with the linear scan over a `used` flag that pager.c used before. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bitmap.h"
+
+/* Same layout as the pager's BlockInfo. */
+struct slot {
+	int used;
+	int pid;
+	int page;
+};
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}/*}}}*/
+
+static int linear_alloc(struct slot *v, int n)/*{{{*/
+{
+	for(int i = 0; i < n; i++) {
+		if(!v[i].used) {
+			v[i].used = 1;
+			return i;
+		}
+	}
+	return -1;
+}/*}}}*/
+
+static double bench_bitmap(unsigned n, const unsigned *victims, int nops)/*{{{*/
+{
+	struct bitmap *bm = bitmap_create(n);
+	if(!bm) exit(EXIT_FAILURE);
+	for(unsigned i = 0; i < n; i++) bitmap_alloc(bm);
+	long check = 0;
+	double t = now();
+	for(int i = 0; i < nops; i++) {
+		bitmap_release(bm, victims[i]);
+		check += bitmap_alloc(bm);
+	}
+	t = now() - t;
+	bitmap_destroy(bm);
+	if(check < 0) printf("unreachable\n");
+	return t / nops * 1e9;
+}/*}}}*/
+
+static double bench_linear(unsigned n, const unsigned *victims, int nops)/*{{{*/
+{
+	struct slot *v = calloc(n, sizeof(*v));
+	if(!v) exit(EXIT_FAILURE);
+	for(unsigned i = 0; i < n; i++) v[i].used = 1;
+	long check = 0;
+	double t = now();
+	for(int i = 0; i < nops; i++) {
+		v[victims[i]].used = 0;
+		check += linear_alloc(v, n);
+	}
+	t = now() - t;
+	free(v);
+	if(check < 0) printf("unreachable\n");
+	return t / nops * 1e9;
+}/*}}}*/
+
+int main(void)/*{{{*/
+{
+	static const unsigned sizes[] = {64, 256, 1024, 4096, 65536, 1 << 20};
+	int nops = 200000;
+	unsigned *victims = malloc(nops * sizeof(*victims));
+	if(!victims) exit(EXIT_FAILURE);
+
+	printf("%8s %14s %14s\n", "slots", "bitmap ns/op", "linear ns/op");
+	for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		unsigned n = sizes[s];
+		srand(1);
+		for(int i = 0; i < nops; i++) victims[i] = (unsigned)rand() % n;
+		/* The linear scan gets slow fast; fewer rounds keep it short. */
+		int nlinear = n > 4096 ? nops / 100 : nops;
+		printf("%8u %14.1f %14.1f\n", n, bench_bitmap(n, victims, nops),
+				bench_linear(n, victims, nlinear));
+	}
+	free(victims);
+	return 0;
+}/*}}}*/
@@ -0,0 +1,428 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <linux/io_uring.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "diskio.h"
+#include "log.h"
+
+/*****************************************************************************
+ * engine state and helpers
+ ****************************************************************************/
+#define DISKIO_NTHREADS 4
+/* user_data of the NOP that tells the reaper to exit. */
+#define DISKIO_STOP UINT64_MAX
+
+struct diskio_op {
+	int block;
+	int write;
+};
+
+/* `fbusy`, `bbusy`, `ops`, `inflight`, the pool queue and the submission
+ * ring tail are protected by `lock`.  The completion ring is only touched
+ * by the reaper. */
+struct diskio {
+	int fd;
+	int engine;
+	char *pmem;
+	int nframes;
+	size_t pagesize;
+	pthread_mutex_t lock;
+	pthread_cond_t done;        /* a transfer completed */
+	uint8_t *fbusy;
+	uint8_t *bbusy;
+	struct diskio_op *ops;      /* transfer in flight, indexed by frame */
+	int inflight;
+	int stopping;
+	/* DISKIO_THREADS: frames waiting for a thread, in order. */
+	pthread_cond_t work;
+	int *queue;
+	int qhead;
+	int qlen;
+	pthread_t threads[DISKIO_NTHREADS];
+	int nthreads;
+	/* DISKIO_URING. */
+	int ring_fd;
+	void *sq_map;
+	size_t sq_mapsz;
+	void *cq_map;
+	size_t cq_mapsz;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned pending;           /* queued in the ring, not yet submitted */
+	pthread_t reaper;
+};
+
+/* Copies a page between =mem= and block =block=, starting =done= bytes
+ * in. */
+static void diskio_copy(struct diskio *d, char *mem, int block, int write,/*{{{*/
+		size_t done)
+{
+	off_t off = (off_t)block * d->pagesize;
+	while(done < d->pagesize) {
+		size_t len = d->pagesize - done;
+		ssize_t n = write ? pwrite(d->fd, mem + done, len, off + done) :
+				pread(d->fd, mem + done, len, off + done);
+		if(n == -1 && errno == EINTR) continue;
+		if(n <= 0) logea(__FILE__, __LINE__, "swap I/O failed");
+		done += n;
+	}
+}/*}}}*/
+
+/* Copies the page between the frame and block of =frame='s transfer,
+ * starting =done= bytes in. */
+static void diskio_rw(struct diskio *d, int frame, size_t done)/*{{{*/
+{
+	struct diskio_op *op = &d->ops[frame];
+	diskio_copy(d, d->pmem + (size_t)frame * d->pagesize, op->block,
+			op->write, done);
+}/*}}}*/
+
+/* Called with d->lock. */
+static void diskio_complete(struct diskio *d, int frame)/*{{{*/
+{
+	d->fbusy[frame] = 0;
+	d->bbusy[d->ops[frame].block] = 0;
+	d->inflight--;
+	pthread_cond_broadcast(&d->done);
+}/*}}}*/
+
+static int uring_enter(int fd, unsigned submit, unsigned wait)/*{{{*/
+{
+	return syscall(__NR_io_uring_enter, fd, submit, wait,
+			wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}/*}}}*/
+
+/* Called with d->lock. */
+static void uring_submit(struct diskio *d)/*{{{*/
+{
+	while(d->pending > 0) {
+		int n = uring_enter(d->ring_fd, d->pending, 0);
+		if(n == -1 && (errno == EINTR || errno == EAGAIN)) continue;
+		if(n == -1) logea(__FILE__, __LINE__, "io_uring_enter");
+		d->pending -= n;
+	}
+}/*}}}*/
+
+/* Called with d->lock. */
+static void uring_queue(struct diskio *d, int frame, uint64_t user_data)/*{{{*/
+{
+	unsigned tail = *d->sq_tail;
+	unsigned idx = tail & d->sq_mask;
+	struct io_uring_sqe *sqe = &d->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	if(user_data == DISKIO_STOP) {
+		sqe->opcode = IORING_OP_NOP;
+	} else {
+		struct diskio_op *op = &d->ops[frame];
+		sqe->opcode = op->write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = d->fd;
+		sqe->addr = (uintptr_t)(d->pmem + (size_t)frame * d->pagesize);
+		sqe->len = d->pagesize;
+		sqe->off = (uint64_t)op->block * d->pagesize;
+	}
+	sqe->user_data = user_data;
+	d->sq_array[idx] = idx;
+	__atomic_store_n(d->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	d->pending++;
+}/*}}}*/
+
+static void * uring_reaper(void *arg)/*{{{*/
+{
+	struct diskio *d = arg;
+	for(;;) {
+		unsigned head = *d->cq_head;
+		unsigned tail = __atomic_load_n(d->cq_tail, __ATOMIC_ACQUIRE);
+		if(head == tail) {
+			uring_enter(d->ring_fd, 0, 1);
+			continue;
+		}
+		int stop = 0;
+		for(; head != tail; head++) {
+			struct io_uring_cqe *cqe = &d->cqes[head & d->cq_mask];
+			if(cqe->user_data == DISKIO_STOP) {
+				stop = 1;
+				continue;
+			}
+			int frame = (int)cqe->user_data;
+			if(cqe->res < 0) {
+				errno = -cqe->res;
+				logea(__FILE__, __LINE__, "swap I/O failed");
+			}
+			/* Short transfers are finished here. */
+			if((size_t)cqe->res < d->pagesize) diskio_rw(d, frame, cqe->res);
+			pthread_mutex_lock(&d->lock);
+			diskio_complete(d, frame);
+			pthread_mutex_unlock(&d->lock);
+		}
+		__atomic_store_n(d->cq_head, head, __ATOMIC_RELEASE);
+		if(stop) return NULL;
+	}
+}/*}}}*/
+
+static int uring_init(struct diskio *d)/*{{{*/
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	/* One entry per frame plus the stop NOP. */
+	d->ring_fd = syscall(__NR_io_uring_setup, d->nframes + 1, &p);
+	if(d->ring_fd == -1) return -1;
+
+	d->sq_mapsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	d->cq_mapsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(d->cq_mapsz > d->sq_mapsz) d->sq_mapsz = d->cq_mapsz;
+		d->cq_mapsz = d->sq_mapsz;
+	}
+	d->sq_map = mmap(NULL, d->sq_mapsz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, d->ring_fd, IORING_OFF_SQ_RING);
+	if(d->sq_map == MAP_FAILED) goto out_close;
+	d->cq_map = d->sq_map;
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		d->cq_map = mmap(NULL, d->cq_mapsz, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, d->ring_fd, IORING_OFF_CQ_RING);
+		if(d->cq_map == MAP_FAILED) goto out_sq;
+	}
+	d->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	d->sqes = mmap(NULL, d->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, d->ring_fd, IORING_OFF_SQES);
+	if(d->sqes == MAP_FAILED) goto out_cq;
+
+	char *sq = d->sq_map, *cq = d->cq_map;
+	d->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	d->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	d->sq_array = (unsigned *)(sq + p.sq_off.array);
+	d->cq_head = (unsigned *)(cq + p.cq_off.head);
+	d->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	d->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	d->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	d->pending = 0;
+	if(pthread_create(&d->reaper, NULL, uring_reaper, d)) goto out_sqes;
+	return 0;
+
+out_sqes:
+	munmap(d->sqes, d->sqes_sz);
+out_cq:
+	if(d->cq_map != d->sq_map) munmap(d->cq_map, d->cq_mapsz);
+out_sq:
+	munmap(d->sq_map, d->sq_mapsz);
+out_close:
+	close(d->ring_fd);
+	return -1;
+}/*}}}*/
+
+static void * pool_thread(void *arg)/*{{{*/
+{
+	struct diskio *d = arg;
+	pthread_mutex_lock(&d->lock);
+	for(;;) {
+		while(d->qlen == 0 && !d->stopping)
+			pthread_cond_wait(&d->work, &d->lock);
+		if(d->qlen == 0) break;
+		int frame = d->queue[d->qhead];
+		d->qhead = (d->qhead + 1) % d->nframes;
+		d->qlen--;
+		pthread_mutex_unlock(&d->lock);
+		diskio_rw(d, frame, 0);
+		pthread_mutex_lock(&d->lock);
+		diskio_complete(d, frame);
+	}
+	pthread_mutex_unlock(&d->lock);
+	return NULL;
+}/*}}}*/
+
+static int pool_init(struct diskio *d)/*{{{*/
+{
+	d->queue = malloc(d->nframes * sizeof(d->queue[0]));
+	if(!d->queue) return -1;
+	d->qhead = 0;
+	d->qlen = 0;
+	pthread_cond_init(&d->work, NULL);
+	for(d->nthreads = 0; d->nthreads < DISKIO_NTHREADS; d->nthreads++) {
+		if(pthread_create(&d->threads[d->nthreads], NULL, pool_thread, d))
+			break;
+	}
+	if(d->nthreads > 0) return 0;
+	pthread_cond_destroy(&d->work);
+	free(d->queue);
+	return -1;
+}/*}}}*/
+
+/* Waits until =frame= and =block=, each unless -1, are idle.  Called
+ * with d->lock. */
+static void diskio_wait_locked(struct diskio *d, int frame, int block)/*{{{*/
+{
+	while((frame >= 0 && d->fbusy[frame]) ||
+			(block >= 0 && d->bbusy[block])) {
+		if(d->engine == DISKIO_URING) uring_submit(d);
+		pthread_cond_wait(&d->done, &d->lock);
+	}
+}/*}}}*/
+
+/* Starts a transfer, or does it on the calling thread if =now= is set or
+ * the engine is DISKIO_SYNC. */
+static void diskio_start(struct diskio *d, int frame, int block, int write,/*{{{*/
+		int now)
+{
+	pthread_mutex_lock(&d->lock);
+	diskio_wait_locked(d, frame, block);
+	d->fbusy[frame] = 1;
+	d->bbusy[block] = 1;
+	d->ops[frame].block = block;
+	d->ops[frame].write = write;
+	d->inflight++;
+	switch(now ? DISKIO_SYNC : d->engine) {
+	case DISKIO_URING:
+		uring_queue(d, frame, frame);
+		break;
+	case DISKIO_THREADS:
+		d->queue[(d->qhead + d->qlen) % d->nframes] = frame;
+		d->qlen++;
+		pthread_cond_signal(&d->work);
+		break;
+	default:
+		pthread_mutex_unlock(&d->lock);
+		diskio_rw(d, frame, 0);
+		pthread_mutex_lock(&d->lock);
+		diskio_complete(d, frame);
+	}
+	pthread_mutex_unlock(&d->lock);
+}/*}}}*/
+
+/*****************************************************************************
+ * diskio function implementations
+ ****************************************************************************/
+struct diskio * diskio_create(int fd, int engine, char *pmem, int nframes, /* {{{ */
+		int nblocks, size_t pagesize)
+{
+	struct diskio *d = calloc(1, sizeof(*d));
+	if(!d) return NULL;
+	d->fd = fd;
+	d->pmem = pmem;
+	d->nframes = nframes;
+	d->pagesize = pagesize;
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_cond_init(&d->done, NULL);
+	d->fbusy = calloc(nframes, 1);
+	d->bbusy = calloc(nblocks, 1);
+	d->ops = calloc(nframes, sizeof(d->ops[0]));
+	if(!d->fbusy || !d->bbusy || !d->ops) goto out_free;
+
+	/* Engine threads leave signals to the caller's threads. */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	d->engine = engine;
+	if(d->engine == DISKIO_URING && uring_init(d) == -1)
+		d->engine = DISKIO_THREADS;
+	if(d->engine == DISKIO_THREADS && pool_init(d) == -1)
+		d->engine = DISKIO_SYNC;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return d;
+
+out_free:
+	free(d->fbusy);
+	free(d->bbusy);
+	free(d->ops);
+	free(d);
+	return NULL;
+} /* }}} */
+
+void diskio_destroy(struct diskio *d) /* {{{ */
+{
+	pthread_mutex_lock(&d->lock);
+	while(d->inflight > 0) {
+		if(d->engine == DISKIO_URING) uring_submit(d);
+		pthread_cond_wait(&d->done, &d->lock);
+	}
+	d->stopping = 1;
+	if(d->engine == DISKIO_URING) {
+		uring_queue(d, 0, DISKIO_STOP);
+		uring_submit(d);
+	}
+	if(d->engine == DISKIO_THREADS) pthread_cond_broadcast(&d->work);
+	pthread_mutex_unlock(&d->lock);
+
+	if(d->engine == DISKIO_URING) {
+		pthread_join(d->reaper, NULL);
+		munmap(d->sqes, d->sqes_sz);
+		if(d->cq_map != d->sq_map) munmap(d->cq_map, d->cq_mapsz);
+		munmap(d->sq_map, d->sq_mapsz);
+		close(d->ring_fd);
+	} else if(d->engine == DISKIO_THREADS) {
+		for(int i = 0; i < d->nthreads; i++)
+			pthread_join(d->threads[i], NULL);
+		pthread_cond_destroy(&d->work);
+		free(d->queue);
+	}
+	pthread_mutex_destroy(&d->lock);
+	pthread_cond_destroy(&d->done);
+	free(d->fbusy);
+	free(d->bbusy);
+	free(d->ops);
+	free(d);
+} /* }}} */
+
+int diskio_engine(const struct diskio *d) /* {{{ */
+{
+	return d->engine;
+} /* }}} */
+
+void diskio_read(struct diskio *d, int block, int frame) /* {{{ */
+{
+	diskio_start(d, frame, block, 0, 0);
+} /* }}} */
+
+void diskio_write(struct diskio *d, int frame, int block) /* {{{ */
+{
+	diskio_start(d, frame, block, 1, 0);
+} /* }}} */
+
+void diskio_transfer(struct diskio *d, int frame, int block, int write) /* {{{ */
+{
+	diskio_start(d, frame, block, write, 1);
+} /* }}} */
+
+void diskio_write_buf(struct diskio *d, const char *buf, int block) /* {{{ */
+{
+	pthread_mutex_lock(&d->lock);
+	diskio_wait_locked(d, -1, block);
+	d->bbusy[block] = 1;
+	pthread_mutex_unlock(&d->lock);
+	diskio_copy(d, (char *)buf, block, 1, 0);
+	pthread_mutex_lock(&d->lock);
+	d->bbusy[block] = 0;
+	pthread_cond_broadcast(&d->done);
+	pthread_mutex_unlock(&d->lock);
+} /* }}} */
+
+void diskio_submit(struct diskio *d) /* {{{ */
+{
+	if(d->engine != DISKIO_URING) return;
+	pthread_mutex_lock(&d->lock);
+	uring_submit(d);
+	pthread_mutex_unlock(&d->lock);
+} /* }}} */
+
+void diskio_wait_frame(struct diskio *d, int frame) /* {{{ */
+{
+	pthread_mutex_lock(&d->lock);
+	diskio_wait_locked(d, frame, -1);
+	pthread_mutex_unlock(&d->lock);
+} /* }}} */
@@ -0,0 +1,65 @@
+/* This module moves pages between physical memory frames and a swap file
+ * without blocking the caller.  Transfers are started with diskio_read()
+ * and diskio_write() and complete in the background, on one of three
+ * engines:
+ *
+ * - DISKIO_URING queues transfers on an io_uring submission ring; a
+ *   reaper thread collects completions.  Transfers queued by any thread
+ *   go to the kernel together on the next diskio_submit().
+ * - DISKIO_THREADS hands transfers to a small pool of threads doing
+ *   pread/pwrite, for kernels without io_uring.
+ * - DISKIO_SYNC does each transfer before returning.
+ *
+ * Transfers are ordered per frame and per block: a transfer naming a frame
+ * or block that has one in flight first waits for it.  Callers that touch
+ * a frame by other means (mapping it, filling it) call diskio_wait_frame()
+ * first.  At most one transfer per frame is in flight, which bounds the
+ * queues. */
+
+#ifndef __DISKIO_HEADER__
+#define __DISKIO_HEADER__
+
+#include <stddef.h>
+
+#define DISKIO_SYNC 0
+#define DISKIO_THREADS 1
+#define DISKIO_URING 2
+
+struct diskio;
+
+/* This function creates an engine moving =pagesize=-byte pages between
+ * the =nframes= frames at =pmem= and the =nblocks= blocks of file =fd=.
+ * If =engine= is DISKIO_URING and io_uring is not available, falls back
+ * to DISKIO_THREADS.  Returns NULL on error. */
+struct diskio * diskio_create(int fd, int engine, char *pmem, int nframes,
+		int nblocks, size_t pagesize);
+
+/* This function waits for all transfers and frees the engine. */
+void diskio_destroy(struct diskio *d);
+
+/* This function returns the engine in use. */
+int diskio_engine(const struct diskio *d);
+
+/* These functions start copying block =block= into frame =frame= (read)
+ * or frame =frame= into block =block= (write).  With DISKIO_URING the
+ * transfer may sit in the submission ring until diskio_submit(). */
+void diskio_read(struct diskio *d, int block, int frame);
+void diskio_write(struct diskio *d, int frame, int block);
+
+/* This function copies frame =frame= to block =block= if =write= is set,
+ * or the block to the frame otherwise, on the calling thread.  It is
+ * cheaper than starting a transfer and waiting for it. */
+void diskio_transfer(struct diskio *d, int frame, int block, int write);
+
+/* This function copies page =buf= to block =block= on the calling
+ * thread, after earlier transfers on the block.  =buf= must be aligned
+ * to the page size if the file was opened with O_DIRECT. */
+void diskio_write_buf(struct diskio *d, const char *buf, int block);
+
+/* This function passes queued transfers to the kernel. */
+void diskio_submit(struct diskio *d);
+
+/* This function waits until no transfer on =frame= is in flight. */
+void diskio_wait_frame(struct diskio *d, int frame);
+
+#endif
@@ -0,0 +1,104 @@
+/* Microbenchmark for the diskio engines.  Writes BATCH random blocks
+ * from as many frames, submits them and waits for all, then reads BATCH
+ * random blocks back the same way, for each engine in turn.  With -i the
+ * transfers are done inline with diskio_transfer() instead, as
+ * mmu_disk_read and mmu_disk_write do. */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "diskio.h"
+
+#define PAGESIZE 4096
+#define NFRAMES 256
+#define NBLOCKS 65536
+#define NPAGES 8000
+
+static const char *engine_names[] = {"sync", "threads", "uring"};
+static unsigned seed = 1;
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}/*}}}*/
+
+static int random_block(void)/*{{{*/
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % NBLOCKS;
+}/*}}}*/
+
+static double run_batch(struct diskio *d, int batch, int inl, int write)/*{{{*/
+{
+	double t = now();
+	for(int i = 0; i < batch; i++) {
+		int block = random_block();
+		if(inl) diskio_transfer(d, i, block, write);
+		else if(write) diskio_write(d, i, block);
+		else diskio_read(d, block, i);
+	}
+	diskio_submit(d);
+	for(int i = 0; i < batch; i++) diskio_wait_frame(d, i);
+	return now() - t;
+}/*}}}*/
+
+static void usage(char **argv)/*{{{*/
+{
+	printf("usage: %s [-d] [-i] [-b BATCH] SWAPFILE\n", argv[0]);
+	exit(EXIT_FAILURE);
+}/*}}}*/
+
+int main(int argc, char **argv)/*{{{*/
+{
+	int direct = 0, inl = 0, batch = 16;
+	int opt;
+	while((opt = getopt(argc, argv, "dib:")) != -1) {
+		switch(opt) {
+		case 'd': direct = 1; break;
+		case 'i': inl = 1; break;
+		case 'b': batch = atoi(optarg); break;
+		default: usage(argv);
+		}
+	}
+	if(argc - optind != 1 || batch <= 0 || batch > NFRAMES) usage(argv);
+	const char *fn = argv[optind];
+
+	char *pmem = mmap(NULL, NFRAMES * PAGESIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(pmem == MAP_FAILED) exit(EXIT_FAILURE);
+	memset(pmem, 7, NFRAMES * PAGESIZE);
+	int fd = open(fn, O_RDWR | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0),
+			0600);
+	if(fd == -1 || ftruncate(fd, (off_t)NBLOCKS * PAGESIZE)) {
+		perror(fn);
+		exit(EXIT_FAILURE);
+	}
+
+	for(int e = DISKIO_SYNC; e <= DISKIO_URING; e++) {
+		struct diskio *d = diskio_create(fd, e, pmem, NFRAMES, NBLOCKS,
+				PAGESIZE);
+		if(!d) exit(EXIT_FAILURE);
+		int rounds = NPAGES / batch;
+		double tw = 0, tr = 0;
+		for(int r = 0; r < rounds; r++) {
+			tw += run_batch(d, batch, inl, 1);
+			tr += run_batch(d, batch, inl, 0);
+		}
+		printf("%s%s batch %d%s: write %.1f us/page, read %.1f us/page\n",
+				engine_names[diskio_engine(d)], direct ? " O_DIRECT" : "",
+				batch, inl ? " inline" : "",
+				tw / rounds / batch * 1e6, tr / rounds / batch * 1e6);
+		diskio_destroy(d);
+	}
+	close(fd);
+	unlink(fn);
+	return 0;
+}/*}}}*/
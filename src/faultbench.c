@@ -0,0 +1,321 @@
+/* Client driver for the fault-path scenarios in bench.sh.  Runs one
+ * access pattern against the mmu and prints its cost to stdout.
+ *
+ * cycle  writes one byte to each of NPAGES pages in turn, LOOPS times;
+ *        with fewer frames than pages every access faults.
+ * seq    reads the first byte of each of NPAGES fresh pages in order,
+ *        as a sequential scan does.
+ * sweep  fills NPAGES pages, then sweeps them LOOPS times writing one
+ *        byte per page and LOOPS times reading one; with fewer frames
+ *        than pages the first sweep evicts dirty pages, the second
+ *        clean ones.
+ * sparse writes one byte to 16 of NPAGES fresh pages, spread evenly,
+ *        then reads all pages LOOPS times; the other pages never hold
+ *        anything but the zero fill.
+ * refill writes '0' over NPAGES pages twice, so they still hold only
+ *        the zero fill, then real data into every other page, and
+ *        checks the contents.
+ * shared fills NPAGES pages with the same data in every process, waits
+ *        100 ms, then reads them LOOPS times and writes one byte, as
+ *        processes sharing a library would; checks the contents.
+ *
+ * cold   writes one byte to each of NPAGES fresh pages, split among
+ *        NTHREADS threads, so every access is a first fault.
+ * mixed  NTHREADS threads each walk their share of NPAGES pages LOOPS
+ *        times, reading and writing each page and calling uvm_syslog on
+ *        it every 8th pass.
+ * extend only creates the uvm and allocates NPAGES pages, one
+ *        uvm_extend at a time or, with -b, in one uvm_extend_n; run it
+ *        with -p to time process setup.
+ * release allocates NPAGES pages with uvm_extend_n, writes each, and
+ *        gives them back one uvm_release at a time or, with -b, in one
+ *        call, LOOPS times; checks that the addresses are reused.
+ *
+ * With -p NPROCS, NPROCS processes run the pattern at the same time. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "uvm.h"
+
+static int npages = 3;
+static int loops = 10000;
+static int nprocs = 1;
+static int nthreads = 1;
+static int bulk = 0;
+static char **pages;
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}/*}}}*/
+
+static void extend_pages(void)/*{{{*/
+{
+	pages = malloc(npages * sizeof(pages[0]));
+	if(!pages) exit(EXIT_FAILURE);
+	for(int i = 0; i < npages; i++) {
+		pages[i] = uvm_extend();
+		if(!pages[i]) {
+			fprintf(stderr, "uvm_extend failed at page %d\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+}/*}}}*/
+
+static void run_cycle(void)/*{{{*/
+{
+	extend_pages();
+	long n = (long)loops * npages;
+	double t = now();
+	for(long i = 0; i < n; i++) pages[i % npages][0]++;
+	t = now() - t;
+	printf("cycle %d pages: %.1f us/access\n", npages, t / n * 1e6);
+}/*}}}*/
+
+static void run_seq(void)/*{{{*/
+{
+	extend_pages();
+	volatile char sink;
+	double t = now();
+	for(int i = 0; i < npages; i++) sink = pages[i][0];
+	t = now() - t;
+	(void)sink;
+	printf("seq %d pages: %.1f us/page\n", npages, t / npages * 1e6);
+}/*}}}*/
+
+static void run_sweep(void)/*{{{*/
+{
+	extend_pages();
+	for(int i = 0; i < npages; i++) memset(pages[i], i, sysconf(_SC_PAGESIZE));
+	long n = (long)loops * npages;
+	double t = now();
+	for(long i = 0; i < n; i++) pages[i % npages][0]++;
+	double tdirty = now() - t;
+	volatile char sink;
+	t = now();
+	for(long i = 0; i < n; i++) sink = pages[i % npages][0];
+	double tclean = now() - t;
+	(void)sink;
+	printf("sweep %d pages: dirty %.1f us/access, clean %.1f us/access\n",
+			npages, tdirty / n * 1e6, tclean / n * 1e6);
+}/*}}}*/
+
+static void run_sparse(void)/*{{{*/
+{
+	extend_pages();
+	int stride = npages > 16 ? npages / 16 : 1;
+	for(int i = 0; i < npages; i += stride) pages[i][0] = 'x';
+	long n = (long)loops * npages;
+	volatile char sink;
+	double t = now();
+	for(long i = 0; i < n; i++) sink = pages[i % npages][100];
+	t = now() - t;
+	(void)sink;
+	printf("sparse %d pages: %.1f us/read\n", npages, t / n * 1e6);
+}/*}}}*/
+
+static void run_refill(void)/*{{{*/
+{
+	extend_pages();
+	for(int pass = 0; pass < 2; pass++) {
+		for(int i = 0; i < npages; i++) pages[i][5] = '0';
+	}
+	for(int i = 0; i < npages; i += 2) pages[i][7] = 'a';
+	int bad = 0;
+	for(int i = 0; i < npages; i++) {
+		if(pages[i][5] != '0' || pages[i][7] != (i % 2 ? '0' : 'a')) bad++;
+	}
+	printf("refill %d pages: %d bad\n", npages, bad);
+	if(bad) exit(EXIT_FAILURE);
+}/*}}}*/
+
+static char shared_byte(int page, int off)/*{{{*/
+{
+	return (char)('A' + page + off / 64 % 7);
+}/*}}}*/
+
+static void run_shared(void)/*{{{*/
+{
+	extend_pages();
+	for(int i = 0; i < npages; i++) {
+		for(int k = 0; k < 4096; k += 64) pages[i][k] = shared_byte(i, k);
+	}
+	usleep(100000);
+	int bad = 0;
+	double t = now();
+	for(int r = 0; r < loops; r++) {
+		for(int i = 0; i < npages; i++) {
+			int off = r * 64 % 4096;
+			if(pages[i][off] != shared_byte(i, off)) bad++;
+		}
+	}
+	t = now() - t;
+	pages[0][1] = 'x';
+	if(pages[0][1] != 'x' || pages[0][0] != shared_byte(0, 0)) bad++;
+	printf("shared %d pages: %.1f us/read, %d bad\n", npages,
+			t / ((double)loops * npages) * 1e6, bad);
+	if(bad) exit(EXIT_FAILURE);
+}/*}}}*/
+
+static void *cold_thread(void *arg)/*{{{*/
+{
+	for(int i = (int)(long)arg; i < npages; i += nthreads) pages[i][0] = 1;
+	return NULL;
+}/*}}}*/
+
+static void run_threads(void *(*fn)(void *))/*{{{*/
+{
+	pthread_t *th = malloc(nthreads * sizeof(th[0]));
+	if(!th) exit(EXIT_FAILURE);
+	for(long k = 0; k < nthreads; k++) {
+		if(pthread_create(&th[k], NULL, fn, (void *)k)) exit(EXIT_FAILURE);
+	}
+	for(int k = 0; k < nthreads; k++) pthread_join(th[k], NULL);
+	free(th);
+}/*}}}*/
+
+static void run_cold(void)/*{{{*/
+{
+	extend_pages();
+	double t = now();
+	run_threads(cold_thread);
+	t = now() - t;
+	printf("cold %d pages, %d threads: %.1f us/fault\n", npages, nthreads,
+			t / npages * 1e6);
+}/*}}}*/
+
+static void *mixed_thread(void *arg)/*{{{*/
+{
+	volatile char sink;
+	for(int l = 0; l < loops; l++) {
+		for(int i = (int)(long)arg; i < npages; i += nthreads) {
+			sink = pages[i][0];
+			pages[i][1] = (char)l;
+			if(l % 8 == 0) uvm_syslog(pages[i], 4);
+		}
+	}
+	(void)sink;
+	return NULL;
+}/*}}}*/
+
+static void run_mixed(void)/*{{{*/
+{
+	extend_pages();
+	for(int i = 0; i < npages; i++) memset(pages[i], 'x', 8);
+	double t = now();
+	run_threads(mixed_thread);
+	t = now() - t;
+	printf("mixed %d pages, %d threads: %.0f accesses/s\n", npages, nthreads,
+			(double)npages * loops / t);
+}/*}}}*/
+
+static void run_extend(void)/*{{{*/
+{
+	if(!bulk) {
+		extend_pages();
+	} else if(!uvm_extend_n(npages, NULL)) {
+		fprintf(stderr, "uvm_extend_n failed\n");
+		exit(EXIT_FAILURE);
+	}
+}/*}}}*/
+
+static void run_release(void)/*{{{*/
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	double t = 0;
+	char *first = NULL;
+	for(int l = 0; l < loops; l++) {
+		char *base = uvm_extend_n(npages, NULL);
+		if(!base || (first && base != first)) {
+			fprintf(stderr, "uvm_extend_n did not reuse %p\n", first);
+			exit(EXIT_FAILURE);
+		}
+		first = base;
+		for(int i = 0; i < npages; i++) base[i * pagesize] = 'x';
+		double t0 = now();
+		if(bulk) {
+			if(uvm_release(base, npages)) exit(EXIT_FAILURE);
+		} else {
+			for(int i = npages - 1; i >= 0; i--) {
+				if(uvm_release(base + i * pagesize, 1)) exit(EXIT_FAILURE);
+			}
+		}
+		t += now() - t0;
+	}
+	printf("release %d pages%s: %.1f us/page\n", npages,
+			bulk ? " at once" : "", t / ((double)loops * npages) * 1e6);
+}/*}}}*/
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} modes[] = {
+	{"cycle", run_cycle},
+	{"seq", run_seq},
+	{"sweep", run_sweep},
+	{"sparse", run_sparse},
+	{"refill", run_refill},
+	{"shared", run_shared},
+	{"cold", run_cold},
+	{"mixed", run_mixed},
+	{"extend", run_extend},
+	{"release", run_release},
+};
+#define NMODES (int)(sizeof(modes) / sizeof(modes[0]))
+
+static void usage(char **argv)/*{{{*/
+{
+	printf("usage: %s [-n NPAGES] [-l LOOPS] [-p NPROCS] [-t NTHREADS] [-b] MODE\n", argv[0]);
+	printf("modes:");
+	for(int i = 0; i < NMODES; i++) printf(" %s", modes[i].name);
+	printf("\n");
+	exit(EXIT_FAILURE);
+}/*}}}*/
+
+static void run_mode(int mode)/*{{{*/
+{
+	uvm_create();
+	modes[mode].run();
+	exit(EXIT_SUCCESS);
+}/*}}}*/
+
+int main(int argc, char **argv)/*{{{*/
+{
+	int opt;
+	while((opt = getopt(argc, argv, "n:l:p:t:b")) != -1) {
+		switch(opt) {
+		case 'n': npages = atoi(optarg); break;
+		case 'l': loops = atoi(optarg); break;
+		case 'p': nprocs = atoi(optarg); break;
+		case 't': nthreads = atoi(optarg); break;
+		case 'b': bulk = 1; break;
+		default: usage(argv);
+		}
+	}
+	if(argc - optind != 1 || npages <= 0 || loops < 0 || nprocs <= 0 ||
+			nthreads <= 0)
+		usage(argv);
+	int mode = 0;
+	while(mode < NMODES && strcmp(modes[mode].name, argv[optind])) mode++;
+	if(mode == NMODES) usage(argv);
+
+	if(nprocs == 1) run_mode(mode);
+	for(int i = 0; i < nprocs; i++) {
+		pid_t pid = fork();
+		if(pid == -1) exit(EXIT_FAILURE);
+		if(pid == 0) run_mode(mode);
+	}
+	int failed = 0, status;
+	while(wait(&status) > 0) {
+		if(!WIFEXITED(status) || WEXITSTATUS(status)) failed = 1;
+	}
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}/*}}}*/
@@ -1,79 +1,172 @@
+#define _GNU_SOURCE /* memfd_create */
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
+#include <linux/fs.h> /* BLKGETSIZE64 */
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "bitmap.h"
+#include "diskio.h"
 #include "log.h"
+#include "mmutrace.h"
+#include "pidtab.h"
+#include "zswap.h"
 
+#include "mmu.h"
 #include "pager.h"
 #include "mmuproto.h"
 
 #define MMU_MAX_EVENTS 32
-#define MMU_MAX_SOCK 1024
-
-
-pid_t id2pid[UINT8_MAX];
-uint8_t nextid = 0;
+#define MMU_CLIENTS_HINT 256
+#define MMU_DEFAULT_WORKERS 4
+#define MMU_MAX_WORKERS 256
+#define MMU_MAX_BLOCKS (1 << 22)
+/* Largest request a client may send and per-client input buffer size. */
+#define MMU_MSG_MAX 32
+#define MMU_INBUF_SIZE 256
+/* Largest binary trace; the file is sparse and trimmed at shutdown. */
+#define MMU_TRACE_MAX_BYTES (1ULL << 32)
 
 /****************************************************************************
  * structure definitions and static variables
  ***************************************************************************/
+/* A complete request read from a client socket.  Messages with `len`
+ * zero are internal and tell a worker to tear the client down. */
+struct mmu_msg {/*{{{*/
+	struct mmu_msg *next;
+	uint32_t len;
+	char data[MMU_MSG_MAX];
+};/*}}}*/
 struct mmu_data {/*{{{*/
 	int running;
 	int npages;
+	int nblocks;
 	char *pmem;
+	/* Swap space: blocks live in `disk` unless a swap file or device
+	 * was given, in which case they are accessed through `disk_fd`. */
 	char *disk;
+	int disk_fd;
+	struct diskio *dio;
+	/* Compressed pages, consulted before the swap blocks. */
+	struct zswap *zswap;
 	char *pmem_fn;
 	int pmem_fd;
+	int pmem_memfd; /* pmem_fn is a /proc path, not a file to unlink */
 	int sock;
-	struct mmu_client * sock2client[MMU_MAX_SOCK];
+	int epfd;
+	/* Worker pool.  Clients with pending requests wait in the run
+	 * queue.  Tagged requests (EXTEND, SYSLOG, SEGV) from one client
+	 * may be served by several workers at once; any other request
+	 * waits for those to finish and runs alone, so it is ordered with
+	 * everything around it.  The run queue and per-client request
+	 * queues are protected by `queue_lock`. */
+	int nworkers;
+	pthread_t *workers;
+	int stopping;
+	pthread_mutex_t queue_lock;
+	pthread_cond_t queue_cond;
+	struct mmu_client *runq_head;
+	struct mmu_client *runq_tail;
+	/* Client registry: `clients` lists every connection,
+	 * `pid2client` maps pids to clients and `ids` hands out the small
+	 * numeric ids printed in traces.  Ids are recycled when clients
+	 * exit.  All are protected by `clients_lock`. */
+	pthread_mutex_t clients_lock;
+	struct mmu_client *clients;
+	struct pidtab *pid2client;
+	struct bitmap *ids;
 };/*}}}*/
 struct mmu_client {/*{{{*/
-	int running;
 	int sock;
 	pid_t pid;
-	pthread_t thread;
+	int id;
+	int exited; /* EXIT_REQ served, pager state already released */
+	/* Input framing, only touched by the event loop thread. */
+	char inbuf[MMU_INBUF_SIZE];
+	size_t inlen;
+	/* Request queue, protected by `mmu->queue_lock`.  `nrunning` counts
+	 * workers serving the client and `serial` is set while one of them
+	 * serves an untagged request. */
+	struct mmu_msg *msgs_head;
+	struct mmu_msg *msgs_tail;
+	int scheduled;
+	int nrunning;
+	int serial;
+	struct mmu_client *runq_next;
+	/* REMAP_REQ and CHPROT_REQ acknowledgements are counted here by the
+	 * event loop.  The client acknowledges in order, so a handshake
+	 * waits until `acks` reaches the sequence number its message got
+	 * in `handshakes`.  `dead` is set when the connection is gone.
+	 * Protected by `lock`. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long acks;
+	int dead;
+	/* Serializes sends from workers and pager callbacks, and numbers
+	 * handshake messages in `handshakes`. */
+	pthread_mutex_t send_lock;
+	unsigned long handshakes;
+	/* Shared-memory transport (MMU_PROTO_SHM_REQ).  Once `shm` is set,
+	 * requests are read from it by `shm_reader` and replies are written
+	 * to it; the socket is only watched for EOF. */
+	struct mmu_proto_shm *shm;
+	pthread_t shm_reader;
+	struct mmu_client *prev;
+	struct mmu_client *next;
 };/*}}}*/
 static struct mmu_data *mmu = NULL;
 const char *pmem = NULL;
 static size_t PAGESIZE = 0;
 
+/* Command-line settings for the backing stores. */
+static struct {
+	int memfd;              /* pmem in a memfd instead of a file */
+	const char *swapfn;     /* swap file or device, NULL for memory */
+	int direct;             /* open swapfn with O_DIRECT */
+	int engine;             /* DISKIO_* engine for swapfn */
+	size_t zswap;           /* compressed pool budget, 0 for none */
+} opts = { 0, NULL, 0, DISKIO_URING, 0 };
+
 /****************************************************************************
  * static function declarations
  ***************************************************************************/
 static void mmu_destroy(void);
 static void mmu_client_destroy(struct mmu_client *c);
 static void mmu_shutdown_action(int signum, siginfo_t *si, void *context);
-static void mmu_accept_loop(void);
-static void * mmu_client_thread(void *vclient);
-
-int get_pid_id(pid_t pid) {
-	int i = 0;
-	for(; id2pid[i] != pid; i++);
-	return i;
-}
+static void mmu_event_loop(void);
+static void * mmu_worker_thread(void *unused);
+static int mmu_client_register(struct mmu_client *c);
+static void mmu_client_unregister(struct mmu_client *c);
 
 /****************************************************************************
  * initialization functions {{{
  ***************************************************************************/
-static void mmu_init(int npages, int nblocks);
+static void mmu_init(int npages, int nblocks, int nworkers);
 static void mmu_init_disk(int nblocks);
 static void mmu_init_pmem(int npages);
+static void mmu_init_diskio(void);
+static void mmu_init_zswap(void);
 static void mmu_init_sock(void);
 static void mmu_init_sigs(void);
+static void mmu_init_workers(int nworkers);
 
-void mmu_init(int npages, int nblocks)/*{{{*/
+void mmu_init(int npages, int nblocks, int nworkers)/*{{{*/
 {
 	PAGESIZE = sysconf(_SC_PAGESIZE);
 	assert(mmu == NULL);
@@ -81,35 +174,108 @@ void mmu_init(int npages, int nblocks)/*{{{*/
 	if(!mmu) logea(__FILE__, __LINE__, NULL);
 	mmu->running = 1;
 	mmu->npages = npages;
+	pthread_mutex_init(&mmu->clients_lock, NULL);
+	mmu->clients = NULL;
+	mmu->pid2client = pidtab_create(MMU_CLIENTS_HINT);
+	mmu->ids = bitmap_create(MMU_CLIENTS_HINT);
+	if(!mmu->pid2client || !mmu->ids) logea(__FILE__, __LINE__, NULL);
 
+	/* The swap file is opened first so a bad path fails before the
+	 * socket exists.  Then listen: clients that connect while we set up
+	 * wait in the backlog instead of failing. */
 	mmu_init_disk(nblocks);
-	mmu_init_pmem(npages);
 	mmu_init_sock();
+	mmu_init_pmem(npages);
+	mmu_init_diskio();
+	mmu_init_zswap();
 	mmu_init_sigs();
-	memset(mmu->sock2client, 0, MMU_MAX_SOCK*sizeof(mmu->sock2client[0]));
+	mmu_init_workers(nworkers);
 }/*}}}*/
 
 void mmu_init_disk(int nblocks)/*{{{*/
 {
-	size_t disksz = PAGESIZE * nblocks;
-	mmu->disk = malloc(disksz);
-	if(!mmu->disk) logea(__FILE__, __LINE__, NULL);
-	logd(LOG_INFO, "%s: %zu bytes in %d blocks\n", __func__, disksz, nblocks);
+	const char *swapfn = opts.swapfn;
+	size_t disksz = PAGESIZE * (size_t)nblocks;
+	mmu->nblocks = nblocks;
+	mmu->disk = NULL;
+	mmu->disk_fd = -1;
+	mmu->dio = NULL;
+	if(!swapfn) {
+		/* Only blocks that are written take up memory. */
+		mmu->disk = mmap(NULL, disksz, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(mmu->disk == MAP_FAILED) logea(__FILE__, __LINE__, NULL);
+		logd(LOG_INFO, "%s: %zu bytes in %d blocks\n", __func__, disksz,
+				nblocks);
+		return;
+	}
+
+	/* Frames and block offsets are page-aligned, so O_DIRECT works
+	 * wherever the filesystem allows it. */
+	int flags = O_RDWR | O_CREAT | O_CLOEXEC;
+	if(opts.direct) {
+		mmu->disk_fd = open(swapfn, flags | O_DIRECT, 0600);
+		if(mmu->disk_fd == -1 && errno == EINVAL)
+			fprintf(stderr, "%s: O_DIRECT not supported, using the page "
+					"cache\n", swapfn);
+	}
+	if(mmu->disk_fd == -1) mmu->disk_fd = open(swapfn, flags, 0600);
+	struct stat st;
+	if(mmu->disk_fd == -1 || fstat(mmu->disk_fd, &st) == -1) {
+		perror(swapfn);
+		exit(EXIT_FAILURE);
+	}
+	uint64_t size = st.st_size;
+	if(S_ISBLK(st.st_mode)) {
+		if(ioctl(mmu->disk_fd, BLKGETSIZE64, &size) == -1) {
+			perror(swapfn);
+			exit(EXIT_FAILURE);
+		}
+	} else if(size < disksz) {
+		/* Grow the file sparsely; untouched blocks take no space. */
+		if(ftruncate(mmu->disk_fd, disksz) == -1) {
+			perror(swapfn);
+			exit(EXIT_FAILURE);
+		}
+		size = disksz;
+	}
+	if(size < disksz) {
+		fprintf(stderr, "%s: %llu bytes, %zu needed\n", swapfn,
+				(unsigned long long)size, disksz);
+		exit(EXIT_FAILURE);
+	}
+	logd(LOG_INFO, "%s: %zu bytes in %d blocks on %s fd %d%s\n", __func__,
+			disksz, nblocks, swapfn, mmu->disk_fd,
+			(fcntl(mmu->disk_fd, F_GETFL) & O_DIRECT) ? " (direct)" : "");
 }/*}}}*/
 
 void mmu_init_pmem(int npages)/*{{{*/
 {
-	mmu->pmem_fn = strdup("mmu.pmem.img.XXXXXX");
-	if(mmu->pmem_fn == NULL) logea(__FILE__, __LINE__, NULL);
-	mmu->pmem_fd = mkstemp(mmu->pmem_fn);
-	if(mmu->pmem_fd == -1) logea(__FILE__, __LINE__, NULL);
+	mmu->pmem_memfd = opts.memfd;
+	if(opts.memfd) {
+		/* Clients open the memfd through our /proc entry. */
+		mmu->pmem_fd = memfd_create("mmu.pmem", MFD_CLOEXEC);
+		if(mmu->pmem_fd == -1) logea(__FILE__, __LINE__, NULL);
+		if(asprintf(&mmu->pmem_fn, "/proc/%d/fd/%d", (int)getpid(),
+				mmu->pmem_fd) == -1)
+			logea(__FILE__, __LINE__, NULL);
+	} else {
+		mmu->pmem_fn = strdup("mmu.pmem.img.XXXXXX");
+		if(mmu->pmem_fn == NULL) logea(__FILE__, __LINE__, NULL);
+		mmu->pmem_fd = mkstemp(mmu->pmem_fn);
+		if(mmu->pmem_fd == -1) logea(__FILE__, __LINE__, NULL);
+	}
 	logd(LOG_INFO, "%s: mmap fd %d path %s\n", __func__, mmu->pmem_fd,
 			mmu->pmem_fn);
 
+	/* Frames are zero-filled or read from disk before they are mapped,
+	 * so the initial contents do not matter.  Allocate the blocks up
+	 * front where the filesystem supports it, so running out of space
+	 * fails here instead of as SIGBUS in a client. */
 	size_t memsz = PAGESIZE * npages;
-	for(size_t i = 0; i < npages*PAGESIZE; ++i) {
-		write(mmu->pmem_fd, "z", 1);
-	}
+	if(ftruncate(mmu->pmem_fd, memsz) == -1) logea(__FILE__, __LINE__, NULL);
+	if(fallocate(mmu->pmem_fd, 0, 0, memsz) == -1 && errno != EOPNOTSUPP)
+		logea(__FILE__, __LINE__, NULL);
 
 	int prot = PROT_READ | PROT_WRITE;
 	mmu->pmem = mmap(NULL, memsz, prot, MAP_SHARED, mmu->pmem_fd, 0);
@@ -118,9 +284,45 @@ void mmu_init_pmem(int npages)/*{{{*/
 	logd(LOG_INFO, "%s: %zu bytes in %d pages\n", __func__, memsz, npages);
 }/*}}}*/
 
+void mmu_init_diskio(void)/*{{{*/
+{
+	if(mmu->disk_fd == -1) return;
+	mmu->dio = diskio_create(mmu->disk_fd, opts.engine, mmu->pmem,
+			mmu->npages, mmu->nblocks, PAGESIZE);
+	if(!mmu->dio) logea(__FILE__, __LINE__, NULL);
+	static const char *names[] = { "sync", "threads", "uring" };
+	logd(LOG_INFO, "%s: %s engine\n", __func__,
+			names[diskio_engine(mmu->dio)]);
+}/*}}}*/
+
+/* Writes a page spilled from the compressed pool to its block. */
+static void mmu_zswap_spill(void *arg, int block, const char *page)/*{{{*/
+{
+	(void)arg;
+	if(mmu->dio) diskio_write_buf(mmu->dio, page, block);
+	else memcpy(mmu->disk + (size_t)block*PAGESIZE, page, PAGESIZE);
+}/*}}}*/
+
+void mmu_init_zswap(void)/*{{{*/
+{
+	mmu->zswap = NULL;
+	if(!opts.zswap) return;
+	mmu->zswap = zswap_create(opts.zswap, mmu->nblocks, PAGESIZE,
+			mmu_zswap_spill, NULL);
+	if(!mmu->zswap) logea(__FILE__, __LINE__, NULL);
+	logd(LOG_INFO, "%s: %zu bytes\n", __func__, opts.zswap);
+}/*}}}*/
+
 void mmu_init_sock(void)/*{{{*/
 {
-	mmu->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	/* Each client holds one descriptor; use all we are allowed to. */
+	struct rlimit rl;
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	mmu->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
 	if(mmu->sock == -1)
 		logea(__FILE__, __LINE__, NULL);
 	struct sockaddr_un addr;
@@ -129,10 +331,18 @@ void mmu_init_sock(void)/*{{{*/
 	strcat(addr.sun_path, MMU_PROTO_UNIX_PATH);
 	if(bind(mmu->sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
 		logea(__FILE__, __LINE__, NULL);
-	if(listen(mmu->sock, 32) == -1)
+	if(listen(mmu->sock, 128) == -1)
 		logea(__FILE__, __LINE__, NULL);
 	logd(LOG_INFO, "%s: unix socket %d at %s\n", __func__, mmu->sock,
 			MMU_PROTO_UNIX_PATH);
+
+	mmu->epfd = epoll_create1(0);
+	if(mmu->epfd == -1) logea(__FILE__, __LINE__, NULL);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL; /* NULL marks the listening socket */
+	if(epoll_ctl(mmu->epfd, EPOLL_CTL_ADD, mmu->sock, &ev) == -1)
+		logea(__FILE__, __LINE__, NULL);
 }/*}}}*/
 
 void mmu_init_sigs(void)/*{{{*/
@@ -145,23 +355,96 @@ void mmu_init_sigs(void)/*{{{*/
 	logd(LOG_INFO, "%s: SIGINT triggers shutdown\n", __func__);
 }
 /*}}}*/
+
+void mmu_init_workers(int nworkers)/*{{{*/
+{
+	mmu->nworkers = nworkers;
+	mmu->stopping = 0;
+	mmu->runq_head = NULL;
+	mmu->runq_tail = NULL;
+	pthread_mutex_init(&mmu->queue_lock, NULL);
+	pthread_cond_init(&mmu->queue_cond, NULL);
+	mmu->workers = malloc(nworkers * sizeof(mmu->workers[0]));
+	if(!mmu->workers) logea(__FILE__, __LINE__, NULL);
+
+	/* Workers inherit a blocked SIGINT so the signal always interrupts
+	 * epoll_wait in the event loop thread. */
+	sigset_t set, old;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	for(int i = 0; i < nworkers; ++i) {
+		if(pthread_create(&mmu->workers[i], NULL, mmu_worker_thread, NULL))
+			logea(__FILE__, __LINE__, NULL);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	logd(LOG_INFO, "%s: %d workers\n", __func__, nworkers);
+}/*}}}*/
 /*}}}*/
 
 /****************************************************************************
  * shutdown functions {{{
  ***************************************************************************/
+/* Marks every client as gone.  Once the event loop stops nobody counts
+ * acknowledgements, so handshakes in flight, or started later by pager
+ * threads, must give up instead of waiting. */
+static void mmu_hangup_clients(void)/*{{{*/
+{
+	pthread_mutex_lock(&mmu->clients_lock);
+	for(struct mmu_client *c = mmu->clients; c; c = c->next) {
+		pthread_mutex_lock(&c->lock);
+		c->dead = 1;
+		pthread_cond_broadcast(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+	}
+	pthread_mutex_unlock(&mmu->clients_lock);
+}/*}}}*/
+
 void mmu_destroy(void)/*{{{*/
 {
 	logd(LOG_DEBUG, "%s: starting\n", __func__);
 	assert(mmu);
-	unlink(mmu->pmem_fn);
-	free(mmu->pmem_fn);
-	for(int i = 3; i < MMU_MAX_SOCK; ++i) {
-		if(!mmu->sock2client[i]) continue;
-		mmu_client_destroy(mmu->sock2client[i]);
+
+	/* Wake workers blocked in handshakes, then stop the pool. */
+	mmu_hangup_clients();
+	pthread_mutex_lock(&mmu->queue_lock);
+	mmu->stopping = 1;
+	pthread_cond_broadcast(&mmu->queue_cond);
+	pthread_mutex_unlock(&mmu->queue_lock);
+	for(int i = 0; i < mmu->nworkers; ++i)
+		pthread_join(mmu->workers[i], NULL);
+	free(mmu->workers);
+	/* Transfers still in flight touch pmem. */
+	if(mmu->dio) diskio_destroy(mmu->dio);
+	if(mmu->zswap) {
+		struct zswap_stats s;
+		zswap_get_stats(mmu->zswap, &s);
+		printf("zswap_stats stores %llu same %llu rejects %llu hits %llu "
+				"misses %llu spills %llu ratio %.2f pool_pages %llu "
+				"pool_bytes %llu\n", (unsigned long long)s.stores,
+				(unsigned long long)s.same, (unsigned long long)s.rejects,
+				(unsigned long long)s.hits, (unsigned long long)s.misses,
+				(unsigned long long)s.spills, s.packed_bytes ?
+				(double)s.stored_bytes / s.packed_bytes : 0.0,
+				(unsigned long long)s.npages,
+				(unsigned long long)s.pool_bytes);
+		fflush(stdout);
+		zswap_destroy(mmu->zswap);
 	}
+
+	if(!mmu->pmem_memfd) unlink(mmu->pmem_fn);
+	free(mmu->pmem_fn);
+	while(mmu->clients)
+		mmu_client_destroy(mmu->clients);
 	munmap(mmu->pmem, mmu->npages * PAGESIZE);
-	free(mmu->disk);
+	pidtab_destroy(mmu->pid2client);
+	bitmap_destroy(mmu->ids);
+	pthread_mutex_destroy(&mmu->clients_lock);
+	pthread_mutex_destroy(&mmu->queue_lock);
+	pthread_cond_destroy(&mmu->queue_cond);
+	if(mmu->disk) munmap(mmu->disk, PAGESIZE * (size_t)mmu->nblocks);
+	else close(mmu->disk_fd);
+	close(mmu->epfd);
 	close(mmu->sock);
 	unlink(MMU_PROTO_UNIX_PATH);
 	free(mmu);
@@ -178,82 +461,339 @@ void mmu_shutdown_action(int signum, siginfo_t *si, void *context)/*{{{*/
 /*}}}*/
 
 /****************************************************************************
- * main loop and client functions {{{
+ * event loop and worker pool {{{
  ***************************************************************************/
-void mmu_accept_loop(void)/*{{{*/
+static void mmu_accept(void);
+static void mmu_client_input(struct mmu_client *c);
+static void mmu_client_deliver(struct mmu_client *c, const char *buf,
+		size_t len);
+static void * mmu_shm_reader_thread(void *arg);
+static void mmu_runq_push(struct mmu_client *c);
+static int mmu_msg_tagged(const struct mmu_msg *m);
+static int mmu_client_runnable(const struct mmu_client *c);
+static void mmu_client_enqueue(struct mmu_client *c, const void *data,
+		uint32_t len);
+static void mmu_client_fail(struct mmu_client *c);
+static int mmu_client_send(struct mmu_client *c, const void *buf, size_t len);
+static int mmu_client_write(struct mmu_client *c, const void *buf, size_t len);
+static int mmu_client_dispatch(struct mmu_client *c, struct mmu_msg *m);
+
+/* Returns the size of client request `type`, or zero if `type` is not
+ * something clients may send. */
+static size_t mmu_proto_req_size(uint32_t type)/*{{{*/
 {
+	switch(type) {
+	case MMU_PROTO_CREATE_REQ: return sizeof(struct mmu_proto_create_req);
+	case MMU_PROTO_EXTEND_REQ: return sizeof(struct mmu_proto_extend_req);
+	case MMU_PROTO_EXTENDV_REQ: return sizeof(struct mmu_proto_extendv_req);
+	case MMU_PROTO_RELEASE_REQ: return sizeof(struct mmu_proto_release_req);
+	case MMU_PROTO_SYSLOG_REQ: return sizeof(struct mmu_proto_syslog_req);
+	case MMU_PROTO_SEGV_REQ: return sizeof(struct mmu_proto_segv_req);
+	case MMU_PROTO_REMAP_REQ: return sizeof(struct mmu_proto_remap_req);
+	case MMU_PROTO_CHPROT_REQ: return sizeof(struct mmu_proto_chprot_req);
+	case MMU_PROTO_CHPROTV_REQ: return sizeof(struct mmu_proto_chprotv_req);
+	case MMU_PROTO_EXIT_REQ: return sizeof(struct mmu_proto_exit_req);
+	case MMU_PROTO_SHM_REQ: return sizeof(struct mmu_proto_shm_req);
+	default: return 0;
+	}
+}/*}}}*/
+
+void mmu_event_loop(void)/*{{{*/
+{
+	/* SIGINT is only let through while we sleep in epoll_pwait, so it
+	 * cannot slip in between checking `running` and going to sleep. */
+	sigset_t set, waitset;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &set, &waitset);
+	sigdelset(&waitset, SIGINT);
+
+	struct epoll_event events[MMU_MAX_EVENTS];
 	while(mmu->running) {
-		struct sockaddr_un addr;
-		socklen_t addrlen = sizeof(addr);
-		logd(LOG_DEBUG, "%s: accepting connection\n", __func__);
-		int nsock = accept(mmu->sock, (struct sockaddr *)&addr, &addrlen);
-		if(nsock == -1) continue;
-		logd(LOG_DEBUG, "%s: sock %d\n", __func__, nsock);
-		logd(LOG_DEBUG, "%s: creating thread\n", __func__);
-		struct mmu_client *c = malloc(sizeof(*c));
-		if(!c) logea(__FILE__, __LINE__, NULL);
-		mmu->sock2client[nsock] = c;
-		c->running = 1;
-		c->sock = nsock;
-		c->pid = 0;
-		pthread_create(&c->thread, NULL, mmu_client_thread, c);
-		pthread_detach(c->thread);
+		int n = epoll_pwait(mmu->epfd, events, MMU_MAX_EVENTS, -1,
+				&waitset);
+		if(n == -1) continue; /* EINTR on shutdown */
+		for(int i = 0; i < n; ++i) {
+			if(events[i].data.ptr == NULL) mmu_accept();
+			else mmu_client_input(events[i].data.ptr);
+		}
 	}
 	logd(LOG_DEBUG, "%s: exiting\n", __func__);
 }/*}}}*/
 
-static void mmu_client_log(const struct mmu_client *c, const char *fname, const char *msg);
-static void mmu_client_create(struct mmu_client *c);
-static void mmu_client_extend(struct mmu_client *c);
-static void mmu_client_syslog(struct mmu_client *c);
-static void mmu_client_segv(struct mmu_client *c);
-static void mmu_client_exit(struct mmu_client *c);
+void mmu_accept(void)/*{{{*/
+{
+	struct sockaddr_un addr;
+	socklen_t addrlen = sizeof(addr);
+	int nsock = accept(mmu->sock, (struct sockaddr *)&addr, &addrlen);
+	if(nsock == -1) return;
+	logd(LOG_DEBUG, "%s: sock %d\n", __func__, nsock);
+	struct mmu_client *c = malloc(sizeof(*c));
+	if(!c) logea(__FILE__, __LINE__, NULL);
+	c->sock = nsock;
+	c->pid = 0;
+	c->id = -1;
+	c->exited = 0;
+	c->inlen = 0;
+	c->msgs_head = NULL;
+	c->msgs_tail = NULL;
+	c->scheduled = 0;
+	c->nrunning = 0;
+	c->serial = 0;
+	c->runq_next = NULL;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	c->acks = 0;
+	c->dead = 0;
+	pthread_mutex_init(&c->send_lock, NULL);
+	c->handshakes = 0;
+	c->shm = NULL;
+
+	pthread_mutex_lock(&mmu->clients_lock);
+	c->prev = NULL;
+	c->next = mmu->clients;
+	if(mmu->clients) mmu->clients->prev = c;
+	mmu->clients = c;
+	pthread_mutex_unlock(&mmu->clients_lock);
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if(epoll_ctl(mmu->epfd, EPOLL_CTL_ADD, nsock, &ev) == -1) {
+		loge(LOG_ERROR, __FILE__, __LINE__);
+		mmu_client_fail(c);
+		mmu_client_enqueue(c, NULL, 0);
+	}
+}/*}}}*/
 
-void * mmu_client_thread(void *vclient)/*{{{*/
+/* Reads whatever is available from `c` and splits it into messages.
+ * Clients on the shared-memory transport send nothing else over the
+ * socket, so for them we only get here on EOF. */
+void mmu_client_input(struct mmu_client *c)/*{{{*/
 {
-	struct mmu_client *c = vclient;
-	while(mmu->running && c->running) {
-		mmu_client_log(c, __func__, "recv");
+	ssize_t cnt = recv(c->sock, c->inbuf + c->inlen,
+			MMU_INBUF_SIZE - c->inlen, MSG_DONTWAIT);
+	if(cnt == -1 && (errno == EAGAIN || errno == EINTR)) return;
+	if(cnt <= 0 || c->shm) goto out_client;
+	c->inlen += cnt;
+
+	size_t off = 0;
+	while(c->inlen - off >= sizeof(uint32_t)) {
 		uint32_t type;
-		ssize_t cnt = recv(c->sock, &type, sizeof(type), MSG_PEEK);
-		if(!mmu->running || !c->running) {
-			mmu_client_log(c, __func__, "breaking loop");
-			break;
-		}
-		if(cnt != sizeof(type)) goto out_client;
-		switch(type) {
-		case MMU_PROTO_CREATE_REQ:
-			mmu_client_create(c);
-			break;
-		case MMU_PROTO_EXTEND_REQ:
-			mmu_client_extend(c);
-			break;
-		case MMU_PROTO_SYSLOG_REQ:
-			mmu_client_syslog(c);
-			break;
-		case MMU_PROTO_SEGV_REQ:
-			mmu_client_segv(c);
-			break;
-		case MMU_PROTO_REMAP_REQ:
-		case MMU_PROTO_CHPROT_REQ:
-			/* these messages are handled by the pager thread */
-			break;
-		case MMU_PROTO_EXIT_REQ:
-			mmu_client_exit(c);
-			break;
-		default:
-			mmu_client_log(c, __func__, "invalid message type");
+		memcpy(&type, c->inbuf + off, sizeof(type));
+		size_t len = mmu_proto_req_size(type);
+		if(len == 0) {
+			logd(LOG_DEBUG, "%s sock %d pid %d: invalid message type\n",
+					__func__, c->sock, (int)c->pid);
 			goto out_client;
-			break;
 		}
+		if(c->inlen - off < len) break;
+		mmu_client_deliver(c, c->inbuf + off, len);
+		off += len;
 	}
-	mmu_client_log(c, __func__, "finished");
-	free(c);
-	pthread_exit(NULL);
+	memmove(c->inbuf, c->inbuf + off, c->inlen - off);
+	c->inlen -= off;
+	return;
 
 	out_client:
-	mmu_client_destroy(c);
-	pthread_exit(NULL);
+	epoll_ctl(mmu->epfd, EPOLL_CTL_DEL, c->sock, NULL);
+	mmu_client_fail(c);
+	mmu_client_enqueue(c, NULL, 0);
+}/*}}}*/
+
+/* Handles one complete message from `c`.  Handshake acknowledgements are
+ * counted right here so pager callbacks waiting for them never depend on
+ * a worker being free; everything else goes to the client's request
+ * queue. */
+void mmu_client_deliver(struct mmu_client *c, const char *buf, size_t len)/*{{{*/
+{
+	uint32_t type;
+	memcpy(&type, buf, sizeof(type));
+	if(type == MMU_PROTO_REMAP_REQ || type == MMU_PROTO_CHPROT_REQ ||
+			type == MMU_PROTO_CHPROTV_REQ) {
+		pthread_mutex_lock(&c->lock);
+		c->acks++;
+		pthread_cond_broadcast(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+	} else {
+		mmu_client_enqueue(c, buf, len);
+	}
+}/*}}}*/
+
+/* Reads requests from the shared-memory ring of `arg`.  On errors we only
+ * fail the client: the event loop sees the socket EOF and queues the
+ * teardown, which joins this thread. */
+void * mmu_shm_reader_thread(void *arg)/*{{{*/
+{
+	struct mmu_client *c = arg;
+	struct ring *r = &c->shm->req;
+	char buf[MMU_MSG_MAX];
+	while(1) {
+		uint32_t type;
+		if(ring_read(r, &type, sizeof(type), 1) == -1) {
+			if(errno == ETIMEDOUT) continue;
+			break; /* closed by mmu_client_fail */
+		}
+		size_t len = mmu_proto_req_size(type);
+		if(len == 0 || type == MMU_PROTO_SHM_REQ) {
+			logd(LOG_DEBUG, "%s sock %d pid %d: invalid message type\n",
+					__func__, c->sock, (int)c->pid);
+			mmu_client_fail(c);
+			break;
+		}
+		int rc;
+		while((rc = ring_read(r, buf, len, 0)) == -1 && errno == ETIMEDOUT);
+		if(rc == -1) break;
+		mmu_client_deliver(c, buf, len);
+	}
+	return NULL;
+}/*}}}*/
+
+void mmu_client_enqueue(struct mmu_client *c, const void *data, uint32_t len)/*{{{*/
+{
+	struct mmu_msg *m = malloc(sizeof(*m));
+	if(!m) logea(__FILE__, __LINE__, NULL);
+	assert(len <= MMU_MSG_MAX);
+	m->next = NULL;
+	m->len = len;
+	if(len) memcpy(m->data, data, len);
+
+	pthread_mutex_lock(&mmu->queue_lock);
+	if(c->msgs_tail) c->msgs_tail->next = m;
+	else c->msgs_head = m;
+	c->msgs_tail = m;
+	if(!c->scheduled && mmu_client_runnable(c)) {
+		c->scheduled = 1;
+		mmu_runq_push(c);
+	}
+	pthread_mutex_unlock(&mmu->queue_lock);
+}/*}}}*/
+
+/* Tagged requests carry their own reply slot in the client and may be
+ * served concurrently. */
+int mmu_msg_tagged(const struct mmu_msg *m)/*{{{*/
+{
+	if(m->len == 0) return 0;
+	uint32_t type;
+	memcpy(&type, m->data, sizeof(type));
+	return type == MMU_PROTO_EXTEND_REQ || type == MMU_PROTO_EXTENDV_REQ ||
+			type == MMU_PROTO_RELEASE_REQ || type == MMU_PROTO_SYSLOG_REQ ||
+			type == MMU_PROTO_SEGV_REQ;
+}/*}}}*/
+
+/* Whether a worker may take the next request of `c` now.  Assumes
+ * `mmu->queue_lock` is locked. */
+int mmu_client_runnable(const struct mmu_client *c)/*{{{*/
+{
+	if(!c->msgs_head || c->serial) return 0;
+	return c->nrunning == 0 || mmu_msg_tagged(c->msgs_head);
+}/*}}}*/
+
+/* Appends `c` to the run queue.  Assumes `mmu->queue_lock` is locked. */
+void mmu_runq_push(struct mmu_client *c)/*{{{*/
+{
+	c->runq_next = NULL;
+	if(mmu->runq_tail) mmu->runq_tail->runq_next = c;
+	else mmu->runq_head = c;
+	mmu->runq_tail = c;
+	pthread_cond_signal(&mmu->queue_cond);
+}/*}}}*/
+
+void * mmu_worker_thread(void *unused)/*{{{*/
+{
+	mmu_trace_buffered();
+	pthread_mutex_lock(&mmu->queue_lock);
+	while(1) {
+		while(!mmu->runq_head && !mmu->stopping)
+			pthread_cond_wait(&mmu->queue_cond, &mmu->queue_lock);
+		if(mmu->stopping) break;
+
+		struct mmu_client *c = mmu->runq_head;
+		mmu->runq_head = c->runq_next;
+		if(!mmu->runq_head) mmu->runq_tail = NULL;
+		struct mmu_msg *m = c->msgs_head;
+		c->msgs_head = m->next;
+		if(!c->msgs_head) c->msgs_tail = NULL;
+		int serial = !mmu_msg_tagged(m);
+		c->nrunning++;
+		c->serial = serial;
+		/* Let another worker take the client's next request. */
+		if(mmu_client_runnable(c)) mmu_runq_push(c);
+		else c->scheduled = 0;
+		pthread_mutex_unlock(&mmu->queue_lock);
+
+		int gone = mmu_client_dispatch(c, m);
+		free(m);
+		mmu_trace_flush();
+
+		pthread_mutex_lock(&mmu->queue_lock);
+		if(gone) continue;
+		c->nrunning--;
+		if(serial) c->serial = 0;
+		if(!c->scheduled && mmu_client_runnable(c)) {
+			c->scheduled = 1;
+			mmu_runq_push(c);
+		}
+	}
+	pthread_mutex_unlock(&mmu->queue_lock);
+	return NULL;
+}/*}}}*/
+/*}}}*/
+
+/****************************************************************************
+ * client functions {{{
+ ***************************************************************************/
+static void mmu_client_log(const struct mmu_client *c, const char *fname, const char *msg);
+static void mmu_client_create(struct mmu_client *c, const void *msg);
+static void mmu_client_extend(struct mmu_client *c, const void *msg);
+static void mmu_client_extendv(struct mmu_client *c, const void *msg);
+static void mmu_client_release(struct mmu_client *c, const void *msg);
+static void mmu_client_syslog(struct mmu_client *c, const void *msg);
+static void mmu_client_segv(struct mmu_client *c, const void *msg);
+static void mmu_client_exit(struct mmu_client *c, const void *msg);
+static void mmu_client_shm(struct mmu_client *c, const void *msg);
+
+/* Serves one request from `c`.  Returns nonzero if the client was torn
+ * down and must not be touched again. */
+int mmu_client_dispatch(struct mmu_client *c, struct mmu_msg *m)/*{{{*/
+{
+	if(m->len == 0) {
+		mmu_client_destroy(c);
+		return 1;
+	}
+	uint32_t type;
+	memcpy(&type, m->data, sizeof(type));
+	switch(type) {
+	case MMU_PROTO_CREATE_REQ:
+		mmu_client_create(c, m->data);
+		break;
+	case MMU_PROTO_EXTEND_REQ:
+		mmu_client_extend(c, m->data);
+		break;
+	case MMU_PROTO_EXTENDV_REQ:
+		mmu_client_extendv(c, m->data);
+		break;
+	case MMU_PROTO_RELEASE_REQ:
+		mmu_client_release(c, m->data);
+		break;
+	case MMU_PROTO_SYSLOG_REQ:
+		mmu_client_syslog(c, m->data);
+		break;
+	case MMU_PROTO_SEGV_REQ:
+		mmu_client_segv(c, m->data);
+		break;
+	case MMU_PROTO_EXIT_REQ:
+		mmu_client_exit(c, m->data);
+		break;
+	case MMU_PROTO_SHM_REQ:
+		mmu_client_shm(c, m->data);
+		break;
+	default:
+		mmu_client_log(c, __func__, "invalid message type");
+		mmu_client_fail(c);
+		break;
+	}
+	return 0;
 }/*}}}*/
 
 void mmu_client_log(const struct mmu_client *c, const char *fname, const char *msg)/*{{{*/
@@ -262,150 +802,399 @@ void mmu_client_log(const struct mmu_client *c, const char *fname, const char *m
 			(int)c->pid, msg);
 }/*}}}*/
 
-void mmu_client_create(struct mmu_client *c)/*{{{*/
+void mmu_client_create(struct mmu_client *c, const void *msg)/*{{{*/
 {
-	char msg[96];
+	char logmsg[96];
 	struct mmu_proto_create_req req;
-	if(recv(c->sock, &req, sizeof(req), 0) != sizeof(req))
-		goto out_client;
+	memcpy(&req, msg, sizeof(req));
 	assert(req.type == MMU_PROTO_CREATE_REQ);
 
 	c->pid = (pid_t)req.pid;
-	int id = nextid;
-	id2pid[nextid++] = c->pid;
-	printf("pager_create pid %d\n", id);
+	if(mmu_client_register(c) == -1) {
+		c->pid = 0;
+		mmu_client_fail(c);
+		return;
+	}
+	int id = c->id;
+	mmu_trace(MMU_TRACE_CREATE, id, NULL, -1, -1, -1);
 	pager_create(c->pid);
-	snprintf(msg, 96, "create pid %d", id);
-	mmu_client_log(c, __func__, msg);
+	if(log_true(LOG_DEBUG)) {
+		snprintf(logmsg, 96, "create pid %d", id);
+		mmu_client_log(c, __func__, logmsg);
+	}
 
 	struct mmu_proto_create_rep rep;
 	rep.type = MMU_PROTO_CREATE_REP;
 	memset(rep.pmem_fn, '\0', MMU_PROTO_PATH_MAX);
 	strncat(rep.pmem_fn, mmu->pmem_fn, MMU_PROTO_PATH_MAX-1);
-	if(send(c->sock, &rep, sizeof(rep), 0) != sizeof(rep))
-		goto out_client;
-	return;
-
-	out_client:
-	mmu_client_destroy(c);
+	if(mmu_client_send(c, &rep, sizeof(rep)) == -1)
+		mmu_client_fail(c);
 }/*}}}*/
 
-void mmu_client_extend(struct mmu_client *c)/*{{{*/
+void mmu_client_extend(struct mmu_client *c, const void *msg)/*{{{*/
 {
-	char msg[96];
+	char logmsg[96];
 	struct mmu_proto_extend_req req;
-	if(recv(c->sock, &req, sizeof(req), 0) != sizeof(req))
-		goto out_client;
+	memcpy(&req, msg, sizeof(req));
 	assert(req.type == MMU_PROTO_EXTEND_REQ);
 
-	int id = get_pid_id(c->pid);
+	int id = c->id;
 	void *vaddr = pager_extend(c->pid);
-	printf("pager_extend pid %d vaddr %p\n", id, vaddr);
-	snprintf(msg, 96, "extend vaddr %p", vaddr);
-	mmu_client_log(c, __func__, msg);
+	mmu_trace(MMU_TRACE_EXTEND, id, vaddr, -1, -1, -1);
+	if(log_true(LOG_DEBUG)) {
+		snprintf(logmsg, 96, "extend vaddr %p", vaddr);
+		mmu_client_log(c, __func__, logmsg);
+	}
 
 	struct mmu_proto_extend_rep rep;
 	rep.type = MMU_PROTO_EXTEND_REP;
+	rep.tag = req.tag;
 	rep.vaddr = (intptr_t)vaddr;
-	if(send(c->sock, &rep, sizeof(rep), 0) != sizeof(rep))
-		goto out_client;
-	return;
+	if(mmu_client_send(c, &rep, sizeof(rep)) == -1)
+		mmu_client_fail(c);
+}/*}}}*/
 
-	out_client:
-	mmu_client_destroy(c);
+void mmu_client_extendv(struct mmu_client *c, const void *msg)/*{{{*/
+{
+	char logmsg[96];
+	struct mmu_proto_extendv_req req;
+	memcpy(&req, msg, sizeof(req));
+	assert(req.type == MMU_PROTO_EXTENDV_REQ);
+
+	int id = c->id;
+	int count = 0;
+	void *vaddr = NULL;
+	if(req.count <= INT_MAX)
+		vaddr = pager_extend_range(c->pid, (int)req.count, req.partial != 0,
+				&count);
+	for(int i = 0; i < count; ++i)
+		mmu_trace(MMU_TRACE_EXTEND, id, (char *)vaddr + i * PAGESIZE,
+				-1, -1, -1);
+	if(log_true(LOG_DEBUG)) {
+		snprintf(logmsg, 96, "extend vaddr %p pages %d/%u", vaddr, count,
+				req.count);
+		mmu_client_log(c, __func__, logmsg);
+	}
+
+	struct mmu_proto_extendv_rep rep;
+	rep.type = MMU_PROTO_EXTENDV_REP;
+	rep.tag = req.tag;
+	rep.count = (uint32_t)count;
+	rep.vaddr = (intptr_t)vaddr;
+	if(mmu_client_send(c, &rep, sizeof(rep)) == -1)
+		mmu_client_fail(c);
+}/*}}}*/
+
+void mmu_client_release(struct mmu_client *c, const void *msg)/*{{{*/
+{
+	char logmsg[96];
+	struct mmu_proto_release_req req;
+	memcpy(&req, msg, sizeof(req));
+	assert(req.type == MMU_PROTO_RELEASE_REQ);
+
+	assert(req.addr < UINTPTR_MAX);
+	void *vaddr = (void *)(uintptr_t)req.addr;
+	int id = c->id;
+	int status = -1;
+	char *released = NULL;
+	if(req.count <= INT_MAX && (released = calloc(req.count, 1)))
+		status = pager_release(c->pid, vaddr, (int)req.count, released);
+	for(uint32_t i = 0; status == 0 && i < req.count; ++i) {
+		if(!released[i]) continue;
+		mmu_trace(MMU_TRACE_RELEASE, id, (char *)vaddr + i * PAGESIZE,
+				-1, -1, -1);
+	}
+	free(released);
+	if(log_true(LOG_DEBUG)) {
+		snprintf(logmsg, 96, "release vaddr %p pages %u retcode %d", vaddr,
+				req.count, status);
+		mmu_client_log(c, __func__, logmsg);
+	}
+
+	struct mmu_proto_release_rep rep;
+	rep.type = MMU_PROTO_RELEASE_REP;
+	rep.tag = req.tag;
+	rep.retcode = (uint32_t)status;
+	if(mmu_client_send(c, &rep, sizeof(rep)) == -1)
+		mmu_client_fail(c);
 }/*}}}*/
 
-void mmu_client_syslog(struct mmu_client *c)/*{{{*/
+void mmu_client_syslog(struct mmu_client *c, const void *msg)/*{{{*/
 {
-	char msg[96];
+	char logmsg[96];
 	struct mmu_proto_syslog_req req;
-	if(recv(c->sock, &req, sizeof(req), 0) != sizeof(req))
-		goto out_client;
+	memcpy(&req, msg, sizeof(req));
 	assert(req.type == MMU_PROTO_SYSLOG_REQ);
 
 	assert(req.addr < UINTPTR_MAX);
 	void *vaddr = (void *)(uintptr_t)req.addr;
 	size_t len = (size_t)req.len;
-	int id = get_pid_id(c->pid);
-	printf("pager_syslog pid %d %p\n", id, vaddr);
+	int id = c->id;
+	mmu_trace(MMU_TRACE_SYSLOG, id, vaddr, -1, -1, -1);
+	/* The pager prints the message with stdio, after the events it
+	 * causes, and stdio may write part of it out at any time. */
+	mmu_trace_sync();
 	int status = pager_syslog(c->pid, vaddr, len);
-	snprintf(msg, 96, "vaddr %p len %zu retcode %d", vaddr, len, status);
-	mmu_client_log(c, __func__, msg);
+	mmu_trace_sync();
+	if(log_true(LOG_DEBUG)) {
+		snprintf(logmsg, 96, "vaddr %p len %zu retcode %d", vaddr, len,
+				status);
+		mmu_client_log(c, __func__, logmsg);
+	}
 
 	struct mmu_proto_syslog_rep rep;
 	rep.type = MMU_PROTO_SYSLOG_REP;
+	rep.tag = req.tag;
 	rep.retcode = (uint32_t)status;
-	if(send(c->sock, &rep, sizeof(rep), 0) != sizeof(rep))
-		goto out_client;
-	return;
-
-	out_client:
-	mmu_client_destroy(c);
+	if(mmu_client_send(c, &rep, sizeof(rep)) == -1)
+		mmu_client_fail(c);
 }/*}}}*/
 
-void mmu_client_segv(struct mmu_client *c)/*{{{*/
+void mmu_client_segv(struct mmu_client *c, const void *msg)/*{{{*/
 {
-	char msg[96];
+	char logmsg[96];
 	struct mmu_proto_segv_req req;
-	if(recv(c->sock, &req, sizeof(req), 0) != sizeof(req))
-		goto out_client;
+	memcpy(&req, msg, sizeof(req));
 	assert(req.type == MMU_PROTO_SEGV_REQ);
 
 	assert(req.addr < UINTPTR_MAX);
 	void *vaddr = (void *)(uintptr_t)req.addr;
 	int code = (int)req.code;
-	snprintf(msg, 96, "vaddr %p code %d", vaddr, code);
-	mmu_client_log(c, __func__, msg);
+	if(log_true(LOG_DEBUG)) {
+		snprintf(logmsg, 96, "vaddr %p code %d", vaddr, code);
+		mmu_client_log(c, __func__, logmsg);
+	}
 
-	int id = get_pid_id(c->pid);
-	printf("pager_fault pid %d vaddr %p\n", id, vaddr);
+	int id = c->id;
+	mmu_trace(MMU_TRACE_FAULT, id, vaddr, -1, -1, -1);
 	pager_fault(c->pid, vaddr);
 
 	struct mmu_proto_segv_rep rep;
 	rep.type = MMU_PROTO_SEGV_REP;
-	if(send(c->sock, &rep, sizeof(rep), 0) != sizeof(rep))
-		goto out_client;
-	return;
-
-	out_client:
-	mmu_client_destroy(c);
+	rep.tag = req.tag;
+	if(mmu_client_send(c, &rep, sizeof(rep)) == -1)
+		mmu_client_fail(c);
 }/*}}}*/
 
-void mmu_client_exit(struct mmu_client *c)/*{{{*/
+void mmu_client_exit(struct mmu_client *c, const void *msg)/*{{{*/
 {
 	struct mmu_proto_exit_req req;
-	if(recv(c->sock, &req, sizeof(req), 0) != sizeof(req))
-		goto out_client;
+	memcpy(&req, msg, sizeof(req));
 	mmu_client_log(c, __func__, "exiting cleanly");
 	assert(req.type == MMU_PROTO_EXIT_REQ);
 	assert(c->pid);
-	int id = get_pid_id(c->pid);
-	printf("pager_destroy pid %d\n", id);
+	int id = c->id;
+	mmu_trace(MMU_TRACE_DESTROY, id, NULL, -1, -1, -1);
 	pager_destroy(c->pid);
+	mmu_client_unregister(c);
+	c->exited = 1;
 
-	struct mmu_proto_segv_rep rep;
+	struct mmu_proto_exit_rep rep;
 	rep.type = MMU_PROTO_EXIT_REP;
-	send(c->sock, &rep, sizeof(rep), 0); /* ignoring return value */
+	/* the client closes the socket after this reply; the event loop
+	 * sees EOF and schedules the final teardown. */
+	mmu_client_send(c, &rep, sizeof(rep)); /* ignoring return value */
+}/*}}}*/
 
-	mmu->sock2client[c->sock] = NULL;
-	c->running = 0;
-	close(c->sock);
-	return;
+/* Moves `c` to the shared-memory transport.  The client waits for our
+ * reply before sending anything else and has no pages yet, so nothing
+ * else can be in flight on the socket while we switch. */
+void mmu_client_shm(struct mmu_client *c, const void *msg)/*{{{*/
+{
+	struct mmu_proto_shm_req req;
+	memcpy(&req, msg, sizeof(req));
+	assert(req.type == MMU_PROTO_SHM_REQ);
 
-	out_client:
-	mmu_client_destroy(c);
+	struct mmu_proto_shm_rep rep;
+	rep.type = MMU_PROTO_SHM_REP;
+	rep.size = 0;
+	size_t size = sizeof(struct mmu_proto_shm);
+	struct mmu_proto_shm *shm = MAP_FAILED;
+	int fd = -1;
+	if(c->shm) goto out_reply;
+
+	fd = memfd_create("mmu.shm", MFD_CLOEXEC);
+	if(fd == -1) goto out_err;
+	if(ftruncate(fd, size) == -1) goto out_err;
+	shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(shm == MAP_FAILED) goto out_err;
+	ring_init(&shm->req);
+	ring_init(&shm->rep);
+	c->shm = shm;
+	sigset_t set, old;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	int err = pthread_create(&c->shm_reader, NULL, mmu_shm_reader_thread, c);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if(err) {
+		c->shm = NULL;
+		errno = err;
+		goto out_err;
+	}
+	rep.size = size;
+	mmu_client_log(c, __func__, "switched to shared memory");
+	goto out_reply;
+
+	out_err:
+	loge(LOG_WARN, __FILE__, __LINE__);
+	if(shm != MAP_FAILED) munmap(shm, size);
+	out_reply:;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { &rep, sizeof(rep) };
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if(rep.size) {
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	pthread_mutex_lock(&c->send_lock);
+	ssize_t cnt = sendmsg(c->sock, &mh, MSG_NOSIGNAL);
+	pthread_mutex_unlock(&c->send_lock);
+	if(fd != -1) close(fd);
+	if(cnt != sizeof(rep)) mmu_client_fail(c);
 }/*}}}*/
 
-void mmu_client_destroy(struct mmu_client *c)/*{{{*/
+/* Marks `c` as gone and wakes anyone waiting for a handshake with it.
+ * Shutting the socket down makes the event loop see EOF, which queues
+ * the teardown; we cannot release pager state here because this may run
+ * inside a pager callback. */
+void mmu_client_fail(struct mmu_client *c)/*{{{*/
 {
 	loge(LOG_WARN, __FILE__, __LINE__);
 	mmu_client_log(c, __func__, "running");
-	mmu->sock2client[c->sock] = NULL;
-	c->running = 0;
-	close(c->sock);
-	if(c->pid) { /* may get here before CREATE_REQ happens */
+	pthread_mutex_lock(&c->lock);
+	c->dead = 1;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	if(c->shm) {
+		ring_close(&c->shm->req);
+		ring_close(&c->shm->rep);
+	}
+	shutdown(c->sock, SHUT_RDWR);
+}/*}}}*/
+
+void mmu_client_destroy(struct mmu_client *c)/*{{{*/
+{
+	mmu_client_log(c, __func__, "running");
+	if(c->pid && !c->exited) { /* may get here before CREATE_REQ happens */
 		pager_destroy(c->pid);
 	}
+	if(c->pid)
+		mmu_client_unregister(c);
+
+	pthread_mutex_lock(&mmu->clients_lock);
+	if(c->prev) c->prev->next = c->next;
+	else mmu->clients = c->next;
+	if(c->next) c->next->prev = c->prev;
+	pthread_mutex_unlock(&mmu->clients_lock);
+
+	if(c->shm) {
+		ring_close(&c->shm->req);
+		ring_close(&c->shm->rep);
+		pthread_join(c->shm_reader, NULL);
+		munmap(c->shm, sizeof(*c->shm));
+	}
+	while(c->msgs_head) {
+		struct mmu_msg *m = c->msgs_head;
+		c->msgs_head = m->next;
+		free(m);
+	}
+	close(c->sock);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->cond);
+	pthread_mutex_destroy(&c->send_lock);
+	free(c);
+}/*}}}*/
+
+int mmu_client_register(struct mmu_client *c)/*{{{*/
+{
+	pthread_mutex_lock(&mmu->clients_lock);
+	int id = bitmap_alloc(mmu->ids);
+	if(id == -1) {
+		if(bitmap_grow(mmu->ids, 2 * bitmap_size(mmu->ids)) == -1)
+			goto out_unlock;
+		id = bitmap_alloc(mmu->ids);
+	}
+	if(pidtab_put(mmu->pid2client, c->pid, c) == -1) {
+		bitmap_release(mmu->ids, id);
+		goto out_unlock;
+	}
+	c->id = id;
+	pthread_mutex_unlock(&mmu->clients_lock);
+	return 0;
+
+	out_unlock:
+	pthread_mutex_unlock(&mmu->clients_lock);
+	logd(LOG_ERROR, "%s: cannot register pid %d\n", __func__, (int)c->pid);
+	return -1;
+}/*}}}*/
+
+void mmu_client_unregister(struct mmu_client *c)/*{{{*/
+{
+	pthread_mutex_lock(&mmu->clients_lock);
+	if(pidtab_get(mmu->pid2client, c->pid) == c)
+		pidtab_del(mmu->pid2client, c->pid);
+	if(c->id != -1)
+		bitmap_release(mmu->ids, c->id);
+	c->id = -1;
+	pthread_mutex_unlock(&mmu->clients_lock);
+}/*}}}*/
+
+int mmu_client_send(struct mmu_client *c, const void *buf, size_t len)/*{{{*/
+{
+	/* Text for the events that led here goes out before the client can
+	 * react and cause more events on another thread. */
+	mmu_trace_flush();
+	pthread_mutex_lock(&c->send_lock);
+	int rc = mmu_client_write(c, buf, len);
+	pthread_mutex_unlock(&c->send_lock);
+	return rc;
+}/*}}}*/
+
+/* Sends `buf` to `c`.  Assumes `c->send_lock` is locked. */
+int mmu_client_write(struct mmu_client *c, const void *buf, size_t len)/*{{{*/
+{
+	ssize_t cnt;
+	if(c->shm) cnt = ring_write(&c->shm->rep, buf, len) ? -1 : len;
+	else cnt = send(c->sock, buf, len, MSG_NOSIGNAL);
+	return cnt == (ssize_t)len ? 0 : -1;
+}/*}}}*/
+
+/* Sends an MMU-initiated message and waits until the client acknowledges
+ * it.  We need these functions to wait for the application to effect
+ * the protection change before we return to the pager.  The event loop
+ * counts the acknowledgements, so this works even when the worker
+ * calling us is the one serving `c`. */
+static int mmu_client_handshake(struct mmu_client *c, const void *rep, size_t len)/*{{{*/
+{
+	if(c->dead) goto out_client;
+	mmu_trace_flush();
+	pthread_mutex_lock(&c->send_lock);
+	int rc = mmu_client_write(c, rep, len);
+	unsigned long seq = ++c->handshakes;
+	pthread_mutex_unlock(&c->send_lock);
+	if(rc == -1) goto out_client;
+	pthread_mutex_lock(&c->lock);
+	while(c->acks < seq && !c->dead)
+		pthread_cond_wait(&c->cond, &c->lock);
+	if(c->acks < seq) {
+		pthread_mutex_unlock(&c->lock);
+		goto out_client;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+
+	out_client:
+	mmu_client_fail(c);
+	return -1;
 }/*}}}*/
 /*}}}*/
 
@@ -414,138 +1203,191 @@ void mmu_client_destroy(struct mmu_client *c)/*{{{*/
  ***************************************************************************/
 struct mmu_client * mmu_client_search(pid_t pid)/*{{{*/
 {
-	for(int i = 3; i < MMU_MAX_SOCK; ++i) {
-		if(!mmu->sock2client[i]) continue;
-		if(mmu->sock2client[i]->pid == pid) return mmu->sock2client[i];
-	}
+	pthread_mutex_lock(&mmu->clients_lock);
+	struct mmu_client *c = pidtab_get(mmu->pid2client, pid);
+	pthread_mutex_unlock(&mmu->clients_lock);
+	if(c) return c;
+	mmu_trace_sync();
 	printf("error: pid %d not found.  aborting.\n", (int)pid);
 	logd(LOG_FATAL, "pid %d not found.  aborting.\n", (int)pid);
-	mmu_destroy();
+	/* We are inside the pager and possibly holding its locks, so a
+	 * full mmu_destroy() could wait on ourselves. */
+	if(!mmu->pmem_memfd) unlink(mmu->pmem_fn);
 	exit(EXIT_FAILURE);
 }/*}}}*/
 
 void mmu_zero_fill(int frame)/*{{{*/
 {
-	printf("%s frame %u\n", __func__, frame);
+	mmu_trace(MMU_TRACE_ZERO_FILL, 0, NULL, frame, -1, -1);
 	logd(LOG_DEBUG, "%s frame %u\n", __func__, frame);
+	if(mmu->dio) diskio_wait_frame(mmu->dio, frame);
 	memset(mmu->pmem + (PAGESIZE*frame), '0', PAGESIZE);
 }/*}}}*/
 
 void mmu_resident(pid_t pid, void *vaddr, int frame, int prot)/*{{{*/
 {
-	int id = get_pid_id(pid);
-	printf("%s pid %d vaddr %p prot %d frame %u\n", __func__,
-			id, vaddr, prot, frame);
+	struct mmu_client *c = mmu_client_search(pid);
+	int id = c->id;
+	mmu_trace(MMU_TRACE_RESIDENT, id, vaddr, frame, -1, prot);
 	logd(LOG_DEBUG, "%s pid %d vaddr %p prot %d frame %u\n", __func__,
 			id, vaddr, prot, frame);
-	struct mmu_client *c = mmu_client_search(pid);
+	/* The client must not see the frame before a read into it lands. */
+	if(mmu->dio) diskio_wait_frame(mmu->dio, frame);
 	struct mmu_proto_remap_rep rep;
 	rep.type = MMU_PROTO_REMAP_REP;
 	rep.prot = (int32_t)prot;
 	rep.offset = (uint64_t)(PAGESIZE * frame);
 	rep.vaddr = (intptr_t)vaddr;
-	if(send(c->sock, &rep, sizeof(rep), 0) != sizeof(rep))
-		goto out_client;
-
-	/* We need these functions to wait for the application to
-	 * effect the protection change before we return to the
-	 * pager.  This loop is necessary because mmu_client_thread
-	 * is already in the pager and blocked here (so we cannot
-	 * wait on a condition variable to be signaled forward as
-	 * there is no one else to recv the REMAP_REQ message).  An
-	 * alternative approach would be to use two sockets or
-	 * threads. */
-	uint32_t t;
-	do {
-		 if(recv(c->sock, &t, sizeof(t), MSG_PEEK) != sizeof(t))
-			goto out_client;
-	} while(t != MMU_PROTO_REMAP_REQ);
-	struct mmu_proto_remap_req req;
-	if(recv(c->sock, &req, sizeof(req), 0) != sizeof(req))
-		goto out_client;
-	assert(req.type == MMU_PROTO_REMAP_REQ);
-	return;
-
-	out_client:
-	mmu_client_destroy(c);
+	mmu_client_handshake(c, &rep, sizeof(rep));
 }/*}}}*/
 
 
 void mmu_nonresident(pid_t pid, void *vaddr)/*{{{*/
 {
-	int id = get_pid_id(pid);
-	printf("%s pid %d vaddr %p\n", __func__, id, vaddr);
-	logd(LOG_DEBUG, "%s pid %d vaddr %p\n", __func__, id, vaddr);
 	struct mmu_client *c = mmu_client_search(pid);
+	int id = c->id;
+	mmu_trace(MMU_TRACE_NONRESIDENT, id, vaddr, -1, -1, -1);
+	logd(LOG_DEBUG, "%s pid %d vaddr %p\n", __func__, id, vaddr);
 	struct mmu_proto_chprot_rep rep;
 	rep.type = MMU_PROTO_CHPROT_REP;
 	rep.prot = PROT_NONE;
 	rep.vaddr = (intptr_t)vaddr;
-	if(send(c->sock, &rep, sizeof(rep), 0) != sizeof(rep))
-		goto out_client;
-
-	uint32_t t;
-	do {
-		if(recv(c->sock, &t, sizeof(t), MSG_PEEK) != sizeof(t))
-			goto out_client;
-	} while(t != MMU_PROTO_CHPROT_REQ);
-	struct mmu_proto_chprot_req req;
-	if(recv(c->sock, &req, sizeof(req), 0) != sizeof(req))
-		goto out_client;
-	assert(req.type == MMU_PROTO_CHPROT_REQ);
-	return;
-
-	out_client:
-	mmu_client_destroy(c);
+	mmu_client_handshake(c, &rep, sizeof(rep));
 }/*}}}*/
 
 void mmu_chprot(pid_t pid, void *vaddr, int prot)/*{{{*/
 {
-	int id = get_pid_id(pid);
-	printf("%s pid %d vaddr %p prot %d\n", __func__, id, vaddr, prot);
+	struct mmu_client *c = mmu_client_search(pid);
+	int id = c->id;
+	mmu_trace(MMU_TRACE_CHPROT, id, vaddr, -1, -1, prot);
 	logd(LOG_DEBUG, "%s pid %d vaddr %p prot %d\n", __func__,
 			id, vaddr,prot);
-	struct mmu_client *c = mmu_client_search(pid);
 	struct mmu_proto_chprot_rep rep;
 	rep.type = MMU_PROTO_CHPROT_REP;
 	rep.prot = (int32_t)prot;
 	rep.vaddr = (intptr_t)vaddr;
-	if(send(c->sock, &rep, sizeof(rep), 0) != sizeof(rep))
-		goto out_client;
+	mmu_client_handshake(c, &rep, sizeof(rep));
+}/*}}}*/
 
-	uint32_t t;
-	do {
-		if(recv(c->sock, &t, sizeof(t), MSG_PEEK) != sizeof(t))
-			goto out_client;
-	} while(t != MMU_PROTO_CHPROT_REQ);
-	struct mmu_proto_chprot_req req;
-	if(recv(c->sock, &req, sizeof(req), 0) != sizeof(req))
-		goto out_client;
-	assert(req.type == MMU_PROTO_CHPROT_REQ);
-	return;
+void mmu_chprot_batch(pid_t pid, const struct mmu_chprot_entry *v, int n)/*{{{*/
+{
+	if(n <= 0) return;
+	struct mmu_client *c = mmu_client_search(pid);
+	int id = c->id;
+	char buf[sizeof(struct mmu_proto_chprotv_rep) +
+			MMU_PROTO_CHPROTV_MAX * sizeof(struct mmu_proto_chprotv_entry)];
+	while(n > 0) {
+		int cnt = n < MMU_PROTO_CHPROTV_MAX ? n : MMU_PROTO_CHPROTV_MAX;
+		struct mmu_proto_chprotv_rep rep;
+		rep.type = MMU_PROTO_CHPROTV_REP;
+		rep.count = (uint32_t)cnt;
+		memcpy(buf, &rep, sizeof(rep));
+		char *pos = buf + sizeof(rep);
+		for(int i = 0; i < cnt; ++i) {
+			mmu_trace(MMU_TRACE_CHPROT, id, v[i].vaddr, -1, -1,
+					v[i].prot);
+			logd(LOG_DEBUG, "%s pid %d vaddr %p prot %d\n", __func__,
+					id, v[i].vaddr, v[i].prot);
+			struct mmu_proto_chprotv_entry e;
+			e.prot = (int32_t)v[i].prot;
+			e.vaddr = (intptr_t)v[i].vaddr;
+			memcpy(pos, &e, sizeof(e));
+			pos += sizeof(e);
+		}
+		mmu_client_handshake(c, buf, pos - buf);
+		v += cnt;
+		n -= cnt;
+	}
+}/*}}}*/
 
-	out_client:
-	mmu_client_destroy(c);
+void mmu_kill(pid_t pid)/*{{{*/
+{
+	struct mmu_client *c = mmu_client_search(pid);
+	mmu_trace(MMU_TRACE_KILL, c->id, NULL, -1, -1, -1);
+	logd(LOG_INFO, "%s pid %d\n", __func__, c->id);
+	if(kill(c->pid, SIGKILL) == -1) loge(LOG_WARN, __FILE__, __LINE__);
+}/*}}}*/
+
+void mmu_copy_frame(int frame_from, int frame_to)/*{{{*/
+{
+	mmu_trace(MMU_TRACE_COPY_FRAME, 0, NULL, frame_to, frame_from, -1);
+	logd(LOG_DEBUG, "%s from frame %d to frame %d\n", __func__,
+			frame_from, frame_to);
+	if(mmu->dio) {
+		diskio_wait_frame(mmu->dio, frame_from);
+		diskio_wait_frame(mmu->dio, frame_to);
+	}
+	memcpy(mmu->pmem + (size_t)frame_to*PAGESIZE,
+			mmu->pmem + (size_t)frame_from*PAGESIZE, PAGESIZE);
+}/*}}}*/
+
+/* Moves one page between frame =frame= and swap block =block=, through
+ * the compressed pool if there is one.  With a swap file the transfer is
+ * only started, unless =wait= is set. */
+static void mmu_disk_io(int block, int frame, int write, int wait)/*{{{*/
+{
+	if(mmu->zswap) {
+		char *mem = mmu->pmem + (size_t)frame*PAGESIZE;
+		if(write) {
+			if(zswap_store(mmu->zswap, block, mem) == 0) return;
+		} else {
+			/* An earlier write from the frame may still be reading it. */
+			if(mmu->dio) diskio_wait_frame(mmu->dio, frame);
+			if(zswap_load(mmu->zswap, block, mem) == 0) return;
+		}
+	}
+	if(mmu->dio) {
+		if(wait) diskio_transfer(mmu->dio, frame, block, write);
+		else if(write) diskio_write(mmu->dio, frame, block);
+		else diskio_read(mmu->dio, block, frame);
+		return;
+	}
+	char *mem = mmu->pmem + (size_t)frame*PAGESIZE;
+	char *blk = mmu->disk + (size_t)block*PAGESIZE;
+	if(write) memcpy(blk, mem, PAGESIZE);
+	else memcpy(mem, blk, PAGESIZE);
 }/*}}}*/
 
 void mmu_disk_read(int block_from, int frame_to)/*{{{*/
 {
-	printf("%s from block %d to frame %d\n", __func__,
-			block_from, frame_to);
+	mmu_trace(MMU_TRACE_DISK_READ, 0, NULL, frame_to, block_from, -1);
 	logd(LOG_DEBUG, "%s from block %d to frame %d\n", __func__,
 			block_from, frame_to);
-	memcpy(mmu->pmem + frame_to*PAGESIZE, mmu->disk + block_from*PAGESIZE,
-			PAGESIZE);
+	mmu_disk_io(block_from, frame_to, 0, 1);
 }/*}}}*/
 
 void mmu_disk_write(int frame_from, int block_to)/*{{{*/
 {
-	printf("%s from frame %d to block %d\n", __func__,
+	mmu_trace(MMU_TRACE_DISK_WRITE, 0, NULL, frame_from, block_to, -1);
+	logd(LOG_DEBUG, "%s from frame %d to block %d\n", __func__,
 			frame_from, block_to);
+	mmu_disk_io(block_to, frame_from, 1, 1);
+}/*}}}*/
+
+void mmu_disk_read_async(int block_from, int frame_to)/*{{{*/
+{
+	mmu_trace(MMU_TRACE_DISK_READ, 0, NULL, frame_to, block_from, -1);
+	logd(LOG_DEBUG, "%s from block %d to frame %d\n", __func__,
+			block_from, frame_to);
+	mmu_disk_io(block_from, frame_to, 0, 0);
+}/*}}}*/
+
+void mmu_disk_write_async(int frame_from, int block_to)/*{{{*/
+{
+	mmu_trace(MMU_TRACE_DISK_WRITE, 0, NULL, frame_from, block_to, -1);
 	logd(LOG_DEBUG, "%s from frame %d to block %d\n", __func__,
 			frame_from, block_to);
-	memcpy(mmu->disk + block_to*PAGESIZE, mmu->pmem + frame_from*PAGESIZE,
-			PAGESIZE);
+	mmu_disk_io(block_to, frame_from, 1, 0);
+}/*}}}*/
+
+void mmu_disk_submit(void)/*{{{*/
+{
+	if(mmu->dio) diskio_submit(mmu->dio);
+}/*}}}*/
+
+void mmu_disk_wait(int frame)/*{{{*/
+{
+	if(mmu->dio) diskio_wait_frame(mmu->dio, frame);
 }/*}}}*/
 /*}}}*/
 
@@ -555,31 +1397,164 @@ void mmu_disk_write(int frame_from, int block_to)/*{{{*/
 #ifdef MMUFREE
 void pager_free(void);
 #endif
+/* Creates =fn= holding our pid once clients can be served.  The file is
+ * written under a temporary name and renamed, so it never appears
+ * empty. */
+static void mmu_write_ready(const char *fn)/*{{{*/
+{
+	char *tmp;
+	if(asprintf(&tmp, "%s.tmp", fn) == -1) logea(__FILE__, __LINE__, NULL);
+	FILE *fp = fopen(tmp, "w");
+	if(!fp || fprintf(fp, "%d\n", (int)getpid()) < 0 || fclose(fp) == EOF
+			|| rename(tmp, fn) == -1) {
+		perror(fn);
+		exit(EXIT_FAILURE);
+	}
+	free(tmp);
+}/*}}}*/
+
+/* Parses a byte count with an optional k, m or g suffix.  Returns 0 on
+ * success or -1 on error. */
+static int mmu_parse_size(const char *s, size_t *size)/*{{{*/
+{
+	char *end;
+	errno = 0;
+	unsigned long long v = strtoull(s, &end, 10);
+	if(errno || end == s || *s == '-') return -1;
+	int shift = 0;
+	switch(*end) {
+	case 'g': case 'G': shift += 10; /* fall through */
+	case 'm': case 'M': shift += 10; /* fall through */
+	case 'k': case 'K': shift += 10; end++; /* fall through */
+	case '\0': break;
+	default: return -1;
+	}
+	if(*end != '\0' || v > (SIZE_MAX >> shift)) return -1;
+	*size = (size_t)v << shift;
+	return 0;
+}/*}}}*/
+
 void usage(int argc, char **argv) {/*{{{*/
-	printf("usage: %s NFRAMES NBLOCKS\n", argv[0]);
+	printf("usage: %s [-w NWORKERS] [-o NAME=VALUE]... [-t LEVEL] "
+			"[-T TRACEFILE]\n          [-m file|memfd] [-r READYFILE] "
+			"[-s SWAPFILE [-d] [-i ENGINE]]\n          [-z SIZE] "
+			"NFRAMES NBLOCKS\n",
+			argv[0]);
 	printf("\n");
 	printf("valid ranges: 2 <= NFRAMES <= 256\n");
-	printf("              4 <= NBLOCKS <= 1024\n");
+	printf("              2 <= NBLOCKS <= %d\n", MMU_MAX_BLOCKS);
+	printf("              1 <= NWORKERS <= %d (default %d)\n",
+			MMU_MAX_WORKERS, MMU_DEFAULT_WORKERS);
+	printf("\n");
+	printf("-o passes options to the pager, see pager_option() in pager.h\n");
+	printf("-t sets how events are printed: full (default, one line per\n");
+	printf("   event), summary (counts at shutdown) or off\n");
+	printf("-T records events to TRACEFILE in binary instead of printing\n");
+	printf("   them; bin/tracedec decodes the file\n");
+	printf("-m sets what backs physical memory: a file in the current\n");
+	printf("   directory (default) or an anonymous memfd\n");
+	printf("-r creates READYFILE with the mmu pid once clients can\n");
+	printf("   connect, and removes it at shutdown\n");
+	printf("-s keeps swap blocks in SWAPFILE, a file (created or grown\n");
+	printf("   sparsely as needed) or block device, instead of memory\n");
+	printf("-d opens SWAPFILE with O_DIRECT, bypassing the page cache\n");
+	printf("-i sets how SWAPFILE is accessed: uring (default, falls back\n");
+	printf("   to threads without io_uring), threads or sync\n");
+	printf("-z keeps swapped-out pages compressed in up to SIZE bytes of\n");
+	printf("   memory (suffixes k, m and g) before writing them to swap\n");
 	exit(EXIT_FAILURE);
 }/*}}}*/
 
 int main(int argc, char **argv) {/*{{{*/
-	if(argc != 3) usage(argc, argv);
-	int npages = atoi(argv[1]);
+	int nworkers = MMU_DEFAULT_WORKERS;
+	const char *tracefn = NULL;
+	const char *readyfn = NULL;
+	int opt;
+	while((opt = getopt(argc, argv, "w:o:t:T:m:r:s:di:z:")) != -1) {
+		switch(opt) {
+		case 'w':
+			nworkers = atoi(optarg);
+			if(nworkers < 1 || nworkers > MMU_MAX_WORKERS)
+				usage(argc, argv);
+			break;
+		case 'o': {
+			char *value = strchr(optarg, '=');
+			if(!value) usage(argc, argv);
+			*value++ = '\0';
+			if(pager_option(optarg, value) == -1) {
+				printf("invalid pager option %s=%s\n", optarg, value);
+				usage(argc, argv);
+			}
+			break;
+		}
+		case 't':
+			if(strcmp(optarg, "full") == 0) mmu_trace_level(MMU_TRACE_FULL);
+			else if(strcmp(optarg, "summary") == 0)
+				mmu_trace_level(MMU_TRACE_SUMMARY);
+			else if(strcmp(optarg, "off") == 0) mmu_trace_level(MMU_TRACE_OFF);
+			else usage(argc, argv);
+			break;
+		case 'T':
+			tracefn = optarg;
+			break;
+		case 'm':
+			if(strcmp(optarg, "memfd") == 0) opts.memfd = 1;
+			else if(strcmp(optarg, "file") == 0) opts.memfd = 0;
+			else usage(argc, argv);
+			break;
+		case 'r':
+			readyfn = optarg;
+			break;
+		case 's':
+			opts.swapfn = optarg;
+			break;
+		case 'd':
+			opts.direct = 1;
+			break;
+		case 'i':
+			if(strcmp(optarg, "uring") == 0) opts.engine = DISKIO_URING;
+			else if(strcmp(optarg, "threads") == 0)
+				opts.engine = DISKIO_THREADS;
+			else if(strcmp(optarg, "sync") == 0) opts.engine = DISKIO_SYNC;
+			else usage(argc, argv);
+			break;
+		case 'z':
+			if(mmu_parse_size(optarg, &opts.zswap) == -1 || !opts.zswap)
+				usage(argc, argv);
+			break;
+		default:
+			usage(argc, argv);
+		}
+	}
+	if(argc - optind != 2) usage(argc, argv);
+	int npages = atoi(argv[optind]);
 	if(npages < 1 || npages > 256) usage(argc, argv);
-	int nblocks = atoi(argv[2]);
-	if(nblocks < 2 || nblocks > 1024) usage(argc, argv);
+	int nblocks = atoi(argv[optind+1]);
+	if(nblocks < 2 || nblocks > MMU_MAX_BLOCKS) usage(argc, argv);
 	#ifdef MMULOG
 	log_init(LOG_EXTRA, "mmu.log", 1, 1<<20);
 	#endif
-	memset(id2pid, 255, UINT8_MAX * sizeof(pid_t));
-	mmu_init(npages, nblocks);
+	if(tracefn && mmu_trace_open(tracefn, MMU_TRACE_MAX_BYTES) == -1) {
+		perror(tracefn);
+		exit(EXIT_FAILURE);
+	}
+	/* Keep buffered events when exiting on errors. */
+	atexit(mmu_trace_sync);
+	mmu_init(npages, nblocks, nworkers);
 	pager_init(npages, nblocks);
-	mmu_accept_loop();
+	if(readyfn) mmu_write_ready(readyfn);
+	mmu_event_loop();
+	if(readyfn) unlink(readyfn);
+	mmu_trace_sync();
+	/* Pager threads may be in handshakes with clients that are still
+	 * running. */
+	mmu_hangup_clients();
+	pager_shutdown();
 	#ifdef MMUFREE
 	pager_free();
 	#endif
 	mmu_destroy();
+	mmu_trace_close();
 	#ifdef MMULOG
 	log_destroy();
 	#endif
@@ -25,7 +25,7 @@ extern const char *pmem;
 
 /* All functions in this module are blocking, i.e., they only return after
  * changes to physical memory, disk, and program virtual addresses are
- * complete.  */
+ * complete, except for the asynchronous disk functions at the end.  */
 
 /* `mmu_zero_fill` will fill `frame` with zeroes (character '0').
  * Your page should use this function to initialize memory before
@@ -49,6 +49,27 @@ void mmu_nonresident(pid_t pid, void *vaddr);
  * on `vaddr` and `prot`.  */
 void mmu_chprot(pid_t pid, void *vaddr, int prot);
 
+/* `mmu_chprot_batch` applies `n` permission changes to process `pid`
+ * in a single exchange with the process.  The effect is the same as
+ * calling `mmu_chprot` for each entry in order, but the process is only
+ * interrupted once.  */
+struct mmu_chprot_entry {
+	void *vaddr;
+	int prot;
+};
+void mmu_chprot_batch(pid_t pid, const struct mmu_chprot_entry *v, int n);
+
+/* `mmu_copy_frame` copies the contents of frame `frame_from` into
+ * frame `frame_to`, e.g. to give a page a private copy of a frame it
+ * shares with other pages.  */
+void mmu_copy_frame(int frame_from, int frame_to);
+
+/* `mmu_kill` terminates process `pid`, e.g. when there is no disk
+ * space left for its pages.  The process is killed with SIGKILL;
+ * `pager_destroy` is called for it once its connection closes, as for
+ * any process that exits.  */
+void mmu_kill(pid_t pid);
+
 /* `mmu_disk_read` copies content from disk block `block_from` into
  * physical frame `frame_to`.  `mmu_disk_write` copies content from
  * frame `frame_from` to disk block `block_to`.  Your pager shoudl
@@ -56,4 +77,19 @@ void mmu_chprot(pid_t pid, void *vaddr, int prot);
 void mmu_disk_read(int block_from, int frame_to);
 void mmu_disk_write(int frame_from, int block_to);
 
+/* `mmu_disk_read_async` and `mmu_disk_write_async` start the same
+ * transfers but may return before they complete, so the pager can
+ * release its locks, or start more transfers, while the disk works.
+ * Transfers are ordered per frame and per block: every later MMU
+ * function that names the same frame, or transfer that names the same
+ * block, first waits for the transfer to complete.  `mmu_disk_submit`
+ * hands transfers started so far to the disk together; transfers are
+ * also submitted by anything that waits for them.  `mmu_disk_wait`
+ * blocks until no transfer on `frame` is in flight, e.g. before reading
+ * `pmem` directly.  */
+void mmu_disk_read_async(int block_from, int frame_to);
+void mmu_disk_write_async(int frame_from, int block_to);
+void mmu_disk_submit(void);
+void mmu_disk_wait(int frame);
+
 #endif
@@ -16,18 +16,35 @@
  *
  * The `EXTEND` and `SEGV` messages are generated by the client when
  * they allocate memory and experience a segmentation fault,
- * respectively.  The request functions (`uvm_extend` and
- * `uvm_segv_action`) wait on a condition variable for the request
- * to be serviced.
+ * respectively; `EXTENDV` allocates several pages at once and
+ * `RELEASE` gives pages back.  `SYSLOG` is generated by `uvm_syslog`.  `SEGV`
+ * messages are also sent by `uvm_fault_thread` for faults read from a
+ * userfaultfd.  Each of these requests carries a `tag` naming a
+ * completion slot in the client, and its reply echoes the tag.  A
+ * client may have many of them outstanding, from different threads; the
+ * MMU may serve them concurrently and reply in any order.  The request
+ * functions wait on their slot's condition variable for the reply.
  *
  * The `REMAP` and `CHPROT` messages are generated by the MMU and
  * are processed by `uvm_thread` asynchronously.  These messages are
  * used to service sergmentation faults and whenever the pager pages
- * some of the processes pages to disk. */
+ * some of the processes pages to disk.  `CHPROTV` carries several
+ * `CHPROT` changes for one process and is acknowledged once; its
+ * header is followed by `count` entries.
+ *
+ * The optional `SHM` message is sent by the client right after `CREATE`
+ * to move the connection to shared memory.  The MMU replies with a
+ * `memfd` descriptor (passed as SCM_RIGHTS ancillary data) holding a
+ * `struct mmu_proto_shm`; from then on every message travels through its
+ * rings and the socket is only watched for the connection closing.  A
+ * reply with `size` zero and no descriptor means the MMU could not set up
+ * the segment and the client should keep using the socket. */
 
 #ifndef __MMUPROTO_HEADER__
 #define __MMUPROTO_HEADER__
 
+#include "ring.h"
+
 /* From UNIX_PATH_MAX, see man (7) unix: */
 #define MMU_PROTO_PATH_MAX 108
 #define MMU_PROTO_UNIX_PATH "mmu.sock"
@@ -44,6 +61,14 @@
 #define MMU_PROTO_REMAP_REP 10
 #define MMU_PROTO_CHPROT_REQ 11
 #define MMU_PROTO_CHPROT_REP 12
+#define MMU_PROTO_SHM_REQ 13
+#define MMU_PROTO_SHM_REP 14
+#define MMU_PROTO_CHPROTV_REQ 15
+#define MMU_PROTO_CHPROTV_REP 16
+#define MMU_PROTO_EXTENDV_REQ 17
+#define MMU_PROTO_EXTENDV_REP 18
+#define MMU_PROTO_RELEASE_REQ 19
+#define MMU_PROTO_RELEASE_REP 20
 #define MMU_PROTO_EXIT_REQ 32
 #define MMU_PROTO_EXIT_REP 33
 
@@ -58,29 +83,65 @@ struct mmu_proto_create_rep {
 
 struct mmu_proto_extend_req {
 	uint32_t type;
+	uint32_t tag;
 } __attribute__((packed));
 struct mmu_proto_extend_rep {
 	uint32_t type;
+	uint32_t tag;
+	uint64_t vaddr;
+} __attribute__((packed));
+
+/* Asks for `count` consecutive pages; with `partial` set the MMU may
+ * return fewer.  The reply gives the first page and how many were
+ * allocated (zero on failure). */
+struct mmu_proto_extendv_req {
+	uint32_t type;
+	uint32_t tag;
+	uint32_t count;
+	uint32_t partial;
+} __attribute__((packed));
+struct mmu_proto_extendv_rep {
+	uint32_t type;
+	uint32_t tag;
+	uint32_t count;
 	uint64_t vaddr;
 } __attribute__((packed));
 
+/* Gives back `count` pages starting at `addr`.  `retcode` is zero on
+ * success. */
+struct mmu_proto_release_req {
+	uint32_t type;
+	uint32_t tag;
+	uint32_t count;
+	uint64_t addr;
+} __attribute__((packed));
+struct mmu_proto_release_rep {
+	uint32_t type;
+	uint32_t tag;
+	uint32_t retcode;
+} __attribute__((packed));
+
 struct mmu_proto_syslog_req {
 	uint32_t type;
+	uint32_t tag;
 	uint32_t len;
 	uint64_t addr;
 } __attribute__((packed));
 struct mmu_proto_syslog_rep {
 	uint32_t type;
+	uint32_t tag;
 	uint32_t retcode;
 } __attribute__((packed));
 
 struct mmu_proto_segv_req {
 	uint32_t type;
+	uint32_t tag;
 	int32_t code;
 	uint64_t addr;
 } __attribute__((packed));
 struct mmu_proto_segv_rep {
 	uint32_t type;
+	uint32_t tag;
 } __attribute__((packed));
 // segv causes remap and chprot to happen
 
@@ -103,6 +164,34 @@ struct mmu_proto_chprot_rep {
 	uint64_t vaddr;
 } __attribute__((packed));
 
+/* Largest number of entries in one CHPROTV_REP. */
+#define MMU_PROTO_CHPROTV_MAX 256
+struct mmu_proto_chprotv_req {
+	uint32_t type;
+} __attribute__((packed));
+struct mmu_proto_chprotv_rep {
+	uint32_t type;
+	uint32_t count;
+} __attribute__((packed));
+struct mmu_proto_chprotv_entry {
+	int32_t prot;
+	uint64_t vaddr;
+} __attribute__((packed));
+
+struct mmu_proto_shm_req {
+	uint32_t type;
+} __attribute__((packed));
+struct mmu_proto_shm_rep {
+	uint32_t type;
+	uint64_t size;
+} __attribute__((packed));
+/* Layout of the shared segment: requests flow in `req`, replies and
+ * MMU-initiated messages in `rep`. */
+struct mmu_proto_shm {
+	struct ring req;
+	struct ring rep;
+};
+
 struct mmu_proto_exit_req {
 	uint32_t type;
 } __attribute__((packed));
@@ -0,0 +1,298 @@
+#include <sys/mman.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mmutrace.h"
+
+/*****************************************************************************
+ * trace state and helpers
+ ****************************************************************************/
+#define MMU_TRACE_CHUNK_BYTES \
+		(MMU_TRACE_CHUNK_RECS * sizeof(struct mmu_trace_rec))
+/* Per-thread and shared text buffer sizes. */
+#define MMU_TRACE_TBUF 4096
+#define MMU_TRACE_OBUF 65536
+
+static const char *opnames[MMU_TRACE_NOPS] = {
+	"none", "pager_create", "pager_extend", "pager_syslog", "pager_fault",
+	"pager_destroy", "mmu_zero_fill", "mmu_resident", "mmu_nonresident",
+	"mmu_chprot", "mmu_disk_read", "mmu_disk_write", "mmu_copy_frame",
+	"mmu_kill", "pager_release",
+};
+
+static struct {
+	int on;
+	int fd;
+	char *map;
+	uint64_t size;      /* bytes mapped */
+	uint64_t next;      /* offset of the next free chunk */
+	uint64_t seq;
+	uint64_t dropped;
+	uint64_t start;     /* CLOCK_MONOTONIC ns when recording started */
+} trace;
+
+/* Text output.  `buf` holds text not yet written to stdout and is
+ * protected by `lock`; `counts` are updated atomically. */
+static struct {
+	int level;
+	pthread_mutex_t lock;
+	char buf[MMU_TRACE_OBUF];
+	size_t len;
+	unsigned long counts[MMU_TRACE_NOPS];
+} text = { MMU_TRACE_FULL, PTHREAD_MUTEX_INITIALIZER };
+
+/* The calling thread's current chunk; chunks are never shared. */
+static __thread struct mmu_trace_rec *tpos;
+static __thread struct mmu_trace_rec *tend;
+/* The calling thread's text buffer, if it called mmu_trace_buffered(). */
+static __thread int tbuffered;
+static __thread size_t tlen;
+static __thread char tbuf[MMU_TRACE_TBUF];
+
+static uint64_t trace_now(clockid_t clk)
+{
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct mmu_trace_rec * trace_slot(void)
+{
+	if(tpos == tend) {
+		uint64_t off = __atomic_fetch_add(&trace.next,
+				MMU_TRACE_CHUNK_BYTES, __ATOMIC_RELAXED);
+		if(off + MMU_TRACE_CHUNK_BYTES > trace.size) {
+			__atomic_add_fetch(&trace.dropped, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+		tpos = (struct mmu_trace_rec *)(trace.map + off);
+		tend = tpos + MMU_TRACE_CHUNK_RECS;
+	}
+	return tpos++;
+}
+
+static void trace_record(int op, int id, const void *vaddr, int frame,
+		int block, int prot)
+{
+	struct mmu_trace_rec *r = trace_slot();
+	if(!r) return;
+	r->seq = __atomic_fetch_add(&trace.seq, 1, __ATOMIC_RELAXED);
+	r->ts = trace_now(CLOCK_MONOTONIC) - trace.start;
+	r->vaddr = (uintptr_t)vaddr;
+	r->id = (uint32_t)id;
+	r->frame = frame;
+	r->block = block;
+	r->prot = (int8_t)prot;
+	r->pad = 0;
+	/* Written last: readers skip records whose op is still NONE. */
+	__atomic_store_n(&r->op, (uint8_t)op, __ATOMIC_RELEASE);
+}
+
+static void text_write(const char *s, size_t len)
+{
+	while(len > 0) {
+		ssize_t n = write(STDOUT_FILENO, s, len);
+		if(n <= 0) return;
+		s += n;
+		len -= n;
+	}
+}
+
+/* Appends to the shared buffer.  Called with text.lock. */
+static void text_append_locked(const char *s, size_t len)
+{
+	if(text.len + len > MMU_TRACE_OBUF) {
+		text_write(text.buf, text.len);
+		text.len = 0;
+	}
+	if(len > MMU_TRACE_OBUF) {
+		text_write(s, len);
+		return;
+	}
+	memcpy(text.buf + text.len, s, len);
+	text.len += len;
+}
+
+static void text_append(const char *s, size_t len)
+{
+	pthread_mutex_lock(&text.lock);
+	text_append_locked(s, len);
+	pthread_mutex_unlock(&text.lock);
+}
+
+/*****************************************************************************
+ * trace function implementations
+ ****************************************************************************/
+int mmu_trace_open(const char *fn, uint64_t maxbytes) /* {{{ */
+{
+	uint64_t hdr = sizeof(struct mmu_trace_header);
+	if(maxbytes < hdr + MMU_TRACE_CHUNK_BYTES) return -1;
+	trace.fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(trace.fd == -1) return -1;
+	/* The file stays sparse until chunks are filled. */
+	if(ftruncate(trace.fd, maxbytes) == -1) goto out_close;
+	trace.map = mmap(NULL, maxbytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+			trace.fd, 0);
+	if(trace.map == MAP_FAILED) goto out_close;
+
+	struct mmu_trace_header *h = (struct mmu_trace_header *)trace.map;
+	memcpy(h->magic, MMU_TRACE_MAGIC, sizeof(h->magic));
+	h->version = MMU_TRACE_VERSION;
+	h->recsize = sizeof(struct mmu_trace_rec);
+	h->start_ns = trace_now(CLOCK_REALTIME);
+	trace.size = maxbytes;
+	trace.next = hdr;
+	trace.seq = 0;
+	trace.dropped = 0;
+	trace.start = trace_now(CLOCK_MONOTONIC);
+	trace.on = 1;
+	return 0;
+
+out_close:
+	close(trace.fd);
+	return -1;
+} /* }}} */
+
+void mmu_trace_level(int level) /* {{{ */
+{
+	text.level = level;
+} /* }}} */
+
+void mmu_trace(int op, int id, const void *vaddr, int frame, int block, /* {{{ */
+		int prot)
+{
+	if(trace.on) {
+		trace_record(op, id, vaddr, frame, block, prot);
+		return;
+	}
+	if(text.level == MMU_TRACE_OFF) return;
+	if(text.level == MMU_TRACE_SUMMARY) {
+		__atomic_add_fetch(&text.counts[op], 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct mmu_trace_rec r;
+	r.vaddr = (uintptr_t)vaddr;
+	r.id = (uint32_t)id;
+	r.frame = frame;
+	r.block = block;
+	r.prot = (int8_t)prot;
+	r.op = (uint8_t)op;
+	if(!tbuffered) {
+		char line[MMU_TRACE_LINE_MAX];
+		int len = mmu_trace_format(line, &r);
+		text_append(line, len);
+		return;
+	}
+	if(tlen + MMU_TRACE_LINE_MAX > MMU_TRACE_TBUF) mmu_trace_flush();
+	tlen += mmu_trace_format(tbuf + tlen, &r);
+} /* }}} */
+
+void mmu_trace_buffered(void) /* {{{ */
+{
+	tbuffered = 1;
+} /* }}} */
+
+void mmu_trace_flush(void) /* {{{ */
+{
+	if(tlen == 0) return;
+	text_append(tbuf, tlen);
+	tlen = 0;
+} /* }}} */
+
+void mmu_trace_sync(void) /* {{{ */
+{
+	mmu_trace_flush();
+	pthread_mutex_lock(&text.lock);
+	text_write(text.buf, text.len);
+	text.len = 0;
+	fflush(stdout);
+	pthread_mutex_unlock(&text.lock);
+} /* }}} */
+
+void mmu_trace_close(void) /* {{{ */
+{
+	if(text.level == MMU_TRACE_SUMMARY) {
+		char line[MMU_TRACE_LINE_MAX];
+		for(int op = 1; op < MMU_TRACE_NOPS; op++) {
+			int len = snprintf(line, sizeof(line), "%s %lu\n",
+					opnames[op], text.counts[op]);
+			text_append(line, len);
+		}
+	}
+	mmu_trace_sync();
+
+	if(!trace.on) return;
+	trace.on = 0;
+	uint64_t used = trace.next < trace.size ? trace.next : trace.size;
+	struct mmu_trace_header *h = (struct mmu_trace_header *)trace.map;
+	h->nrecs = trace.seq;
+	h->dropped = trace.dropped;
+	munmap(trace.map, trace.size);
+	if(ftruncate(trace.fd, used) == -1) perror("mmu_trace_close");
+	close(trace.fd);
+	if(trace.dropped)
+		fprintf(stderr, "trace full, %lu events dropped\n",
+				(unsigned long)trace.dropped);
+} /* }}} */
+
+int mmu_trace_format(char *buf, const struct mmu_trace_rec *r) /* {{{ */
+{
+	const size_t len = MMU_TRACE_LINE_MAX;
+	int id = (int)r->id;
+	void *vaddr = (void *)(uintptr_t)r->vaddr;
+	int n = 0;
+	switch(r->op) {
+	case MMU_TRACE_CREATE:
+	case MMU_TRACE_DESTROY:
+	case MMU_TRACE_KILL:
+		n = snprintf(buf, len, "%s pid %d\n", opnames[r->op], id);
+		break;
+	case MMU_TRACE_EXTEND:
+	case MMU_TRACE_RELEASE:
+	case MMU_TRACE_FAULT:
+	case MMU_TRACE_NONRESIDENT:
+		n = snprintf(buf, len, "%s pid %d vaddr %p\n", opnames[r->op], id,
+				vaddr);
+		break;
+	case MMU_TRACE_SYSLOG:
+		n = snprintf(buf, len, "pager_syslog pid %d %p\n", id, vaddr);
+		break;
+	case MMU_TRACE_ZERO_FILL:
+		n = snprintf(buf, len, "mmu_zero_fill frame %u\n", r->frame);
+		break;
+	case MMU_TRACE_RESIDENT:
+		n = snprintf(buf, len, "mmu_resident pid %d vaddr %p prot %d "
+				"frame %u\n", id, vaddr, r->prot, r->frame);
+		break;
+	case MMU_TRACE_CHPROT:
+		n = snprintf(buf, len, "mmu_chprot pid %d vaddr %p prot %d\n", id,
+				vaddr, r->prot);
+		break;
+	case MMU_TRACE_DISK_READ:
+		n = snprintf(buf, len, "mmu_disk_read from block %d to frame %d\n",
+				r->block, r->frame);
+		break;
+	case MMU_TRACE_DISK_WRITE:
+		n = snprintf(buf, len, "mmu_disk_write from frame %d to block %d\n",
+				r->frame, r->block);
+		break;
+	case MMU_TRACE_COPY_FRAME:
+		n = snprintf(buf, len, "mmu_copy_frame from frame %d to frame %d\n",
+				r->block, r->frame);
+		break;
+	default:
+		buf[0] = '\0';
+	}
+	return n;
+} /* }}} */
+
+const char * mmu_trace_opname(int op) /* {{{ */
+{
+	return op >= 0 && op < MMU_TRACE_NOPS ? opnames[op] : "unknown";
+} /* }}} */
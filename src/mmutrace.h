@@ -0,0 +1,114 @@
+/* This module emits the MMU event trace.  Events go to one of two sinks:
+ *
+ * - A compact binary trace.  Each thread fills its own chunk of a
+ *   memory-mapped file and only touches shared state, with one atomic add,
+ *   when it needs a new chunk, so recording takes no locks and makes no
+ *   system calls.  The file starts with a `struct mmu_trace_header`,
+ *   followed by chunks of MMU_TRACE_CHUNK_RECS records each.  Records with
+ *   `op` equal to MMU_TRACE_NONE are unused chunk space.  Records from
+ *   different threads interleave in the file; `seq` gives the global
+ *   order.
+ *
+ * - Text on stdout, the default, at one of three levels: full prints one
+ *   line per event, summary prints per-event counts at shutdown and off
+ *   prints nothing.  Threads that opt in with mmu_trace_buffered() format
+ *   lines into a private buffer and append it to the shared output buffer
+ *   once per mmu_trace_flush(), so the shared lock is taken once per
+ *   request instead of once per line. */
+
+#ifndef __MMUTRACE_HEADER__
+#define __MMUTRACE_HEADER__
+
+#include <stdint.h>
+
+#define MMU_TRACE_MAGIC "MMUTRACE"
+#define MMU_TRACE_VERSION 1
+#define MMU_TRACE_CHUNK_RECS 1024
+
+#define MMU_TRACE_NONE 0
+#define MMU_TRACE_CREATE 1       /* pager_create */
+#define MMU_TRACE_EXTEND 2       /* pager_extend; vaddr is the result */
+#define MMU_TRACE_SYSLOG 3       /* pager_syslog */
+#define MMU_TRACE_FAULT 4        /* pager_fault */
+#define MMU_TRACE_DESTROY 5      /* pager_destroy */
+#define MMU_TRACE_ZERO_FILL 6    /* mmu_zero_fill */
+#define MMU_TRACE_RESIDENT 7     /* mmu_resident */
+#define MMU_TRACE_NONRESIDENT 8  /* mmu_nonresident */
+#define MMU_TRACE_CHPROT 9       /* mmu_chprot, also once per batch entry */
+#define MMU_TRACE_DISK_READ 10   /* mmu_disk_read */
+#define MMU_TRACE_DISK_WRITE 11  /* mmu_disk_write */
+#define MMU_TRACE_COPY_FRAME 12  /* mmu_copy_frame; block is the source */
+#define MMU_TRACE_KILL 13        /* mmu_kill */
+#define MMU_TRACE_RELEASE 14     /* pager_release, once per page */
+#define MMU_TRACE_NOPS 15
+
+struct mmu_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t recsize;       /* sizeof(struct mmu_trace_rec) */
+	uint64_t start_ns;      /* CLOCK_REALTIME when recording started */
+	uint64_t nrecs;         /* records written */
+	uint64_t dropped;       /* records lost because the file was full */
+	char pad[24];
+};
+
+/* Fields that do not apply to `op` are -1 (or 0 for `vaddr`). */
+struct mmu_trace_rec {
+	uint64_t seq;
+	uint64_t ts;            /* ns since recording started */
+	uint64_t vaddr;
+	uint32_t id;            /* client id, as in the text output */
+	int32_t frame;
+	int32_t block;
+	int8_t prot;
+	uint8_t op;
+	uint16_t pad;
+};
+
+#define MMU_TRACE_OFF 0
+#define MMU_TRACE_SUMMARY 1
+#define MMU_TRACE_FULL 2
+
+/* This function starts recording to file =fn=, which may grow up to
+ * =maxbytes=, instead of printing text.  Returns 0 on success or -1 on
+ * error. */
+int mmu_trace_open(const char *fn, uint64_t maxbytes);
+
+/* This function sets the text level to MMU_TRACE_OFF, MMU_TRACE_SUMMARY
+ * or MMU_TRACE_FULL (the default). */
+void mmu_trace_level(int level);
+
+/* This function emits an event to the binary trace, if open, or as
+ * text. */
+void mmu_trace(int op, int id, const void *vaddr, int frame, int block,
+		int prot);
+
+/* This function makes the calling thread buffer its text until it calls
+ * mmu_trace_flush().  Other threads emit each line right away. */
+void mmu_trace_buffered(void);
+
+/* This function moves the calling thread's buffered text to the shared
+ * output buffer.  Call it before anything that lets other threads or
+ * processes observe the effects of the buffered events. */
+void mmu_trace_flush(void);
+
+/* This function writes the calling thread's text and the shared output
+ * buffer to stdout, then flushes stdio.  To keep text and stdio output in
+ * order, call it both before and after code that prints with stdio. */
+void mmu_trace_sync(void);
+
+/* This function prints the summary if the text level is summary, writes
+ * out all text, and closes the binary trace, trimming the file and
+ * reporting dropped records on stderr.  Other threads must not emit
+ * events concurrently. */
+void mmu_trace_close(void);
+
+/* This function formats =r= as one line of text into =buf=, which should
+ * hold at least MMU_TRACE_LINE_MAX bytes.  Returns the line length. */
+#define MMU_TRACE_LINE_MAX 128
+int mmu_trace_format(char *buf, const struct mmu_trace_rec *r);
+
+/* This function returns the name of event =op=. */
+const char * mmu_trace_opname(int op);
+
+#endif
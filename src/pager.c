@@ -2,25 +2,60 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
+#include "bitmap.h"
 #include "mmu.h"
 #include "pager.h"
+#include "pidtab.h"
+#include "policy.h"
 
-#define MAX_PROCS 128
 #define MAX_PAGES 256   /* 1MiB / 4KiB = 256 páginas */
+#define PROCS_HINT 128  /* tamanho inicial da tabela de processos */
 
-/* Informação de cada frame físico */
+/* Estados de um frame.  Um frame RESERVED foi entregue a um processo que
+ * está carregando uma página nele; o clock não mexe nesses frames.  O
+ * frame ZERO só contém o preenchimento do zero_fill e é mapeado só para
+ * leitura em todas as páginas que ainda não foram escritas (opção
+ * zeropage); nunca é evictado. */
+#define FRAME_FREE 0
+#define FRAME_RESERVED 1
+#define FRAME_USED 2
+#define FRAME_ZERO 3
+
+typedef struct ProcInfo ProcInfo;
+
+/* Uma das páginas que compartilham um frame (opção ksm). */
+typedef struct {
+    ProcInfo *proc;
+    int page;
+} Sharer;
+
+/* Informação de cada frame físico.  `state`, `pid`, `proc`, `page` e
+ * `sharers` só mudam com clock_lock, exceto na publicação RESERVED ->
+ * USED (ver load_page).  `ref` é escrito pelo dono e zerado pelo clock,
+ * por isso é atômico.
+ *
+ * Um frame com `nsharers` > 0 foi fundido pelo ksm: é mapeado só para
+ * leitura em todas as páginas de `sharers`, e `proc`/`page` é uma
+ * delas.  Seu conteúdo não muda mais; a primeira escrita numa das
+ * páginas lhe dá uma cópia própria. */
 typedef struct {
-    int used;           /* frame está em uso */
+    int state;          /* FRAME_FREE, FRAME_RESERVED ou FRAME_USED */
     pid_t pid;          /* dono do frame */
+    ProcInfo *proc;     /* entrada do dono, evita busca por pid */
     int page;           /* índice da página virtual do processo */
     int ref;            /* bit de referência (segunda chance) */
-    int prot;           /* PROT_NONE, PROT_READ ou PROT_READ|PROT_WRITE */
+    uint64_t sum;       /* hash do conteúdo na última passada do ksm */
+    Sharer *sharers;
+    int nsharers;       /* 0 se o frame não é compartilhado */
 } FrameInfo;
 
 /* Informação de cada bloco de disco */
@@ -35,18 +70,38 @@ typedef struct {
     int allocated;      /* página foi alocada via pager_extend */
     int resident;       /* está em algum frame físico? */
     int frame;          /* índice do frame, se resident */
-    int disk_block;     /* bloco de disco reservado */
+    int disk_block;     /* bloco de disco, ou -1 até a primeira escrita
+                           (zeropage ou overcommit) */
     int in_disk;        /* conteúdo válido salvo em disco? */
     int dirty;          /* página foi modificada desde o último write em disco? */
+    int prefetched;     /* trazida por readahead e ainda não acessada */
+    int zero;           /* mapeada no frame zero compartilhado */
+    int loading;        /* uma falta está trazendo a página, sem p->lock */
+    int prot;           /* PROT_NONE, PROT_READ ou PROT_READ|PROT_WRITE,
+                           se resident */
 } PageInfo;
 
-/* Informação de cada processo conhecido pelo pager */
-typedef struct {
-    int used;
+/* Informação de cada processo conhecido pelo pager.  `lock` protege
+ * `npages` e `pages`, inclusive o `prot` com que cada página está
+ * mapeada.  `loaded` sinaliza o fim de cada carga de página. */
+struct ProcInfo {
     pid_t pid;
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
     int npages;                 /* número de páginas alocadas */
     PageInfo pages[MAX_PAGES];
-} ProcInfo;
+    /* Detecção de acesso sequencial para o readahead. */
+    int ra_next;                /* página esperada na próxima falta */
+    int ra_window;              /* páginas trazidas à frente */
+    /* Mudanças de proteção acumuladas durante uma varredura do clock,
+     * enviadas de uma vez por flush_chprot().  Protegidos por
+     * clock_lock. */
+    struct mmu_chprot_entry *batch;
+    int nbatch;
+    ProcInfo *batch_next;
+    int killed;                 /* morto por falta de disco; as páginas
+                                   já foram liberadas */
+};
 
 /* ------------------------------------------------------------------ */
 /* Estado global do pager                                             */
@@ -54,171 +109,1015 @@ typedef struct {
 
 static FrameInfo *frames = NULL;
 static BlockInfo *blocks = NULL;
+static struct bitmap *free_frames = NULL;  /* frames livres, bit 1 = livre */
+static struct bitmap *free_blocks = NULL;  /* blocos livres, bit 1 = livre */
 static int g_nframes = 0;
 static int g_nblocks = 0;
 static long g_pagesize = 0;
-static int clock_hand = 0;          /* ponteiro do algoritmo clock */
-
-static ProcInfo procs[MAX_PROCS];
-
-static pthread_mutex_t pager_lock = PTHREAD_MUTEX_INITIALIZER;
+static int zero_frame = -1;     /* frame zero, se zeropage estiver ligado */
+/* Frames candidatos do ksm, indexados pelo hash do conteúdo.  Entradas
+ * podem estar velhas e são conferidas antes do uso.  Protegido por
+ * clock_lock. */
+static int *ksm_table = NULL;
+static uint64_t ksm_mask = 0;
+/* Com zeropage ou overcommit, pager_extend só reserva a quantidade de
+ * blocos, até `commit_limit`, e cada página ganha seu bloco na primeira
+ * escrita em disco.  Com overcommit o limite passa de g_nblocks, e o
+ * disco pode acabar antes.  Protegido por alloc_lock. */
+static int lazy_blocks = 0;
+static long commit_limit = 0;
+static long blocks_committed = 0;
+
+/* Política de substituição (clock por padrão) e seu estado.  Tudo é
+ * chamado com clock_lock, exceto on_access. */
+static const struct policy_ops *policy = NULL;
+static void *policy_state = NULL;
+static struct policy_env policy_env;
+
+/* pid -> ProcInfo*; entradas são alocadas em pager_create e liberadas
+ * em pager_destroy, então não há limite fixo de processos. */
+static struct pidtab *procs = NULL;
+
+/* Processos com mudanças de proteção pendentes, na ordem em que
+ * apareceram na varredura. */
+static ProcInfo *batch_head = NULL;
+static ProcInfo *batch_tail = NULL;
+
+/* Hierarquia de locks: clock_lock -> ProcInfo.lock -> alloc_lock.
+ * procs_lock é folha e só protege a tabela de processos.
+ *
+ * - clock_lock: frames livres, estado e dono dos frames, ponteiro do
+ *   clock e lotes de mudanças de proteção.  Quem evicta segura este lock
+ *   durante toda a evicção, então só há uma varredura por vez.
+ * - ProcInfo.lock: páginas de um processo.  Faltas em processos
+ *   diferentes rodam em paralelo.  Quem precisa de um frame novo solta o
+ *   lock do próprio processo antes de pegar o clock_lock.  Só quem tem o
+ *   clock_lock pode segurar os locks de dois processos ao mesmo tempo
+ *   (o ksm, ao fundir páginas).
+ * - alloc_lock: blocos de disco.
+ *
+ * Um processo com várias threads pode ter faltas, syslogs, extends e
+ * releases em paralelo, mas o mmu nunca chama pager_destroy junto com
+ * outra função do mesmo processo, então um ProcInfo não some enquanto o
+ * próprio processo o usa; os demais só o alcançam através de frames, com
+ * clock_lock.  Quem solta p->lock para carregar uma página a marca com
+ * `loading`, e as outras faltas nela esperam em `loaded`; só o oom_kill
+ * e o pager_release ainda podem liberá-la. */
+static pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t procs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Opções ajustáveis com pager_option(). */
+static struct {
+    int cleaner;            /* thread de limpeza ligada */
+    int cleaner_interval;   /* ms entre passadas da limpeza */
+    int cleaner_batch;      /* frames escritos por passada */
+    int stats;              /* imprime contadores no pager_shutdown */
+    int readahead;          /* máximo de páginas trazidas à frente */
+    int zeropage;           /* frame zero compartilhado e descarte de
+                               páginas só com preenchimento */
+    int ksm;                /* thread que funde páginas iguais ligada */
+    int ksm_interval;       /* ms entre passadas do ksm */
+    int ksm_batch;          /* frames examinados por passada */
+    int overcommit;         /* % de g_nblocks que pode ser prometido */
+} opts = { 0, 10, 16, 0, 0, 0, 0, 20, 64, 0 };
+
+/* Contadores, protegidos por clock_lock. */
+static struct {
+    unsigned long clean_evictions;  /* vítima já estava limpa */
+    unsigned long dirty_evictions;  /* vítima precisou de disk_write */
+    unsigned long cleaned;          /* frames escritos pela limpeza */
+    /* Atualizados com operações atômicas, sem clock_lock. */
+    unsigned long readahead_hits;   /* páginas antecipadas e usadas */
+    unsigned long readahead_waste;  /* antecipadas e descartadas sem uso */
+    unsigned long zero_maps;        /* leituras atendidas pelo frame zero */
+    unsigned long zero_writes;      /* escritas que tiraram a página dele */
+    unsigned long zero_drops;       /* páginas só com preenchimento que
+                                       não foram escritas em disco */
+    /* Protegidos por clock_lock. */
+    unsigned long ksm_merges;       /* páginas fundidas a outro frame */
+    unsigned long ksm_cow;          /* escritas que desfizeram a fusão */
+    unsigned long ksm_saved;        /* frames economizados agora */
+    unsigned long ksm_saved_max;    /* maior valor de ksm_saved */
+    unsigned long oom_kills;        /* processos mortos sem disco */
+} stats;
+
+/* Thread de limpeza: escreve em disco frames sujos e não referenciados
+ * antes que virem vítimas.  Tem seu próprio ponteiro, independente do
+ * clock. */
+static pthread_t cleaner_thread;
+static int cleaner_running = 0;
+static int cleaner_hand = 0;
+static pthread_mutex_t cleaner_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cleaner_cond = PTHREAD_COND_INITIALIZER;
+
+/* Thread do ksm: procura frames com o mesmo conteúdo e os funde.  Também
+ * tem seu próprio ponteiro. */
+static pthread_t ksm_thread;
+static int ksm_running = 0;
+static int ksm_hand = 0;
+static pthread_mutex_t ksm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ksm_cond = PTHREAD_COND_INITIALIZER;
 
 /* ------------------------------------------------------------------ */
 /* Funções auxiliares                                                 */
 /* ------------------------------------------------------------------ */
 
 static ProcInfo *find_proc(pid_t pid) {
-    for (int i = 0; i < MAX_PROCS; i++) {
-        if (procs[i].used && procs[i].pid == pid)
-            return &procs[i];
-    }
-    return NULL;
+    pthread_mutex_lock(&procs_lock);
+    ProcInfo *p = pidtab_get(procs, pid);
+    pthread_mutex_unlock(&procs_lock);
+    return p;
 }
 
 static ProcInfo *create_proc_entry(pid_t pid) {
-    for (int i = 0; i < MAX_PROCS; i++) {
-        if (!procs[i].used) {
-            procs[i].used = 1;
-            procs[i].pid = pid;
-            procs[i].npages = 0;
-            memset(procs[i].pages, 0, sizeof(procs[i].pages));
-            return &procs[i];
-        }
+    ProcInfo *p = calloc(1, sizeof(*p));
+    if (!p)
+        return NULL;
+    p->pid = pid;
+    p->npages = 0;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->loaded, NULL);
+    pthread_mutex_lock(&procs_lock);
+    int r = pidtab_put(procs, pid, p);
+    pthread_mutex_unlock(&procs_lock);
+    if (r == -1) {
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->loaded);
+        free(p);
+        return NULL;
     }
-    return NULL;
+    return p;
 }
 
 static int alloc_block(pid_t pid, int page_index) {
-    for (int i = 0; i < g_nblocks; i++) {
-        if (!blocks[i].used) {
-            blocks[i].used = 1;
-            blocks[i].pid = pid;
-            blocks[i].page = page_index;
-            return i;
-        }
+    pthread_mutex_lock(&alloc_lock);
+    int blk = bitmap_alloc(free_blocks);
+    if (blk >= 0) {
+        blocks[blk].used = 1;
+        blocks[blk].pid = pid;
+        blocks[blk].page = page_index;
     }
-    return -1;
+    pthread_mutex_unlock(&alloc_lock);
+    return blk;
 }
 
 static void free_block(int blk) {
     if (blk < 0 || blk >= g_nblocks) return;
+    pthread_mutex_lock(&alloc_lock);
     blocks[blk].used = 0;
     blocks[blk].pid = 0;
     blocks[blk].page = 0;
+    bitmap_release(free_blocks, blk);
+    pthread_mutex_unlock(&alloc_lock);
 }
 
-static int first_free_frame(void) {
-    for (int i = 0; i < g_nframes; i++) {
-        if (!frames[i].used)
-            return i;
-    }
-    return -1;
+/* Reserva um bloco sem escolher qual (lazy_blocks).  Retorna 0 se o
+ * limite foi atingido. */
+static int commit_block(void) {
+    pthread_mutex_lock(&alloc_lock);
+    int ok = blocks_committed < commit_limit;
+    if (ok)
+        blocks_committed++;
+    pthread_mutex_unlock(&alloc_lock);
+    return ok;
 }
 
-/* Escolhe vítima pelo algoritmo de segunda chance (clock). */
-static int choose_victim_frame(void) {
-    while (1) {
-        FrameInfo *f = &frames[clock_hand];
-
-        /* Se por acaso encontrar um frame livre, usa ele mesmo. */
-        if (!f->used) {
-            int idx = clock_hand;
-            clock_hand = (clock_hand + 1) % g_nframes;
-            return idx;
-        }
+static void uncommit_block(void) {
+    pthread_mutex_lock(&alloc_lock);
+    blocks_committed--;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+/* Bloco de disco da página `page` de `p`, alocado aqui na primeira
+ * escrita em disco com lazy_blocks.  Só falha com overcommit, quando o
+ * disco acabou; sem ele pager_extend reservou um bloco para cada
+ * página.  Chamada com p->lock. */
+static int page_block(ProcInfo *p, int page) {
+    PageInfo *pg = &p->pages[page];
+    if (pg->disk_block < 0)
+        pg->disk_block = alloc_block(p->pid, page);
+    return pg->disk_block;
+}
+
+/* O frame só contém o preenchimento do mmu_zero_fill?  O pager só lê a
+ * pmem. */
+static int frame_is_zero(int frame) {
+    const char *m = pmem + (size_t)frame * g_pagesize;
+    return m[0] == '0' && memcmp(m, m + 1, g_pagesize - 1) == 0;
+}
+
+/* Descarta a cópia em disco de uma página que só tem preenchimento: o
+ * próximo acesso volta a mapear o frame zero.  Chamada com p->lock. */
+static void drop_zero_page(PageInfo *pg) {
+    free_block(pg->disk_block);
+    pg->disk_block = -1;
+    pg->in_disk = 0;
+    pg->dirty = 0;
+    __atomic_add_fetch(&stats.zero_drops, 1, __ATOMIC_RELAXED);
+}
+
+static inline int frame_state(FrameInfo *f) {
+    return __atomic_load_n(&f->state, __ATOMIC_ACQUIRE);
+}
+
+static inline void frame_set_state(FrameInfo *f, int state) {
+    __atomic_store_n(&f->state, state, __ATOMIC_RELEASE);
+}
 
-        /* Se ref == 0, este frame pode ser vítima. */
-        if (f->ref == 0) {
-            int idx = clock_hand;
-            clock_hand = (clock_hand + 1) % g_nframes;
-            return idx;
+static inline int frame_ref(FrameInfo *f) {
+    return __atomic_load_n(&f->ref, __ATOMIC_RELAXED);
+}
+
+static inline void frame_set_ref(FrameInfo *f, int ref) {
+    __atomic_store_n(&f->ref, ref, __ATOMIC_RELAXED);
+}
+
+/* Lido com o lock do dono da página: só deixa de ser 0 com ele (ver
+ * ksm_merge). */
+static inline int frame_shared(FrameInfo *f) {
+    return __atomic_load_n(&f->nsharers, __ATOMIC_ACQUIRE) != 0;
+}
+
+/* Proteção de uma página residente que volta a ser acessada: gravável
+ * só se já estiver suja e o frame não for compartilhado. */
+static int restore_prot(PageInfo *pg) {
+    if (pg->dirty && !frame_shared(&frames[pg->frame]))
+        return PROT_READ | PROT_WRITE;
+    return PROT_READ;
+}
+
+/* Tira a página `page` de `p` da lista do frame compartilhado `frame`.
+ * Se sobrar uma só, o frame passa a ser dela.  Chamada com
+ * clock_lock. */
+static void unshare_frame(int frame, ProcInfo *p, int page) {
+    FrameInfo *f = &frames[frame];
+    int n = f->nsharers;
+    for (int k = 0; k < n; k++) {
+        if (f->sharers[k].proc == p && f->sharers[k].page == page) {
+            f->sharers[k] = f->sharers[--n];
+            break;
         }
+    }
+    f->proc = f->sharers[0].proc;
+    f->pid = f->proc->pid;
+    f->page = f->sharers[0].page;
+    if (n == 1) {
+        free(f->sharers);
+        f->sharers = NULL;
+        n = 0;
+    }
+    __atomic_store_n(&f->nsharers, n, __ATOMIC_RELEASE);
+    stats.ksm_saved--;
+}
 
-        /* Segunda chance: zera ref e tira permissão (PROT_NONE). */
-        ProcInfo *p = find_proc(f->pid);
-        if (p) {
-            void *vaddr = (void *)(UVM_BASEADDR +
-                                   (intptr_t)f->page * g_pagesize);
-            mmu_chprot(f->pid, vaddr, PROT_NONE);
-            f->prot = PROT_NONE;
-            f->ref = 0;
+/* Marca o frame como livre tanto na tabela quanto no bitmap.  Chamada
+ * com clock_lock. */
+static void free_frame(int frame) {
+    FrameInfo *f = &frames[frame];
+    policy->on_evict(policy_state, frame);
+    f->pid  = 0;
+    f->proc = NULL;
+    f->page = -1;
+    f->sum = 0;
+    frame_set_ref(f, 0);
+    frame_set_state(f, FRAME_FREE);
+    bitmap_release(free_frames, frame);
+}
+
+/* Envia todas as mudanças de proteção pendentes, uma troca de
+ * mensagens por processo, e atualiza o `prot` das páginas com o lock do
+ * dono.  Chamada com clock_lock, que impede os donos de sumirem. */
+static void flush_chprot(void) {
+    ProcInfo *p = batch_head;
+    while (p) {
+        ProcInfo *next = p->batch_next;
+        pthread_mutex_lock(&p->lock);
+        mmu_chprot_batch(p->pid, p->batch, p->nbatch);
+        for (int i = 0; i < p->nbatch; i++) {
+            intptr_t off = (intptr_t)p->batch[i].vaddr - UVM_BASEADDR;
+            PageInfo *pg = &p->pages[off / g_pagesize];
+            if (pg->resident)
+                pg->prot = p->batch[i].prot;
         }
+        pthread_mutex_unlock(&p->lock);
+        p->nbatch = 0;
+        p->batch_next = NULL;
+        p = next;
+    }
+    batch_head = batch_tail = NULL;
+}
 
-        clock_hand = (clock_hand + 1) % g_nframes;
+/* Acumula a mudança de proteção de `page` do processo `p`.  Se não
+ * houver memória para o lote, envia a mudança imediatamente. */
+static void batch_chprot(ProcInfo *p, int page, int prot) {
+    void *vaddr = (void *)(UVM_BASEADDR + (intptr_t)page * g_pagesize);
+    if (!p->batch)
+        p->batch = malloc(MAX_PAGES * sizeof(*p->batch));
+    if (!p->batch) {
+        pthread_mutex_lock(&p->lock);
+        mmu_chprot(p->pid, vaddr, prot);
+        p->pages[page].prot = prot;
+        pthread_mutex_unlock(&p->lock);
+        return;
     }
+    if (p->nbatch == MAX_PAGES)
+        flush_chprot();
+    if (p->nbatch == 0) {
+        if (batch_tail) batch_tail->batch_next = p;
+        else batch_head = p;
+        batch_tail = p;
+    }
+    p->batch[p->nbatch].vaddr = vaddr;
+    p->batch[p->nbatch].prot = prot;
+    p->nbatch++;
 }
 
-/* Evicta a página atualmente no frame `frame` para o disco. */
-static void evict_frame(int frame) {
+/* Serviços oferecidos à política de substituição (ver policy.h).
+ * Chamados com clock_lock. */
+static int policy_evictable(int frame) {
+    return frame_state(&frames[frame]) == FRAME_USED;
+}
+
+/* Zerar ref tira a permissão da página (PROT_NONE), ou de todas as que
+ * compartilham o frame, para que o próximo acesso gere falta e marque
+ * ref de novo. */
+static int policy_test_and_clear_ref(int frame) {
+    FrameInfo *f = &frames[frame];
+    if (frame_ref(f) == 0)
+        return 0;
+    if (f->nsharers) {
+        for (int k = 0; k < f->nsharers; k++)
+            batch_chprot(f->sharers[k].proc, f->sharers[k].page, PROT_NONE);
+    } else {
+        batch_chprot(f->proc, f->page, PROT_NONE);
+    }
+    frame_set_ref(f, 0);
+    return 1;
+}
+
+/* Lido sem o lock do dono: é só uma dica. */
+static int policy_dirty(int frame) {
     FrameInfo *f = &frames[frame];
-    if (!f->used)
+    return f->proc->pages[f->page].dirty;
+}
+
+/* Avisa a política que `page` de `p` vai ocupar `frame`.  Chamada com
+ * clock_lock, logo após reservar o frame. */
+static void policy_fault(int frame, ProcInfo *p, int page) {
+    uint64_t key = ((uint64_t)(uint32_t)p->pid << 32) | (uint32_t)page;
+    policy->on_fault(policy_state, frame, key);
+}
+
+/* Escolhe vítima pela política configurada.  As páginas que perdem o
+ * bit de referência perdem a permissão em lote, antes de a vítima ser
+ * devolvida.  Retorna -1 se todos os frames estiverem reservados por
+ * outras faltas em andamento.  Chamada com clock_lock. */
+static int choose_victim_frame(void) {
+    int idx = policy->choose_victim(policy_state);
+    flush_chprot();
+    return idx;
+}
+
+/* Libera os frames e blocos de todas as páginas de `p`.  Com `unmap`,
+ * tira antes as páginas do espaço de endereçamento do processo, que
+ * ainda está vivo.  Um frame compartilhado fica com as outras páginas.
+ * Chamada com clock_lock e p->lock. */
+static void release_page(ProcInfo *p, int i, int unmap) {
+    PageInfo *pg = &p->pages[i];
+    if (unmap && (pg->resident || pg->zero))
+        mmu_nonresident(p->pid, (void *)(UVM_BASEADDR +
+                                         (intptr_t)i * g_pagesize));
+    if (pg->resident && pg->frame >= 0 && pg->frame < g_nframes) {
+        if (frames[pg->frame].nsharers)
+            unshare_frame(pg->frame, p, i);
+        else
+            free_frame(pg->frame);
+    }
+    if (pg->prefetched)
+        __atomic_add_fetch(&stats.readahead_waste, 1, __ATOMIC_RELAXED);
+
+    if (pg->disk_block >= 0)
+        free_block(pg->disk_block);
+    if (lazy_blocks)
+        uncommit_block();
+
+    pg->allocated = 0;
+    pg->resident  = 0;
+    pg->frame     = -1;
+    pg->disk_block = -1;
+    pg->in_disk   = 0;
+    pg->dirty     = 0;
+    pg->prefetched = 0;
+    pg->zero      = 0;
+}
+
+static void release_pages(ProcInfo *p, int unmap) {
+    for (int i = 0; i < p->npages; i++) {
+        if (p->pages[i].allocated)
+            release_page(p, i, unmap);
+    }
+}
+
+/* Páginas de `p` que ocupam frame ou bloco.  Lido sem o lock do dono:
+ * é só uma dica. */
+static int proc_footprint(ProcInfo *p) {
+    int n = 0;
+    for (int i = 0; i < p->npages; i++)
+        n += p->pages[i].resident || p->pages[i].disk_block >= 0;
+    return n;
+}
+
+struct oom_choice {
+    ProcInfo *proc;
+    int footprint;
+};
+
+static void oom_pick(pid_t pid, void *value, void *arg) {
+    (void)pid;
+    ProcInfo *p = value;
+    struct oom_choice *c = arg;
+    if (p->killed)
         return;
+    int n = proc_footprint(p);
+    if (!c->proc || n > c->footprint) {
+        c->proc = p;
+        c->footprint = n;
+    }
+}
 
-    ProcInfo *p = find_proc(f->pid);
+/* Não há bloco livre para uma página suja (overcommit): mata o processo
+ * que ocupa mais frames e blocos e os libera na hora.  O mmu chama
+ * pager_destroy quando a conexão dele cair.  Chamada com clock_lock e
+ * sem nenhum lock de processo; pager_destroy precisa do clock_lock, então
+ * o processo escolhido não some. */
+static void oom_kill(void) {
+    struct oom_choice c = { NULL, 0 };
+    pthread_mutex_lock(&procs_lock);
+    pidtab_foreach(procs, oom_pick, &c);
+    pthread_mutex_unlock(&procs_lock);
+    ProcInfo *p = c.proc;
     if (!p)
         return;
 
-    if (f->page < 0 || f->page >= MAX_PAGES)
-        return;
+    pthread_mutex_lock(&p->lock);
+    release_pages(p, 1);
+    p->killed = 1;
+    pthread_mutex_unlock(&p->lock);
+    mmu_kill(p->pid);
+    stats.oom_kills++;
+}
 
-    PageInfo *pg = &p->pages[f->page];
-    if (!pg->allocated || !pg->resident)
-        return;
+/* Tira da memória a página `page` de `p`, que está no frame `frame`,
+ * escrevendo-a no seu bloco se estiver suja.  Retorna 0 se a página não
+ * estava residente e -1 se ela está suja e não há bloco livre para ela
+ * (overcommit); nesses casos a página continua onde estava.  Chamada
+ * com clock_lock e sem nenhum lock de processo. */
+static int evict_page(ProcInfo *p, int page, int frame) {
+    pthread_mutex_lock(&p->lock);
+    PageInfo *pg = &p->pages[page];
+    if (!pg->allocated || !pg->resident) {
+        pthread_mutex_unlock(&p->lock);
+        return 0;
+    }
 
-    void *vaddr = (void *)(UVM_BASEADDR +
-                           (intptr_t)f->page * g_pagesize);
+    if (pg->dirty && pg->disk_block < 0 &&
+            !(opts.zeropage && frame_is_zero(frame)) &&
+            page_block(p, page) < 0) {
+        pthread_mutex_unlock(&p->lock);
+        return -1;
+    }
+
+    void *vaddr = (void *)(UVM_BASEADDR + (intptr_t)page * g_pagesize);
 
     /* O professor espera: primeiro NONRESIDENT, depois DISK_WRITE. */
     mmu_nonresident(p->pid, vaddr);
 
-    /* Escreve em disco apenas se a página estiver suja. */
-    if (pg->dirty && pg->disk_block >= 0) {
-        mmu_disk_write(frame, pg->disk_block);
+    /* Escreve em disco apenas se a página estiver suja.  Com zeropage,
+     * páginas só com preenchimento são descartadas. */
+    if (opts.zeropage && (pg->dirty || pg->in_disk) &&
+            frame_is_zero(frame)) {
+        drop_zero_page(pg);
+        stats.clean_evictions++;
+    } else if (pg->dirty && page_block(p, page) >= 0) {
+        mmu_disk_write_async(frame, pg->disk_block);
         pg->in_disk = 1;
         pg->dirty = 0;      /* disco agora tem a cópia atual */
+        stats.dirty_evictions++;
+    } else if (pg->dirty) {
+        /* Deixou de ser só preenchimento depois do teste acima e não há
+         * bloco para ela. */
+        mmu_resident(p->pid, vaddr, frame, pg->prot);
+        pthread_mutex_unlock(&p->lock);
+        return -1;
+    } else {
+        stats.clean_evictions++;
     }
 
     pg->resident = 0;
     pg->frame = -1;
+    if (pg->prefetched) {
+        pg->prefetched = 0;
+        __atomic_add_fetch(&stats.readahead_waste, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return 1;
+}
 
-    f->used = 0;
-    f->pid = 0;
-    f->page = -1;
-    f->ref = 0;
-    f->prot = PROT_NONE;
+/* Evicta a página atualmente no frame `frame` para o disco, ou todas as
+ * que o compartilham.  Chamada com clock_lock e sem nenhum lock de
+ * processo.  A escrita só é iniciada: o mmu faz quem usar o frame ou o
+ * bloco depois esperar por ela, então o clock_lock é solto sem esperar
+ * o disco. */
+static void evict_frame(int frame) {
+    FrameInfo *f = &frames[frame];
+    if (frame_state(f) != FRAME_USED)
+        return;
+
+    if (f->nsharers) {
+        Sharer *s = f->sharers;
+        int n = f->nsharers;
+        /* Garante antes um bloco para cada página suja, para não evictar
+         * só uma parte delas. */
+        for (int k = 0; k < n; k++) {
+            PageInfo *pg = &s[k].proc->pages[s[k].page];
+            pthread_mutex_lock(&s[k].proc->lock);
+            int ok = !pg->dirty || page_block(s[k].proc, s[k].page) >= 0;
+            pthread_mutex_unlock(&s[k].proc->lock);
+            if (!ok) {
+                oom_kill();
+                return;
+            }
+        }
+        for (int k = 0; k < n; k++)
+            evict_page(s[k].proc, s[k].page, frame);
+        f->sharers = NULL;
+        __atomic_store_n(&f->nsharers, 0, __ATOMIC_RELEASE);
+        free(s);
+        stats.ksm_saved -= n - 1;
+        free_frame(frame);
+        return;
+    }
+
+    ProcInfo *p = f->proc;
+    if (!p)
+        return;
+
+    if (f->page < 0 || f->page >= MAX_PAGES)
+        return;
+
+    int r = evict_page(p, f->page, frame);
+    if (r > 0)
+        free_frame(frame);
+    else if (r < 0)
+        oom_kill();
 }
 
+/* Reserva um frame para carregar a página `page` de `p`: o livre de
+ * menor índice ou, se não houver, o de uma vítima da política.  Após a
+ * evicção o frame da vítima é o único livre, então bitmap_alloc()
+ * devolve exatamente ele.  Não pode ser chamada com lock de processo. */
+static int get_frame(ProcInfo *p, int page) {
+    pthread_mutex_lock(&clock_lock);
+    int frame = bitmap_alloc(free_frames);
+    while (frame < 0) {
+        int victim = choose_victim_frame();
+        if (victim < 0) {
+            /* Todos reservados: espera as outras faltas publicarem. */
+            pthread_mutex_unlock(&clock_lock);
+            sched_yield();
+            pthread_mutex_lock(&clock_lock);
+        } else {
+            evict_frame(victim);
+        }
+        frame = bitmap_alloc(free_frames);
+    }
+    frame_set_state(&frames[frame], FRAME_RESERVED);
+    policy_fault(frame, p, page);
+    pthread_mutex_unlock(&clock_lock);
+    return frame;
+}
 
-/* Garante que a página `page_index` do processo `p` esteja residente.
- * Retorna o índice do frame físico que contém a página.  Esta função
- * é usada tanto pelo pager_fault (para páginas não residentes) quanto
- * pelo pager_syslog.  Ela se comporta como um acesso de LEITURA. */
-static int ensure_page_resident(ProcInfo *p, int page_index) {
-    PageInfo *pg = &p->pages[page_index];
 
-    /* Já residente: apenas marca como referenciada e, se estiver com
-     * PROT_NONE (segunda chance), restaura o prot adequado. */
-    if (pg->resident) {
-        int frame = pg->frame;
-        FrameInfo *f = &frames[frame];
+/* Escreve em disco o frame sob o ponteiro da limpeza se ele estiver sujo
+ * e não referenciado.  A página volta a PROT_READ antes da cópia para
+ * que novas escritas gerem falta e a marquem suja de novo.  Retorna 1 se
+ * escreveu algo. */
+static int clean_one(void) {
+    pthread_mutex_lock(&clock_lock);
+    int frame = cleaner_hand;
+    cleaner_hand = (cleaner_hand + 1) % g_nframes;
+    FrameInfo *f = &frames[frame];
+    if (frame_state(f) != FRAME_USED || frame_ref(f) || f->nsharers) {
+        pthread_mutex_unlock(&clock_lock);
+        return 0;
+    }
+    /* Com o lock do dono o frame não é evictado nem o processo
+     * destruído, então o clock_lock pode ser solto antes do disk_write. */
+    ProcInfo *p = f->proc;
+    pthread_mutex_lock(&p->lock);
+    pthread_mutex_unlock(&clock_lock);
 
-        if (f->prot == PROT_NONE) {
+    PageInfo *pg = &p->pages[f->page];
+    int cleaned = 0;
+    if (pg->resident && pg->frame == frame && pg->dirty &&
+            page_block(p, f->page) >= 0) {
+        if (pg->prot & PROT_WRITE) {
             void *vaddr = (void *)(UVM_BASEADDR +
-                                   (intptr_t)page_index * g_pagesize);
-            int newprot = pg->dirty ? (PROT_READ | PROT_WRITE) : PROT_READ;
-            mmu_chprot(p->pid, vaddr, newprot);
-            f->prot = newprot;
+                                   (intptr_t)f->page * g_pagesize);
+            mmu_chprot(p->pid, vaddr, PROT_READ);
+            pg->prot = PROT_READ;
+        }
+        if (opts.zeropage && frame_is_zero(frame)) {
+            drop_zero_page(pg);
+        } else {
+            mmu_disk_write_async(frame, pg->disk_block);
+            pg->in_disk = 1;
+            pg->dirty = 0;
+            cleaned = 1;
         }
+    }
+    pthread_mutex_unlock(&p->lock);
 
-        f->ref = 1;
-        return frame;
+    if (cleaned) {
+        pthread_mutex_lock(&clock_lock);
+        stats.cleaned++;
+        pthread_mutex_unlock(&clock_lock);
+    }
+    return cleaned;
+}
+
+static void *cleaner_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&cleaner_lock);
+    while (cleaner_running) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += (long)opts.cleaner_interval * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&cleaner_cond, &cleaner_lock, &ts);
+        if (!cleaner_running)
+            break;
+        pthread_mutex_unlock(&cleaner_lock);
+
+        /* Percorre no máximo uma volta, parando após cleaner_batch
+         * escritas. */
+        int written = 0;
+        for (int i = 0; i < g_nframes && written < opts.cleaner_batch; i++)
+            written += clean_one();
+        mmu_disk_submit();
+
+        pthread_mutex_lock(&cleaner_lock);
+    }
+    pthread_mutex_unlock(&cleaner_lock);
+    return NULL;
+}
+
+/* Dá à página `page` de `p`, mapeada só para leitura num frame
+ * compartilhado, uma cópia própria e gravável.  Chamada com p->lock, que
+ * é solto enquanto se obtém um frame; se nesse meio tempo a página saiu
+ * do frame compartilhado, não faz nada e a escrita gera nova falta. */
+static void unshare_page(ProcInfo *p, int page) {
+    pthread_mutex_unlock(&p->lock);
+    int frame = get_frame(p, page);
+    pthread_mutex_lock(&clock_lock);
+    pthread_mutex_lock(&p->lock);
+
+    PageInfo *pg = &p->pages[page];
+    if (!pg->resident || !frames[pg->frame].nsharers) {
+        free_frame(frame);
+        pthread_mutex_unlock(&clock_lock);
+        return;
+    }
+
+    mmu_copy_frame(pg->frame, frame);
+    unshare_frame(pg->frame, p, page);
+
+    void *vaddr = (void *)(UVM_BASEADDR + (intptr_t)page * g_pagesize);
+    mmu_resident(p->pid, vaddr, frame, PROT_READ | PROT_WRITE);
+
+    FrameInfo *f = &frames[frame];
+    f->pid = p->pid;
+    f->proc = p;
+    f->page = page;
+    frame_set_ref(f, 1);
+    frame_set_state(f, FRAME_USED);
+
+    pg->frame = frame;
+    pg->prot = PROT_READ | PROT_WRITE;
+    pg->dirty = 1;
+    stats.ksm_cow++;
+    pthread_mutex_unlock(&clock_lock);
+}
+
+/* Hash do conteúdo de um frame (FNV-1a sobre palavras de 64 bits). */
+static uint64_t frame_hash(int frame) {
+    const uint64_t *w =
+        (const uint64_t *)(pmem + (size_t)frame * g_pagesize);
+    uint64_t h = 14695981039346656037ULL;
+    for (long i = 0; i < g_pagesize / 8; i++)
+        h = (h ^ w[i]) * 1099511628211ULL;
+    return h;
+}
+
+/* Passa a página `page` de `p`, no frame `frame`, a usar o frame
+ * `other`, que tem o mesmo conteúdo, se o conteúdo de `other` também não
+ * puder mudar sem falta.  O dono de `other` é travado na primeira fusão,
+ * quando o frame passa a ser compartilhado.  Retorna 1 se fundiu.
+ * Chamada com clock_lock e p->lock. */
+static int ksm_merge(ProcInfo *p, int page, int frame, int other) {
+    FrameInfo *o = &frames[other];
+    ProcInfo *q = o->proc;
+    int n = o->nsharers;
+    int locked = n == 0 && q != p;
+    int merged = 0;
+
+    if (memcmp(pmem + (size_t)frame * g_pagesize,
+               pmem + (size_t)other * g_pagesize, g_pagesize) != 0)
+        return 0;
+
+    if (locked)
+        pthread_mutex_lock(&q->lock);
+    if (n == 0) {
+        PageInfo *qg = &q->pages[o->page];
+        if (!qg->resident || qg->frame != other || (qg->prot & PROT_WRITE))
+            goto out;
+    }
+
+    Sharer *s = realloc(o->sharers, (n ? n + 1 : 2) * sizeof(*s));
+    if (!s)
+        goto out;
+    if (n == 0)
+        s[n++] = (Sharer){ q, o->page };
+    s[n++] = (Sharer){ p, page };
+    o->sharers = s;
+
+    void *vaddr = (void *)(UVM_BASEADDR + (intptr_t)page * g_pagesize);
+    mmu_resident(p->pid, vaddr, other, PROT_READ);
+    PageInfo *pg = &p->pages[page];
+    pg->frame = other;
+    pg->prot = PROT_READ;
+    __atomic_store_n(&o->nsharers, n, __ATOMIC_RELEASE);
+
+    stats.ksm_merges++;
+    if (++stats.ksm_saved > stats.ksm_saved_max)
+        stats.ksm_saved_max = stats.ksm_saved;
+    merged = 1;
+out:
+    if (locked)
+        pthread_mutex_unlock(&q->lock);
+    return merged;
+}
+
+/* Examina o frame sob o ponteiro do ksm.  Se a página não for gravável
+ * e houver outro frame com o mesmo conteúdo, ela passa a usá-lo e seu
+ * frame é liberado; com zeropage, páginas só com preenchimento voltam
+ * ao frame zero.  Páginas graváveis só são consideradas se o hash não
+ * mudou desde a passada anterior, e então perdem a escrita.  Retorna 1
+ * se liberou o frame. */
+static int ksm_scan_one(void) {
+    pthread_mutex_lock(&clock_lock);
+    int frame = ksm_hand;
+    ksm_hand = (ksm_hand + 1) % g_nframes;
+    FrameInfo *f = &frames[frame];
+    if (frame_state(f) != FRAME_USED || f->nsharers) {
+        pthread_mutex_unlock(&clock_lock);
+        return 0;
+    }
+    ProcInfo *p = f->proc;
+    int page = f->page;
+    pthread_mutex_lock(&p->lock);
+
+    PageInfo *pg = &p->pages[page];
+    void *vaddr = (void *)(UVM_BASEADDR + (intptr_t)page * g_pagesize);
+    int freed = 0;
+    if (!pg->resident || pg->frame != frame)
+        goto out;
+
+    uint64_t sum = frame_hash(frame);
+    if (pg->prot & PROT_WRITE) {
+        if (sum != f->sum) {
+            f->sum = sum;
+            goto out;
+        }
+        mmu_chprot(p->pid, vaddr, PROT_READ);
+        pg->prot = PROT_READ;
+        sum = frame_hash(frame);
+    }
+    f->sum = sum;
+
+    if (opts.zeropage && frame_is_zero(frame)) {
+        mmu_resident(p->pid, vaddr, zero_frame, PROT_READ);
+        if (pg->dirty || pg->in_disk)
+            drop_zero_page(pg);
+        pg->resident = 0;
+        pg->frame = -1;
+        pg->prefetched = 0;
+        pg->zero = 1;
+        stats.ksm_merges++;
+        freed = 1;
+        goto out;
+    }
+
+    int *slot = &ksm_table[sum & ksm_mask];
+    int other = *slot;
+    if (other >= 0 && other != frame &&
+            frame_state(&frames[other]) == FRAME_USED &&
+            frames[other].sum == sum && ksm_merge(p, page, frame, other))
+        freed = 1;
+    else
+        *slot = frame;
+out:
+    pthread_mutex_unlock(&p->lock);
+    if (freed)
+        free_frame(frame);
+    pthread_mutex_unlock(&clock_lock);
+    return freed;
+}
+
+static void *ksm_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&ksm_lock);
+    while (ksm_running) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += (long)opts.ksm_interval * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&ksm_cond, &ksm_lock, &ts);
+        if (!ksm_running)
+            break;
+        pthread_mutex_unlock(&ksm_lock);
+
+        for (int i = 0; i < opts.ksm_batch; i++)
+            ksm_scan_one();
+
+        pthread_mutex_lock(&ksm_lock);
+    }
+    pthread_mutex_unlock(&ksm_lock);
+    return NULL;
+}
+
+/* Começa a carregar a página `page_index` de `p` num frame livre sem
+ * evictar ninguém.  Chamada com p->lock; como a ordem dos locks é
+ * clock_lock -> processo, só tenta pegar o clock_lock.  Retorna o frame
+ * reservado ou -1 se não houver frame livre disponível. */
+static int prefetch_start(ProcInfo *p, int page_index) {
+    if (pthread_mutex_trylock(&clock_lock) != 0)
+        return -1;
+    int frame = bitmap_alloc(free_frames);
+    if (frame >= 0) {
+        frame_set_state(&frames[frame], FRAME_RESERVED);
+        policy_fault(frame, p, page_index);
+    }
+    pthread_mutex_unlock(&clock_lock);
+    if (frame < 0)
+        return -1;
+
+    PageInfo *pg = &p->pages[page_index];
+    if (pg->in_disk && pg->disk_block >= 0) {
+        mmu_disk_read_async(pg->disk_block, frame);
+    } else {
+        mmu_zero_fill(frame);
+    }
+    return frame;
+}
+
+/* Mapeia com `prot` a página carregada por prefetch_start() e publica o
+ * frame.  mmu_resident espera a leitura terminar.  Chamada com p->lock. */
+static void prefetch_finish(ProcInfo *p, int page_index, int frame,
+                            int prot) {
+    void *vaddr = (void *)(UVM_BASEADDR +
+                           (intptr_t)page_index * g_pagesize);
+    mmu_resident(p->pid, vaddr, frame, prot);
+
+    /* ref = 0: páginas especulativas são as primeiras vítimas. */
+    FrameInfo *f = &frames[frame];
+    f->pid = p->pid;
+    f->proc = p;
+    f->page = page_index;
+    frame_set_ref(f, 0);
+    frame_set_state(f, FRAME_USED);
+
+    PageInfo *pg = &p->pages[page_index];
+    pg->resident = 1;
+    pg->frame = frame;
+    pg->prot = prot;
+    pg->dirty = 0;
+    pg->prefetched = 1;
+}
+
+/* Traz até p->ra_window páginas depois de `page_index`, parando na
+ * primeira sem frame livre.  As leituras da janela vão juntas para o
+ * disco antes do primeiro mapeamento.  As páginas são mapeadas com
+ * PROT_READ, para que a leitura sequencial não gere faltas, exceto a
+ * última trazida, que fica com PROT_NONE e serve de marcador: a falta
+ * nela indica que o processo percorreu a janela e dispara a próxima.
+ * Sem o marcador numa janela incompleta a janela pararia de crescer.
+ * Chamada com p->lock. */
+static void readahead(ProcInfo *p, int page_index) {
+    int todo[MAX_PAGES];
+    int started[MAX_PAGES];
+    int n = 0;
+    int last = page_index + p->ra_window;
+    if (last >= p->npages)
+        last = p->npages - 1;
+    for (int i = page_index + 1; i <= last; i++) {
+        PageInfo *pg = &p->pages[i];
+        /* Com zeropage, páginas fora do disco já são servidas pelo frame
+         * zero. */
+        if (pg->allocated && !pg->resident && !pg->loading &&
+                (pg->in_disk || !opts.zeropage))
+            todo[n++] = i;
+    }
+    int m = 0;
+    while (m < n && (started[m] = prefetch_start(p, todo[m])) != -1)
+        m++;
+    mmu_disk_submit();
+    for (int i = 0; i < m; i++) {
+        int prot = (i == m - 1) ? PROT_NONE : PROT_READ;
+        prefetch_finish(p, todo[i], started[i], prot);
+        p->ra_next = todo[i] + 1;
+    }
+}
+
+/* O processo chegou a `page_index` em ordem: as páginas antecipadas
+ * logo antes dela foram usadas sem gerar falta.  Conta os acertos e as
+ * marca como referenciadas. */
+static void readahead_credit(ProcInfo *p, int page_index) {
+    for (int i = page_index; i >= 0 && p->pages[i].prefetched; i--) {
+        PageInfo *pg = &p->pages[i];
+        pg->prefetched = 0;
+        frame_set_ref(&frames[pg->frame], 1);
+        __atomic_add_fetch(&stats.readahead_hits, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void readahead_grow(ProcInfo *p) {
+    p->ra_window = p->ra_window ? 2 * p->ra_window : 1;
+    if (p->ra_window > opts.readahead)
+        p->ra_window = opts.readahead;
+}
+
+/* Atualiza a detecção de acesso sequencial numa falta que precisou
+ * carregar `page_index`: a janela dobra enquanto os acessos seguem em
+ * ordem e zera quando o padrão quebra. */
+static void readahead_miss(ProcInfo *p, int page_index) {
+    if (!opts.readahead)
+        return;
+    if (page_index == p->ra_next) {
+        if (page_index > 0)
+            readahead_credit(p, page_index - 1);
+        readahead_grow(p);
+    } else {
+        p->ra_window = 0;
     }
+    p->ra_next = page_index + 1;
+    readahead(p, page_index);
+}
+
+/* Primeira falta numa página antecipada (o marcador ou uma escrita):
+ * conta os acertos e mantém a janela à frente do acesso. */
+static void readahead_hit(ProcInfo *p, int page_index) {
+    if (!p->pages[page_index].prefetched)
+        return;
+    readahead_credit(p, page_index);
+    readahead_grow(p);
+    p->ra_next = page_index + 1;
+    readahead(p, page_index);
+}
 
-    /* Precisa de frame novo. */
-    int frame = first_free_frame();
-    if (frame < 0) {
-        frame = choose_victim_frame();
-        evict_frame(frame);
+/* Espera outra falta terminar de carregar a página `page_index` de `p`.
+ * Chamada com p->lock. */
+static void wait_page_loaded(ProcInfo *p, int page_index) {
+    while (p->pages[page_index].loading)
+        pthread_cond_wait(&p->loaded, &p->lock);
+}
+
+/* Carrega a página não residente `page_index` de `p` num frame próprio
+ * e a mapeia com `prot`; com PROT_WRITE a página já nasce suja.  Retorna
+ * o frame, ou -1 se o processo foi morto ou a página liberada enquanto
+ * isso.  Chamada com p->lock, que é solto enquanto se obtém um frame. */
+static int load_page(ProcInfo *p, int page_index, int prot) {
+    PageInfo *pg = &p->pages[page_index];
+
+    /* Precisa de frame novo.  Enquanto o lock está solto, `loading`
+     * segura outras faltas na página e o readahead; só o oom_kill e o
+     * pager_release ainda podem liberá-la. */
+    pg->loading = 1;
+    pthread_mutex_unlock(&p->lock);
+    int frame = get_frame(p, page_index);
+    pthread_mutex_lock(&p->lock);
+    pg->loading = 0;
+    pthread_cond_broadcast(&p->loaded);
+    if (p->killed || !pg->allocated) {
+        pthread_mutex_unlock(&p->lock);
+        pthread_mutex_lock(&clock_lock);
+        free_frame(frame);
+        pthread_mutex_unlock(&clock_lock);
+        pthread_mutex_lock(&p->lock);
+        return -1;
     }
 
     /* Carrega conteúdo: se já existe em disco -> disk_read;
@@ -233,132 +1132,348 @@ static int ensure_page_resident(ProcInfo *p, int page_index) {
                            (intptr_t)page_index * g_pagesize);
 
     /* Ao trazer a página para RAM pela primeira vez (ou após swap),
-     * começamos sempre com PROT_READ.  Escrever nela causará um novo
-     * page fault, onde marcaremos como suja e habilitaremos WRITE. */
-    mmu_resident(p->pid, vaddr, frame, PROT_READ);
+     * começamos com PROT_READ.  Escrever nela causará um novo page
+     * fault, onde marcaremos como suja e habilitaremos WRITE. */
+    mmu_resident(p->pid, vaddr, frame, prot);
 
+    /* Publica o frame para o clock só depois de preenchido. */
     FrameInfo *f = &frames[frame];
-    f->used = 1;
     f->pid = p->pid;
+    f->proc = p;
     f->page = page_index;
-    f->ref = 1;
-    f->prot = PROT_READ;
+    frame_set_ref(f, 1);
+    frame_set_state(f, FRAME_USED);
 
     pg->resident = 1;
     pg->frame = frame;
+    pg->prot = prot;
     /* ao carregar de disco, o conteúdo está sincronizado → dirty = 0 */
-    pg->dirty = 0;
+    pg->dirty = (prot & PROT_WRITE) != 0;
 
+    readahead_miss(p, page_index);
     return frame;
 }
 
+/* Garante que a página `page_index` do processo `p` esteja mapeada.
+ * Retorna o índice do frame físico que contém a página, ou -1 se o
+ * processo foi morto pelo oom_kill ou a página liberada.  Esta função
+ * é usada tanto pelo pager_fault (para páginas não residentes) quanto
+ * pelo pager_syslog.  Ela se comporta como um acesso de LEITURA.
+ * Chamada com p->lock, que é solto enquanto se obtém um frame. */
+static int ensure_page_resident(ProcInfo *p, int page_index) {
+    PageInfo *pg = &p->pages[page_index];
+
+    wait_page_loaded(p, page_index);
+    if (!pg->allocated)
+        return -1;
+
+    /* Já residente: apenas marca como referenciada e, se estiver com
+     * PROT_NONE (segunda chance), restaura o prot adequado. */
+    if (pg->resident) {
+        int frame = pg->frame;
+        FrameInfo *f = &frames[frame];
+
+        if (pg->prot == PROT_NONE) {
+            void *vaddr = (void *)(UVM_BASEADDR +
+                                   (intptr_t)page_index * g_pagesize);
+            int newprot = restore_prot(pg);
+            mmu_chprot(p->pid, vaddr, newprot);
+            pg->prot = newprot;
+        }
+
+        frame_set_ref(f, 1);
+        policy->on_access(policy_state, frame);
+        readahead_hit(p, page_index);
+        return frame;
+    }
+
+    /* Com zeropage, uma página fora do disco só tem preenchimento: mapeia
+     * o frame zero, só para leitura, sem gastar frame.  A primeira
+     * escrita gera falta e dá à página um frame próprio. */
+    if (opts.zeropage && !pg->in_disk) {
+        if (!pg->zero) {
+            void *vaddr = (void *)(UVM_BASEADDR +
+                                   (intptr_t)page_index * g_pagesize);
+            mmu_resident(p->pid, vaddr, zero_frame, PROT_READ);
+            pg->zero = 1;
+            __atomic_add_fetch(&stats.zero_maps, 1, __ATOMIC_RELAXED);
+        }
+        return zero_frame;
+    }
+
+    return load_page(p, page_index, PROT_READ);
+}
+
 /* ------------------------------------------------------------------ */
 /* Implementação das funções do pager                                 */
 /* ------------------------------------------------------------------ */
 
-void pager_init(int nframes, int nblocks) {
-    pthread_mutex_lock(&pager_lock);
+int pager_option(const char *name, const char *value) {
+    if (strcmp(name, "policy") == 0) {
+        const struct policy_ops *ops = policy_find(value);
+        if (!ops) {
+            errno = EINVAL;
+            return -1;
+        }
+        policy = ops;
+        return 0;
+    }
 
+    char *end;
+    long v = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || v < 0 || v > 1000000) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (strcmp(name, "cleaner") == 0 && v <= 1) {
+        opts.cleaner = (int)v;
+    } else if (strcmp(name, "cleaner_interval") == 0 && v >= 1) {
+        opts.cleaner_interval = (int)v;
+    } else if (strcmp(name, "cleaner_batch") == 0 && v >= 1) {
+        opts.cleaner_batch = (int)v;
+    } else if (strcmp(name, "readahead") == 0 && v < MAX_PAGES) {
+        opts.readahead = (int)v;
+    } else if (strcmp(name, "stats") == 0 && v <= 1) {
+        opts.stats = (int)v;
+    } else if (strcmp(name, "zeropage") == 0 && v <= 1) {
+        opts.zeropage = (int)v;
+    } else if (strcmp(name, "ksm") == 0 && v <= 1) {
+        opts.ksm = (int)v;
+    } else if (strcmp(name, "ksm_interval") == 0 && v >= 1) {
+        opts.ksm_interval = (int)v;
+    } else if (strcmp(name, "ksm_batch") == 0 && v >= 1) {
+        opts.ksm_batch = (int)v;
+    } else if (strcmp(name, "overcommit") == 0 && (v == 0 || v >= 100)) {
+        opts.overcommit = (int)v;
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+void pager_init(int nframes, int nblocks) {
     g_nframes = nframes;
     g_nblocks = nblocks;
     g_pagesize = sysconf(_SC_PAGESIZE);
 
     frames = calloc(g_nframes, sizeof(FrameInfo));
     blocks = calloc(g_nblocks, sizeof(BlockInfo));
-    memset(procs, 0, sizeof(procs));
-    clock_hand = 0;
+    free_frames = bitmap_create(g_nframes);
+    free_blocks = bitmap_create(g_nblocks);
+    procs = pidtab_create(PROCS_HINT);
+
+    if (!policy)
+        policy = policy_find("clock");
+    policy_env.nframes = g_nframes;
+    policy_env.evictable = policy_evictable;
+    policy_env.test_and_clear_ref = policy_test_and_clear_ref;
+    policy_env.dirty = policy_dirty;
+    policy_state = policy->create(&policy_env);
+
+    /* O frame zero fica fora da política.  Com um frame só não sobraria
+     * nenhum para as escritas. */
+    if (opts.zeropage && g_nframes < 2)
+        opts.zeropage = 0;
+    lazy_blocks = opts.zeropage || opts.overcommit;
+    commit_limit = opts.overcommit ?
+        (long)g_nblocks * opts.overcommit / 100 : g_nblocks;
+    if (opts.zeropage) {
+        zero_frame = bitmap_alloc(free_frames);
+        frames[zero_frame].page = -1;
+        frame_set_state(&frames[zero_frame], FRAME_ZERO);
+        mmu_zero_fill(zero_frame);
+    }
+
+    if (opts.ksm) {
+        size_t n = 1;
+        while (n < 2 * (size_t)g_nframes)
+            n <<= 1;
+        ksm_table = malloc(n * sizeof(*ksm_table));
+        if (ksm_table) {
+            memset(ksm_table, 0xff, n * sizeof(*ksm_table));
+            ksm_mask = n - 1;
+        } else {
+            opts.ksm = 0;
+        }
+    }
 
-    pthread_mutex_unlock(&pager_lock);
+    /* Sinais ficam com as threads do mmu. */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (opts.cleaner) {
+        cleaner_running = 1;
+        if (pthread_create(&cleaner_thread, NULL, cleaner_main, NULL))
+            cleaner_running = 0;
+    }
+    if (opts.ksm) {
+        ksm_running = 1;
+        if (pthread_create(&ksm_thread, NULL, ksm_main, NULL))
+            ksm_running = 0;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
 }
 
-void pager_create(pid_t pid) {
-    pthread_mutex_lock(&pager_lock);
+void pager_shutdown(void) {
+    if (cleaner_running) {
+        pthread_mutex_lock(&cleaner_lock);
+        cleaner_running = 0;
+        pthread_cond_signal(&cleaner_cond);
+        pthread_mutex_unlock(&cleaner_lock);
+        pthread_join(cleaner_thread, NULL);
+    }
+    if (ksm_running) {
+        pthread_mutex_lock(&ksm_lock);
+        ksm_running = 0;
+        pthread_cond_signal(&ksm_cond);
+        pthread_mutex_unlock(&ksm_lock);
+        pthread_join(ksm_thread, NULL);
+    }
+    if (opts.stats) {
+        pthread_mutex_lock(&clock_lock);
+        printf("pager_stats clean_evictions %lu dirty_evictions %lu "
+               "cleaned %lu readahead_hits %lu readahead_waste %lu "
+               "zero_maps %lu zero_writes %lu zero_drops %lu "
+               "ksm_merges %lu ksm_cow %lu ksm_saved %lu "
+               "ksm_saved_max %lu oom_kills %lu\n",
+               stats.clean_evictions, stats.dirty_evictions, stats.cleaned,
+               stats.readahead_hits, stats.readahead_waste,
+               stats.zero_maps, stats.zero_writes, stats.zero_drops,
+               stats.ksm_merges, stats.ksm_cow, stats.ksm_saved,
+               stats.ksm_saved_max, stats.oom_kills);
+        pthread_mutex_unlock(&clock_lock);
+    }
+}
 
+void pager_create(pid_t pid) {
     ProcInfo *p = find_proc(pid);
     if (!p) {
         create_proc_entry(pid);
     }
-
-    pthread_mutex_unlock(&pager_lock);
 }
 
 void *pager_extend(pid_t pid) {
-    pthread_mutex_lock(&pager_lock);
+    int count;
+    return pager_extend_range(pid, 1, 0, &count);
+}
 
+void *pager_extend_range(pid_t pid, int npages, int partial, int *count) {
+    *count = 0;
+    if (npages <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
     ProcInfo *p = find_proc(pid);
     if (!p) {
         p = create_proc_entry(pid);
         if (!p) {
-            pthread_mutex_unlock(&pager_lock);
             errno = ENOMEM;
             return NULL;
         }
     }
 
-    if (p->npages >= MAX_PAGES) {
-        pthread_mutex_unlock(&pager_lock);
-        errno = ENOMEM;
+    pthread_mutex_lock(&p->lock);
+
+    if (p->npages >= MAX_PAGES || p->killed ||
+            (!partial && npages > MAX_PAGES - p->npages)) {
+        pthread_mutex_unlock(&p->lock);
+        errno = ENOSPC;
         return NULL;
     }
+    if (npages > MAX_PAGES - p->npages)
+        npages = MAX_PAGES - p->npages;
+
+    int first = p->npages;
+    int n;
+    for (n = 0; n < npages; n++) {
+        int page_index = first + n;
+        int blk = -1;
+        if (lazy_blocks ? !commit_block() :
+                (blk = alloc_block(pid, page_index)) < 0)
+            break;
+
+        PageInfo *pg = &p->pages[page_index];
+        pg->allocated = 1;
+        pg->resident = 0;
+        pg->frame = -1;
+        pg->disk_block = blk;
+        pg->in_disk = 0;
+        pg->dirty = 0;
+        pg->prefetched = 0;
+        pg->zero = 0;
+        pg->loading = 0;
+        pg->prot = PROT_NONE;
+    }
 
-    int page_index = p->npages;
-
-    int blk = alloc_block(pid, page_index);
-    if (blk < 0) {
-        pthread_mutex_unlock(&pager_lock);
+    /* Sem disco para todas: desfaz as reservas se o pedido é tudo ou
+     * nada. */
+    if (n == 0 || (n < npages && !partial)) {
+        for (int i = first; i < first + n; i++) {
+            PageInfo *pg = &p->pages[i];
+            if (lazy_blocks) uncommit_block();
+            else free_block(pg->disk_block);
+            pg->allocated = 0;
+            pg->disk_block = -1;
+        }
+        pthread_mutex_unlock(&p->lock);
         errno = ENOSPC;
         return NULL;
     }
 
-    PageInfo *pg = &p->pages[page_index];
-    pg->allocated = 1;
-    pg->resident = 0;
-    pg->frame = -1;
-    pg->disk_block = blk;
-    pg->in_disk = 0;
-    pg->dirty = 0;
-
-    p->npages++;
+    p->npages += n;
+    *count = n;
 
     void *vaddr = (void *)(UVM_BASEADDR +
-                           (intptr_t)page_index * g_pagesize);
+                           (intptr_t)first * g_pagesize);
 
-    pthread_mutex_unlock(&pager_lock);
+    pthread_mutex_unlock(&p->lock);
     return vaddr;
 }
 
 void pager_fault(pid_t pid, void *addr) {
-    pthread_mutex_lock(&pager_lock);
-
     ProcInfo *p = find_proc(pid);
     if (!p) {
-        pthread_mutex_unlock(&pager_lock);
         return;
     }
 
+    pthread_mutex_lock(&p->lock);
+
     intptr_t a = (intptr_t)addr;
     intptr_t offset = a - (intptr_t)UVM_BASEADDR;
     if (offset < 0) {
-        pthread_mutex_unlock(&pager_lock);
+        pthread_mutex_unlock(&p->lock);
         return;
     }
 
     int page_index = (int)(offset / g_pagesize);
     if (page_index < 0 || page_index >= p->npages) {
-        pthread_mutex_unlock(&pager_lock);
+        pthread_mutex_unlock(&p->lock);
         return;
     }
 
+    wait_page_loaded(p, page_index);
     PageInfo *pg = &p->pages[page_index];
     if (!pg->allocated) {
-        pthread_mutex_unlock(&pager_lock);
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+
+    if (pg->zero) {
+        /* Escrita numa página mapeada no frame zero: ganha um frame
+         * próprio, já gravável, na mesma falta. */
+        if (load_page(p, page_index, PROT_READ | PROT_WRITE) != -1) {
+            pg->zero = 0;
+            __atomic_add_fetch(&stats.zero_writes, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&p->lock);
         return;
     }
 
     if (!pg->resident) {
         /* Página ainda não residente: traz para RAM com PROT_READ. */
         ensure_page_resident(p, page_index);
-        pthread_mutex_unlock(&pager_lock);
+        pthread_mutex_unlock(&p->lock);
         return;
     }
 
@@ -370,49 +1485,54 @@ void pager_fault(pid_t pid, void *addr) {
     void *vaddr = (void *)(UVM_BASEADDR +
                            (intptr_t)page_index * g_pagesize);
 
-    if (f->prot == PROT_NONE) {
-        /* Página teve segunda chance e foi tocada de novo:
-         * restaura prot conforme dirty. */
-        int newprot = pg->dirty ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    if (pg->prot == PROT_NONE) {
+        /* Página teve segunda chance (ou veio por readahead) e foi
+         * tocada de novo: restaura prot conforme dirty. */
+        int newprot = restore_prot(pg);
         mmu_chprot(pid, vaddr, newprot);
-        f->prot = newprot;
-        f->ref = 1;
-    } else if (f->prot == PROT_READ) {
+        pg->prot = newprot;
+        frame_set_ref(f, 1);
+    } else if (pg->prot == PROT_READ && frame_shared(f)) {
+        /* Escrita numa página fundida pelo ksm. */
+        unshare_page(p, page_index);
+        pthread_mutex_unlock(&p->lock);
+        return;
+    } else if (pg->prot == PROT_READ) {
         /* Primeira escrita na página: marca como suja e habilita WRITE. */
         mmu_chprot(pid, vaddr, PROT_READ | PROT_WRITE);
-        f->prot = PROT_READ | PROT_WRITE;
-        f->ref = 1;
+        pg->prot = PROT_READ | PROT_WRITE;
+        frame_set_ref(f, 1);
         pg->dirty = 1;
     } else {
         /* PROT_READ|PROT_WRITE: em teoria não deveríamos chegar aqui. */
-        f->ref = 1;
+        frame_set_ref(f, 1);
     }
+    policy->on_access(policy_state, frame);
+    readahead_hit(p, page_index);
 
-    pthread_mutex_unlock(&pager_lock);
+    pthread_mutex_unlock(&p->lock);
 }
 
 int pager_syslog(pid_t pid, void *addr, size_t len) {
-    pthread_mutex_lock(&pager_lock);
-
     ProcInfo *p = find_proc(pid);
     if (!p) {
-        pthread_mutex_unlock(&pager_lock);
         errno = EINVAL;
         return -1;
     }
 
     if (len == 0) {
-        pthread_mutex_unlock(&pager_lock);
         return 0;
     }
 
+    pthread_mutex_lock(&p->lock);
+
     intptr_t start = (intptr_t)addr;
     intptr_t base  = (intptr_t)UVM_BASEADDR;
     intptr_t limit = base + (intptr_t)p->npages * g_pagesize;
 
     /* Verifica se [addr, addr+len) está dentro das páginas alocadas. */
-    if (start < base || start + (intptr_t)len > limit) {
-        pthread_mutex_unlock(&pager_lock);
+    if (start < base || start + (intptr_t)len > limit || p->killed) {
+        pthread_mutex_unlock(&p->lock);
         errno = EINVAL;
         return -1;
     }
@@ -420,7 +1540,7 @@ int pager_syslog(pid_t pid, void *addr, size_t len) {
     char *buf = malloc(len);
     if (!buf) {
         int err = errno;
-        pthread_mutex_unlock(&pager_lock);
+        pthread_mutex_unlock(&p->lock);
         errno = err;
         return -1;
     }
@@ -433,12 +1553,26 @@ int pager_syslog(pid_t pid, void *addr, size_t len) {
 
         if (page_index < 0 || page_index >= p->npages) {
             free(buf);
-            pthread_mutex_unlock(&pager_lock);
+            pthread_mutex_unlock(&p->lock);
             errno = EINVAL;
             return -1;
         }
 
+        if (!p->pages[page_index].allocated) {
+            free(buf);
+            pthread_mutex_unlock(&p->lock);
+            errno = EINVAL;
+            return -1;
+        }
+
+        /* Com p->lock ninguém evicta a página antes da cópia. */
         int frame = ensure_page_resident(p, page_index);
+        if (frame < 0) {
+            free(buf);
+            pthread_mutex_unlock(&p->lock);
+            errno = EINVAL;
+            return -1;
+        }
 
         size_t chunk = (size_t)(g_pagesize - offset);
         if (chunk > len - pos)
@@ -450,7 +1584,7 @@ int pager_syslog(pid_t pid, void *addr, size_t len) {
         pos += chunk;
     }
 
-    pthread_mutex_unlock(&pager_lock);
+    pthread_mutex_unlock(&p->lock);
 
     /* Imprime os bytes em hexadecimal, como especificado. */
     for (size_t i = 0; i < len; i++) {
@@ -463,43 +1597,68 @@ int pager_syslog(pid_t pid, void *addr, size_t len) {
     return 0;
 }
 
-void pager_destroy(pid_t pid) {
-    pthread_mutex_lock(&pager_lock);
-
+int pager_release(pid_t pid, void *addr, int npages, char *released) {
     ProcInfo *p = find_proc(pid);
-    if (!p) {
-        pthread_mutex_unlock(&pager_lock);
-        return;
+    intptr_t offset = (intptr_t)addr - (intptr_t)UVM_BASEADDR;
+    if (!p || npages <= 0 || offset < 0 || offset % g_pagesize) {
+        errno = EINVAL;
+        return -1;
     }
+    int first = (int)(offset / g_pagesize);
 
-    for (int i = 0; i < p->npages; i++) {
-        PageInfo *pg = &p->pages[i];
-        if (!pg->allocated)
-            continue;
-
-        /* Libera frame na nossa estrutura (NÃO chama mmu_* aqui). */
-        if (pg->resident && pg->frame >= 0 && pg->frame < g_nframes) {
-            FrameInfo *f = &frames[pg->frame];
-            f->used = 0;
-            f->pid  = 0;
-            f->page = -1;
-            f->ref  = 0;
-            f->prot = PROT_NONE;
-        }
+    /* Como em pager_destroy: com clock_lock nenhuma varredura pega os
+     * frames liberados aqui. */
+    pthread_mutex_lock(&clock_lock);
+    pthread_mutex_lock(&p->lock);
+
+    if (p->killed || first >= p->npages || npages > p->npages - first) {
+        pthread_mutex_unlock(&p->lock);
+        pthread_mutex_unlock(&clock_lock);
+        errno = EINVAL;
+        return -1;
+    }
 
-        if (pg->disk_block >= 0)
-            free_block(pg->disk_block);
+    for (int i = first; i < first + npages; i++) {
+        int was = p->pages[i].allocated;
+        if (was)
+            release_page(p, i, 1);
+        if (released)
+            released[i - first] = (char)was;
+    }
+    /* Liberar o fim do espaço deixa pager_extend reusar os endereços.
+     * Uma página ainda em load_page fica de fora até a carga desistir,
+     * para não ser realocada por baixo dela. */
+    while (p->npages > 0 && !p->pages[p->npages - 1].allocated &&
+           !p->pages[p->npages - 1].loading)
+        p->npages--;
+
+    pthread_mutex_unlock(&p->lock);
+    pthread_mutex_unlock(&clock_lock);
+    return 0;
+}
 
-        pg->allocated = 0;
-        pg->resident  = 0;
-        pg->frame     = -1;
-        pg->disk_block = -1;
-        pg->in_disk   = 0;
-        pg->dirty     = 0;
+void pager_destroy(pid_t pid) {
+    pthread_mutex_lock(&procs_lock);
+    ProcInfo *p = pidtab_get(procs, pid);
+    if (p)
+        pidtab_del(procs, pid);
+    pthread_mutex_unlock(&procs_lock);
+    if (!p) {
+        return;
     }
 
-    p->used = 0;
-    p->npages = 0;
+    /* Com clock_lock nenhuma varredura alcança mais este processo
+     * depois que seus frames forem liberados. */
+    pthread_mutex_lock(&clock_lock);
+    pthread_mutex_lock(&p->lock);
+
+    release_pages(p, 0);
+
+    pthread_mutex_unlock(&p->lock);
+    pthread_mutex_unlock(&clock_lock);
 
-    pthread_mutex_unlock(&pager_lock);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->loaded);
+    free(p->batch);
+    free(p);
 }
@@ -13,6 +13,46 @@
  * backing store, respectively. */
 void pager_init(int nframes, int nblocks);
 
+/* `pager_option` sets the pager tunable `name` to `value`.  It is
+ * called by the memory management infrastructure for each `-o
+ * name=value` argument, before `pager_init`.  Returns 0 on success;
+ * on failure, returns -1 and sets errno to EINVAL.  Supported
+ * options:
+ *
+ *   cleaner=0|1          write back dirty, unreferenced frames from a
+ *                        background thread so victims are usually clean
+ *   cleaner_interval=MS  milliseconds between cleaner passes (10)
+ *   cleaner_batch=N      frames written back per pass (16)
+ *   policy=NAME          page-replacement policy: clock (second
+ *                        chance, the default), lru, wsclock, clockpro
+ *                        or arc
+ *   readahead=N          on sequential faults, also load up to N
+ *                        following pages into free frames (0, off)
+ *   stats=0|1            print pager counters at shutdown
+ *   zeropage=0|1         map pages that were never written to one
+ *                        shared read-only zero-filled frame, giving
+ *                        them a frame of their own on first write, and
+ *                        drop pages that hold only zero fill at
+ *                        eviction instead of writing them to disk
+ *   ksm=0|1              run a thread that finds frames with the same
+ *                        contents, across processes, and maps them all
+ *                        read-only to one of them; the first write to
+ *                        a merged page gives it a copy of its own
+ *   ksm_interval=MS      time between ksm passes (default 20)
+ *   ksm_batch=N          frames examined per ksm pass (default 64)
+ *   overcommit=PCT       let pager_extend promise up to PCT% of the
+ *                        disk blocks (at least 100; 0, off), giving each
+ *                        page its block only on its first write to
+ *                        disk.  When a dirty page must leave memory and
+ *                        no block is left, the process holding the most
+ *                        frames and blocks is killed to free them */
+int pager_option(const char *name, const char *value);
+
+/* `pager_shutdown` is called once when the infrastructure stops,
+ * before it releases its resources.  It should stop any background
+ * activity in the pager. */
+void pager_shutdown(void);
+
 /* `pager_create` should initialize any resources the pager needs to
  * manage memory for a new process `pid`. */
 void pager_create(pid_t pid);
@@ -26,6 +66,28 @@ void pager_create(pid_t pid);
  * use as backing storage. */
 void *pager_extend(pid_t pid);
 
+/* `pager_extend_range` allocates up to `npages` consecutive pages to
+ * process `pid` as `pager_extend` would, returns the address of the
+ * first one and stores how many were allocated in `*count`.  If
+ * `partial` is zero either all `npages` pages are allocated or none
+ * is; otherwise it allocates as many as there are disk blocks and
+ * room in the process's address space for.  Returns NULL and sets
+ * `errno` to ENOSPC if it allocated nothing, to EINVAL if `npages` is
+ * not positive, or to ENOMEM if the process could not be registered. */
+void *pager_extend_range(pid_t pid, int npages, int partial, int *count);
+
+/* `pager_release` frees the `npages` pages of process `pid` starting
+ * at `addr`, which must be page-aligned and previously returned with
+ * `pager_extend`.  Their frames and disk blocks are freed right away
+ * and the pages are unmapped; later faults on them are ignored as for
+ * unallocated memory.  Pages at the end of the address space are
+ * handed out again by `pager_extend`.  If `released` is not NULL, its
+ * `npages` entries are set to 1 for the pages that were allocated and
+ * have been released, and to 0 for the holes skipped.  Returns 0 on
+ * success and -1 with `errno` set to EINVAL if the range is not
+ * allocated. */
+int pager_release(pid_t pid, void *addr, int npages, char *released);
+
 /* `pager_fault` is called when process `pid` receives
  * a segmentation fault at address `addr`.  `pager_fault` is only
  * called for addresses previously returned with `pager_extend`.  If
@@ -0,0 +1,548 @@
+/* Offline pager simulator.  Links pager.c against an in-process MMU that
+ * only tracks page protections, then replays an access trace and reports
+ * faults, evictions, writebacks and disk reads for each policy and frame
+ * count.  No sockets or clients are involved, and physical memory only
+ * records whether a frame still holds zero fill: writes and disk reads
+ * mark the first byte of the frame.  Each configuration runs in a forked
+ * child so it starts from a fresh pager.
+ *
+ * Traces are text, one event per line:
+ *
+ *   c PID          process PID starts (pager_create)
+ *   e PID          PID allocates its next page (pager_extend)
+ *   r PID VADDR    PID reads VADDR
+ *   w PID VADDR    PID writes VADDR
+ *   f PID VADDR    PID gives back the page at VADDR (pager_release)
+ *   x PID          PID exits (pager_destroy)
+ *
+ * Without -t, a synthetic trace is generated; -d saves it for later
+ * replays. */
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mmu.h"
+#include "pager.h"
+#include "pidtab.h"
+
+#define SIM_MAX_PAGES 256
+/* Faults on one access before the pager is considered stuck. */
+#define SIM_MAX_RETRIES 8
+#define SIM_MAX_CONFIGS 64
+
+/****************************************************************************
+ * structure definitions and static variables
+ ***************************************************************************/
+#define SIM_CREATE 0
+#define SIM_EXTEND 1
+#define SIM_READ 2
+#define SIM_WRITE 3
+#define SIM_EXIT 4
+#define SIM_RELEASE 5
+
+struct sim_event {/*{{{*/
+	uint8_t op;
+	pid_t pid;
+	uint32_t page;
+};/*}}}*/
+
+struct sim_trace {/*{{{*/
+	struct sim_event *ev;
+	size_t n;
+	size_t cap;
+	size_t naccesses;
+	int nextends;
+};/*}}}*/
+
+/* Protections the MMU installed.  Written by the pager, possibly from its
+ * cleaner thread, so accesses are atomic. */
+struct sim_proc {/*{{{*/
+	int npages;
+	int prot[SIM_MAX_PAGES];
+	int frame[SIM_MAX_PAGES];
+	char released[SIM_MAX_PAGES];
+};/*}}}*/
+
+struct sim_counters {/*{{{*/
+	unsigned long faults;
+	unsigned long evictions;
+	unsigned long writebacks;
+	unsigned long disk_reads;
+	unsigned long zero_fills;
+	unsigned long chprots;
+	unsigned long stuck;
+};/*}}}*/
+
+const char *pmem = NULL;
+static char *sim_pmem;
+static long pagesize;
+/* Only the replay thread changes `procs`; it takes `procs_lock` to do so
+ * and other threads take it to read. */
+static struct pidtab *procs;
+static pthread_mutex_t procs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sim_counters counters;
+
+/****************************************************************************
+ * simulated MMU
+ ***************************************************************************/
+static void sim_count(unsigned long *c)
+{
+	__atomic_add_fetch(c, 1, __ATOMIC_RELAXED);
+}
+
+/* Sets the protection of =vaddr= and, unless =frame= is -1, the frame
+ * it maps. */
+static void sim_setprot(pid_t pid, void *vaddr, int prot, int frame)
+{
+	pthread_mutex_lock(&procs_lock);
+	struct sim_proc *p = pidtab_get(procs, pid);
+	pthread_mutex_unlock(&procs_lock);
+	if(!p) return;
+	intptr_t page = ((intptr_t)vaddr - UVM_BASEADDR) / pagesize;
+	if(page < 0 || page >= SIM_MAX_PAGES) return;
+	if(frame != -1) __atomic_store_n(&p->frame[page], frame, __ATOMIC_RELAXED);
+	__atomic_store_n(&p->prot[page], prot, __ATOMIC_RELAXED);
+}
+
+void mmu_zero_fill(int frame)/*{{{*/
+{
+	sim_count(&counters.zero_fills);
+	memset(sim_pmem + (size_t)frame * pagesize, '0', pagesize);
+}/*}}}*/
+
+void mmu_resident(pid_t pid, void *vaddr, int frame, int prot)/*{{{*/
+{
+	sim_setprot(pid, vaddr, prot, frame);
+}/*}}}*/
+
+void mmu_nonresident(pid_t pid, void *vaddr)/*{{{*/
+{
+	sim_count(&counters.evictions);
+	sim_setprot(pid, vaddr, PROT_NONE, -1);
+}/*}}}*/
+
+void mmu_chprot(pid_t pid, void *vaddr, int prot)/*{{{*/
+{
+	sim_count(&counters.chprots);
+	sim_setprot(pid, vaddr, prot, -1);
+}/*}}}*/
+
+void mmu_chprot_batch(pid_t pid, const struct mmu_chprot_entry *v, int n)/*{{{*/
+{
+	for(int i = 0; i < n; i++) mmu_chprot(pid, v[i].vaddr, v[i].prot);
+}/*}}}*/
+
+/* The process stops accessing memory; its remaining events are
+ * ignored up to its exit. */
+void mmu_kill(pid_t pid)/*{{{*/
+{
+	pthread_mutex_lock(&procs_lock);
+	struct sim_proc *p = pidtab_get(procs, pid);
+	pthread_mutex_unlock(&procs_lock);
+	if(p) p->npages = 0;
+}/*}}}*/
+
+void mmu_copy_frame(int frame_from, int frame_to)/*{{{*/
+{
+	memcpy(sim_pmem + (size_t)frame_to * pagesize,
+			sim_pmem + (size_t)frame_from * pagesize, pagesize);
+}/*}}}*/
+
+/* Pages holding only zero fill are the pager's to detect, so blocks are
+ * assumed to hold data. */
+void mmu_disk_read(int block_from, int frame_to)/*{{{*/
+{
+	sim_count(&counters.disk_reads);
+	sim_pmem[(size_t)frame_to * pagesize] = 'd';
+}/*}}}*/
+
+void mmu_disk_write(int frame_from, int block_to)/*{{{*/
+{
+	sim_count(&counters.writebacks);
+}/*}}}*/
+
+/* Transfers complete at once, so there is nothing to wait for. */
+void mmu_disk_read_async(int block_from, int frame_to)/*{{{*/
+{
+	mmu_disk_read(block_from, frame_to);
+}/*}}}*/
+
+void mmu_disk_write_async(int frame_from, int block_to)/*{{{*/
+{
+	mmu_disk_write(frame_from, block_to);
+}/*}}}*/
+
+void mmu_disk_submit(void)/*{{{*/
+{
+}/*}}}*/
+
+void mmu_disk_wait(int frame)/*{{{*/
+{
+}/*}}}*/
+
+/****************************************************************************
+ * traces
+ ***************************************************************************/
+static void trace_add(struct sim_trace *t, int op, pid_t pid, uint32_t page)/*{{{*/
+{
+	if(t->n == t->cap) {
+		t->cap = t->cap ? 2 * t->cap : 4096;
+		t->ev = realloc(t->ev, t->cap * sizeof(t->ev[0]));
+		if(!t->ev) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	t->ev[t->n].op = op;
+	t->ev[t->n].pid = pid;
+	t->ev[t->n].page = page;
+	t->n++;
+	if(op == SIM_READ || op == SIM_WRITE) t->naccesses++;
+	if(op == SIM_EXTEND) t->nextends++;
+}/*}}}*/
+
+static int trace_load(struct sim_trace *t, const char *fn)/*{{{*/
+{
+	FILE *fp = strcmp(fn, "-") ? fopen(fn, "r") : stdin;
+	if(!fp) {
+		perror(fn);
+		return -1;
+	}
+	char line[128];
+	int lineno = 0;
+	while(fgets(line, sizeof(line), fp)) {
+		lineno++;
+		char op;
+		int pid;
+		unsigned long vaddr = 0;
+		int n = sscanf(line, " %c %d %lx", &op, &pid, &vaddr);
+		if(n <= 0 || op == '#') continue;
+		uint32_t page = (vaddr - UVM_BASEADDR) / pagesize;
+		if(n >= 2 && op == 'c') trace_add(t, SIM_CREATE, pid, 0);
+		else if(n >= 2 && op == 'e') trace_add(t, SIM_EXTEND, pid, 0);
+		else if(n == 3 && op == 'r') trace_add(t, SIM_READ, pid, page);
+		else if(n == 3 && op == 'w') trace_add(t, SIM_WRITE, pid, page);
+		else if(n >= 2 && op == 'x') trace_add(t, SIM_EXIT, pid, 0);
+		else if(n == 3 && op == 'f') trace_add(t, SIM_RELEASE, pid, page);
+		else {
+			fprintf(stderr, "%s:%d: invalid event\n", fn, lineno);
+			if(fp != stdin) fclose(fp);
+			return -1;
+		}
+	}
+	if(fp != stdin) fclose(fp);
+	return 0;
+}/*}}}*/
+
+static int trace_dump(const struct sim_trace *t, const char *fn)/*{{{*/
+{
+	static const char ops[] = "cerwx";
+	FILE *fp = fopen(fn, "w");
+	if(!fp) {
+		perror(fn);
+		return -1;
+	}
+	for(size_t i = 0; i < t->n; i++) {
+		const struct sim_event *e = &t->ev[i];
+		if(e->op == SIM_READ || e->op == SIM_WRITE) {
+			fprintf(fp, "%c %d %lx\n", ops[e->op], (int)e->pid,
+					(unsigned long)(UVM_BASEADDR + e->page * pagesize));
+		} else {
+			fprintf(fp, "%c %d\n", ops[e->op], (int)e->pid);
+		}
+	}
+	return fclose(fp);
+}/*}}}*/
+
+static uint64_t xorshift(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+/* Each process allocates `npages` pages and accesses them in `pattern`
+ * order: "seq" loops over its pages, "rand" picks pages uniformly and
+ * "zipf" picks page k with probability proportional to 1/(k+1).  Accesses
+ * of different processes are interleaved at random. */
+static int trace_generate(struct sim_trace *t, const char *pattern,/*{{{*/
+		int nprocs, int npages, size_t naccesses, int writepct,
+		uint64_t seed)
+{
+	int kind;
+	if(strcmp(pattern, "seq") == 0) kind = 0;
+	else if(strcmp(pattern, "rand") == 0) kind = 1;
+	else if(strcmp(pattern, "zipf") == 0) kind = 2;
+	else return -1;
+
+	double cdf[SIM_MAX_PAGES];
+	double sum = 0;
+	for(int k = 0; k < npages; k++) sum += 1.0 / (k + 1);
+	double acc = 0;
+	for(int k = 0; k < npages; k++) {
+		acc += 1.0 / (k + 1) / sum;
+		cdf[k] = acc;
+	}
+
+	uint64_t s = seed ? seed : 1;
+	int cursor[nprocs];
+	for(int i = 0; i < nprocs; i++) {
+		cursor[i] = 0;
+		trace_add(t, SIM_CREATE, i + 1, 0);
+		for(int j = 0; j < npages; j++) trace_add(t, SIM_EXTEND, i + 1, 0);
+	}
+	for(size_t n = 0; n < naccesses; n++) {
+		int i = xorshift(&s) % nprocs;
+		uint32_t page;
+		if(kind == 0) {
+			page = cursor[i];
+			cursor[i] = (cursor[i] + 1) % npages;
+		} else if(kind == 1) {
+			page = xorshift(&s) % npages;
+		} else {
+			double u = (xorshift(&s) >> 11) * (1.0 / 9007199254740992.0);
+			int lo = 0, hi = npages - 1;
+			while(lo < hi) {
+				int mid = (lo + hi) / 2;
+				if(cdf[mid] < u) lo = mid + 1;
+				else hi = mid;
+			}
+			page = lo;
+		}
+		int op = (int)(xorshift(&s) % 100) < writepct ? SIM_WRITE : SIM_READ;
+		trace_add(t, op, i + 1, page);
+	}
+	for(int i = 0; i < nprocs; i++) trace_add(t, SIM_EXIT, i + 1, 0);
+	return 0;
+}/*}}}*/
+
+/****************************************************************************
+ * replay
+ ***************************************************************************/
+static void sim_access(struct sim_proc *p, pid_t pid, uint32_t page, int write)/*{{{*/
+{
+	if(!p || page >= (uint32_t)p->npages) return;
+	int need = write ? PROT_WRITE : PROT_READ;
+	void *vaddr = (void *)(UVM_BASEADDR + (intptr_t)page * pagesize);
+	for(int i = 0; !(__atomic_load_n(&p->prot[page], __ATOMIC_RELAXED) & need); i++) {
+		if(i == SIM_MAX_RETRIES) {
+			counters.stuck++;
+			return;
+		}
+		pager_fault(pid, vaddr);
+		counters.faults++;
+	}
+	if(write) sim_pmem[(size_t)p->frame[page] * pagesize] = 'w';
+}/*}}}*/
+
+static void sim_replay(const struct sim_trace *t)/*{{{*/
+{
+	/* Accesses are mostly by the same process as the previous event. */
+	pid_t lastpid = -1;
+	struct sim_proc *last = NULL;
+	for(size_t i = 0; i < t->n; i++) {
+		const struct sim_event *e = &t->ev[i];
+		if(e->pid != lastpid) {
+			lastpid = e->pid;
+			last = pidtab_get(procs, e->pid);
+		}
+		switch(e->op) {
+		case SIM_CREATE:
+			if(last) break;
+			last = calloc(1, sizeof(*last));
+			pthread_mutex_lock(&procs_lock);
+			if(pidtab_put(procs, e->pid, last)) {
+				free(last);
+				last = NULL;
+			}
+			pthread_mutex_unlock(&procs_lock);
+			if(last) pager_create(e->pid);
+			break;
+		case SIM_EXTEND:
+			if(last && pager_extend(e->pid))
+				last->released[last->npages++] = 0;
+			break;
+		case SIM_RELEASE:
+			if(!last || e->page >= (uint32_t)last->npages) break;
+			if(pager_release(e->pid, (void *)(UVM_BASEADDR +
+					(intptr_t)e->page * pagesize), 1, NULL) == -1)
+				break;
+			/* Mirrors the pager: a released tail is handed out again. */
+			last->released[e->page] = 1;
+			while(last->npages > 0 && last->released[last->npages - 1])
+				last->npages--;
+			break;
+		case SIM_READ:
+		case SIM_WRITE:
+			sim_access(last, e->pid, e->page, e->op == SIM_WRITE);
+			break;
+		case SIM_EXIT:
+			if(!last) break;
+			pager_destroy(e->pid);
+			pthread_mutex_lock(&procs_lock);
+			pidtab_del(procs, e->pid);
+			pthread_mutex_unlock(&procs_lock);
+			free(last);
+			last = NULL;
+			break;
+		}
+	}
+}/*}}}*/
+
+/* Runs one configuration in a child process and prints its row. */
+static int sim_run(const struct sim_trace *t, const char *policy,/*{{{*/
+		int nframes, int nblocks)
+{
+	fflush(stdout);
+	pid_t child = fork();
+	if(child == -1) {
+		perror("fork");
+		return -1;
+	}
+	if(child == 0) {
+		if(pager_option("policy", policy) == -1) {
+			fprintf(stderr, "unknown policy %s\n", policy);
+			exit(EXIT_FAILURE);
+		}
+		procs = pidtab_create(16);
+		sim_pmem = calloc(nframes, pagesize);
+		if(!sim_pmem) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		pmem = sim_pmem;
+		pager_init(nframes, nblocks);
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		sim_replay(t);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		pager_shutdown();
+		double secs = (end.tv_sec - start.tv_sec) +
+				(end.tv_nsec - start.tv_nsec) / 1e9;
+		double rate = t->naccesses ?
+				100.0 * counters.faults / t->naccesses : 0;
+		printf("%-9s %6d %10zu %10lu %7.2f %10lu %10lu %10lu %10lu %7.2f\n",
+				policy, nframes, t->naccesses, counters.faults, rate,
+				counters.evictions, counters.writebacks,
+				counters.disk_reads, counters.zero_fills,
+				secs > 0 ? t->n / secs / 1e6 : 0);
+		if(counters.stuck)
+			printf("%-9s %6d %lu accesses made no progress\n", policy,
+					nframes, counters.stuck);
+		exit(EXIT_SUCCESS);
+	}
+	int status;
+	if(waitpid(child, &status, 0) == -1) return -1;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}/*}}}*/
+
+/****************************************************************************
+ * main
+ ***************************************************************************/
+void usage(int argc, char **argv) {/*{{{*/
+	printf("usage: %s [-P POLICY,...] [-f NFRAMES,...] [-b NBLOCKS]\n"
+			"          [-o NAME=VALUE]... [-t TRACE | -g PATTERN [-p NPROCS]\n"
+			"          [-n NPAGES] [-a NACCESSES] [-W WRITEPCT] [-S SEED]\n"
+			"          [-d DUMPFILE]]\n", argv[0]);
+	printf("\n");
+	printf("-P policies to compare (default clock,lru,wsclock,clockpro,arc)\n");
+	printf("-f frame counts to simulate (default 4,16,64)\n");
+	printf("-b disk blocks (default: one per page in the trace)\n");
+	printf("-o passes options to the pager, see pager_option() in pager.h\n");
+	printf("-t replays TRACE (- for stdin); see pagersim.c for the format\n");
+	printf("-g generates a trace: seq, rand or zipf (default zipf)\n");
+	printf("   with NPROCS processes (4) of NPAGES pages (64), NACCESSES\n");
+	printf("   accesses (1000000), WRITEPCT%% of them writes (30)\n");
+	printf("-d saves the generated trace to DUMPFILE\n");
+	exit(EXIT_FAILURE);
+}/*}}}*/
+
+/* Splits a comma-separated list in place.  Returns the number of items. */
+static int split(char *s, char **items, int max)/*{{{*/
+{
+	int n = 0;
+	for(char *tok = strtok(s, ","); tok && n < max; tok = strtok(NULL, ","))
+		items[n++] = tok;
+	return n;
+}/*}}}*/
+
+int main(int argc, char **argv) {/*{{{*/
+	char defpolicies[] = "clock,lru,wsclock,clockpro,arc";
+	char defframes[] = "4,16,64";
+	char *policylist = defpolicies, *framelist = defframes;
+	const char *tracefn = NULL, *dumpfn = NULL, *pattern = "zipf";
+	int nblocks = 0, nprocs = 4, npages = 64, writepct = 30;
+	size_t naccesses = 1000000;
+	uint64_t seed = 1;
+	int opt;
+	while((opt = getopt(argc, argv, "P:f:b:o:t:g:p:n:a:W:S:d:")) != -1) {
+		switch(opt) {
+		case 'P': policylist = optarg; break;
+		case 'f': framelist = optarg; break;
+		case 'b': nblocks = atoi(optarg); break;
+		case 'o': {
+			char *value = strchr(optarg, '=');
+			if(!value) usage(argc, argv);
+			*value++ = '\0';
+			if(pager_option(optarg, value) == -1) {
+				printf("invalid pager option %s=%s\n", optarg, value);
+				usage(argc, argv);
+			}
+			break;
+		}
+		case 't': tracefn = optarg; break;
+		case 'g': pattern = optarg; break;
+		case 'p': nprocs = atoi(optarg); break;
+		case 'n': npages = atoi(optarg); break;
+		case 'a': naccesses = strtoul(optarg, NULL, 10); break;
+		case 'W': writepct = atoi(optarg); break;
+		case 'S': seed = strtoull(optarg, NULL, 10); break;
+		case 'd': dumpfn = optarg; break;
+		default:
+			usage(argc, argv);
+		}
+	}
+	if(optind != argc) usage(argc, argv);
+	if(nprocs < 1 || npages < 1 || npages > SIM_MAX_PAGES) usage(argc, argv);
+	if(writepct < 0 || writepct > 100 || nblocks < 0) usage(argc, argv);
+
+	char *policies[SIM_MAX_CONFIGS], *frames[SIM_MAX_CONFIGS];
+	int npolicies = split(policylist, policies, SIM_MAX_CONFIGS);
+	int nframelist = split(framelist, frames, SIM_MAX_CONFIGS);
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	struct sim_trace t = { 0 };
+	if(tracefn) {
+		if(trace_load(&t, tracefn)) exit(EXIT_FAILURE);
+	} else if(trace_generate(&t, pattern, nprocs, npages, naccesses,
+			writepct, seed)) {
+		usage(argc, argv);
+	}
+	if(dumpfn && trace_dump(&t, dumpfn)) exit(EXIT_FAILURE);
+	if(!nblocks) nblocks = t.nextends > 0 ? t.nextends : 1;
+
+	printf("%-9s %6s %10s %10s %7s %10s %10s %10s %10s %7s\n", "policy",
+			"frames", "accesses", "faults", "fault%", "evictions",
+			"writebacks", "disk_reads", "zero_fills", "Mev/s");
+	int failed = 0;
+	for(int i = 0; i < npolicies; i++) {
+		for(int j = 0; j < nframelist; j++) {
+			int nframes = atoi(frames[j]);
+			if(nframes < 1) usage(argc, argv);
+			if(sim_run(&t, policies[i], nframes, nblocks)) failed = 1;
+		}
+	}
+	free(t.ev);
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}/*}}}*/
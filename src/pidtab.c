@@ -0,0 +1,150 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pidtab.h"
+
+/*****************************************************************************
+ * pidtab struct and helpers
+ ****************************************************************************/
+#define PIDTAB_MIN_SIZE 16
+
+struct pidtab_slot {
+	pid_t pid;
+	void *value; /* NULL marks an empty slot */
+};
+
+struct pidtab {
+	unsigned size; /* always a power of two */
+	unsigned count;
+	struct pidtab_slot *slots;
+};
+
+/* Knuth's multiplicative hash; the table mask keeps the low bits, so mix
+ * the high bits of the product down first. */
+static inline unsigned pidtab_hash(const struct pidtab *tab, pid_t pid)
+{
+	uint32_t h = (uint32_t)pid * 2654435761u;
+	return (h ^ (h >> 16)) & (tab->size - 1);
+}
+
+static int pidtab_resize(struct pidtab *tab, unsigned size);
+
+/*****************************************************************************
+ * pidtab function implementations
+ ****************************************************************************/
+struct pidtab * pidtab_create(unsigned hint) /* {{{ */
+{
+	struct pidtab *tab = malloc(sizeof(*tab));
+	if(!tab) return NULL;
+	tab->size = 0;
+	tab->count = 0;
+	tab->slots = NULL;
+	unsigned size = PIDTAB_MIN_SIZE;
+	while(size < 2 * hint) size *= 2;
+	if(pidtab_resize(tab, size)) {
+		free(tab);
+		return NULL;
+	}
+	return tab;
+} /* }}} */
+
+void pidtab_destroy(struct pidtab *tab) /* {{{ */
+{
+	if(!tab) return;
+	free(tab->slots);
+	free(tab);
+} /* }}} */
+
+void * pidtab_get(const struct pidtab *tab, pid_t pid) /* {{{ */
+{
+	unsigned i = pidtab_hash(tab, pid);
+	while(tab->slots[i].value) {
+		if(tab->slots[i].pid == pid) return tab->slots[i].value;
+		i = (i + 1) & (tab->size - 1);
+	}
+	return NULL;
+} /* }}} */
+
+int pidtab_put(struct pidtab *tab, pid_t pid, void *value) /* {{{ */
+{
+	if(2 * (tab->count + 1) > tab->size) {
+		if(pidtab_resize(tab, 2 * tab->size)) return -1;
+	}
+	unsigned i = pidtab_hash(tab, pid);
+	while(tab->slots[i].value) {
+		if(tab->slots[i].pid == pid) {
+			tab->slots[i].value = value;
+			return 0;
+		}
+		i = (i + 1) & (tab->size - 1);
+	}
+	tab->slots[i].pid = pid;
+	tab->slots[i].value = value;
+	tab->count++;
+	return 0;
+} /* }}} */
+
+void * pidtab_del(struct pidtab *tab, pid_t pid) /* {{{ */
+{
+	unsigned mask = tab->size - 1;
+	unsigned i = pidtab_hash(tab, pid);
+	while(tab->slots[i].value && tab->slots[i].pid != pid)
+		i = (i + 1) & mask;
+	void *value = tab->slots[i].value;
+	if(!value) return NULL;
+	tab->slots[i].value = NULL;
+	tab->count--;
+
+	/* Pull back later entries of the same probe run, unless that would
+	 * move them before their home slot. */
+	unsigned j = i;
+	while(1) {
+		j = (j + 1) & mask;
+		if(!tab->slots[j].value) break;
+		unsigned home = pidtab_hash(tab, tab->slots[j].pid);
+		if(((j - home) & mask) >= ((j - i) & mask)) {
+			tab->slots[i] = tab->slots[j];
+			tab->slots[j].value = NULL;
+			i = j;
+		}
+	}
+	return value;
+} /* }}} */
+
+unsigned pidtab_count(const struct pidtab *tab) /* {{{ */
+{
+	return tab->count;
+} /* }}} */
+
+void pidtab_foreach(const struct pidtab *tab, /* {{{ */
+		void (*fn)(pid_t pid, void *value, void *arg), void *arg)
+{
+	for(unsigned i = 0; i < tab->size; i++) {
+		if(!tab->slots[i].value) continue;
+		fn(tab->slots[i].pid, tab->slots[i].value, arg);
+	}
+} /* }}} */
+
+/*****************************************************************************
+ * static function implementations
+ ****************************************************************************/
+static int pidtab_resize(struct pidtab *tab, unsigned size) /* {{{ */
+{
+	struct pidtab_slot *old = tab->slots;
+	unsigned oldsize = tab->size;
+	struct pidtab_slot *slots = calloc(size, sizeof(*slots));
+	if(!slots) {
+		errno = ENOMEM;
+		return -1;
+	}
+	tab->slots = slots;
+	tab->size = size;
+	tab->count = 0;
+	for(unsigned i = 0; i < oldsize; i++) {
+		if(!old[i].value) continue;
+		pidtab_put(tab, old[i].pid, old[i].value);
+	}
+	free(old);
+	return 0;
+} /* }}} */
@@ -0,0 +1,43 @@
+/* This module implements a growable hash table mapping process IDs to
+ * pointers.  It uses open addressing with linear probing and backward-shift
+ * deletion, so lookups touch a few contiguous cache lines and removals leave
+ * no tombstones behind.  The table doubles its capacity whenever it becomes
+ * half full.
+ *
+ * These functions are not thread-safe; callers must serialize access. */
+
+#ifndef __PIDTAB_HEADER__
+#define __PIDTAB_HEADER__
+
+#include <sys/types.h>
+
+/* This function creates an empty table sized to hold at least =hint=
+ * entries without growing.  Returns NULL if memory cannot be allocated. */
+struct pidtab * pidtab_create(unsigned hint);
+
+/* This function frees all memory used by =tab=.  Stored values are not
+ * freed. */
+void pidtab_destroy(struct pidtab *tab);
+
+/* This function returns the value stored for =pid= or NULL if there is
+ * none. */
+void * pidtab_get(const struct pidtab *tab, pid_t pid);
+
+/* This function stores =value= (which must not be NULL) for =pid=,
+ * replacing any previous value.  Returns 0 on success; returns -1 and sets
+ * errno to ENOMEM if the table needed to grow and could not. */
+int pidtab_put(struct pidtab *tab, pid_t pid, void *value);
+
+/* This function removes =pid= from the table and returns the value that was
+ * stored for it, or NULL if there was none. */
+void * pidtab_del(struct pidtab *tab, pid_t pid);
+
+/* This function returns the number of entries stored in =tab=. */
+unsigned pidtab_count(const struct pidtab *tab);
+
+/* This function calls =fn= once for each entry in =tab=.  =fn= must not
+ * modify the table. */
+void pidtab_foreach(const struct pidtab *tab,
+		void (*fn)(pid_t pid, void *value, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,571 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "policy.h"
+
+/*****************************************************************************
+ * helpers
+ ****************************************************************************/
+static void * policy_calloc(int n, size_t size)
+{
+	return calloc(n > 0 ? n : 1, size);
+}
+
+/* FIFO of keys of pages that recently left memory.  Lookups are linear,
+ * which is fine for the few hundred frames the pager manages. */
+struct ghost {
+	uint64_t *keys; /* keys[0] is the oldest */
+	int n;
+	int cap;
+};
+
+static int ghost_init(struct ghost *g, int cap)
+{
+	g->keys = policy_calloc(cap, sizeof(g->keys[0]));
+	g->n = 0;
+	g->cap = cap;
+	return g->keys ? 0 : -1;
+}
+
+static void ghost_drop_oldest(struct ghost *g)
+{
+	if(g->n == 0) return;
+	g->n--;
+	memmove(g->keys, g->keys + 1, g->n * sizeof(g->keys[0]));
+}
+
+/* Appends =key=, dropping the oldest entry if full.  Returns 1 if an entry
+ * was dropped. */
+static int ghost_push(struct ghost *g, uint64_t key)
+{
+	int dropped = 0;
+	if(g->cap == 0) return 0;
+	if(g->n == g->cap) {
+		ghost_drop_oldest(g);
+		dropped = 1;
+	}
+	g->keys[g->n++] = key;
+	return dropped;
+}
+
+/* Removes =key= if present.  Returns 1 if it was found. */
+static int ghost_take(struct ghost *g, uint64_t key)
+{
+	for(int i = g->n - 1; i >= 0; i--) {
+		if(g->keys[i] != key) continue;
+		g->n--;
+		memmove(g->keys + i, g->keys + i + 1,
+				(g->n - i) * sizeof(g->keys[0]));
+		return 1;
+	}
+	return 0;
+}
+
+static void policy_noop_fault(void *st, int frame, uint64_t key)
+{
+}
+
+static void policy_noop_frame(void *st, int frame)
+{
+}
+
+/*****************************************************************************
+ * clock: second chance
+ ****************************************************************************/
+struct clock {
+	const struct policy_env *env;
+	int hand;
+};
+
+static void * clock_create(const struct policy_env *env) /* {{{ */
+{
+	struct clock *c = calloc(1, sizeof(*c));
+	if(!c) return NULL;
+	c->env = env;
+	return c;
+} /* }}} */
+
+static void clock_destroy(void *st) /* {{{ */
+{
+	free(st);
+} /* }}} */
+
+/* Sweeps at most two rounds: the first may clear every bit, the second
+ * then finds a victim unless frames keep being referenced or reserved. */
+static int clock_choose(void *st) /* {{{ */
+{
+	struct clock *c = st;
+	const struct policy_env *env = c->env;
+	for(int i = 0; i <= 2 * env->nframes; i++) {
+		int frame = c->hand;
+		c->hand = (c->hand + 1) % env->nframes;
+		if(!env->evictable(frame)) continue;
+		if(!env->test_and_clear_ref(frame)) return frame;
+	}
+	return -1;
+} /* }}} */
+
+/*****************************************************************************
+ * lru: aging approximation of LRU
+ ****************************************************************************/
+/* Each frame keeps an 8-bit age.  Every victim search shifts the reference
+ * bit of all frames into their ages and evicts the smallest, so a page
+ * referenced in the last k searches outranks one that was not. */
+struct aging {
+	const struct policy_env *env;
+	uint8_t *age;
+	int hand; /* where ties start being broken */
+};
+
+static void * aging_create(const struct policy_env *env) /* {{{ */
+{
+	struct aging *a = calloc(1, sizeof(*a));
+	if(!a) return NULL;
+	a->env = env;
+	a->age = policy_calloc(env->nframes, sizeof(a->age[0]));
+	if(!a->age) {
+		free(a);
+		return NULL;
+	}
+	return a;
+} /* }}} */
+
+static void aging_destroy(void *st) /* {{{ */
+{
+	struct aging *a = st;
+	free(a->age);
+	free(a);
+} /* }}} */
+
+static void aging_fault(void *st, int frame, uint64_t key) /* {{{ */
+{
+	struct aging *a = st;
+	a->age[frame] = 0;
+} /* }}} */
+
+static int aging_choose(void *st) /* {{{ */
+{
+	struct aging *a = st;
+	const struct policy_env *env = a->env;
+	int best = -1;
+	for(int i = 0; i < env->nframes; i++) {
+		int frame = (a->hand + i) % env->nframes;
+		if(!env->evictable(frame)) continue;
+		int ref = env->test_and_clear_ref(frame);
+		a->age[frame] = (a->age[frame] >> 1) | (ref ? 0x80 : 0);
+		if(best == -1 || a->age[frame] < a->age[best]) best = frame;
+	}
+	if(best != -1) a->hand = (best + 1) % env->nframes;
+	return best;
+} /* }}} */
+
+/*****************************************************************************
+ * wsclock
+ ****************************************************************************/
+/* Virtual time advances by one per page load.  A page not referenced for
+ * more than `tau` ticks is outside the working set; clean ones are evicted
+ * right away, dirty ones only if no clean candidate shows up within two
+ * rounds.  If every page is in the working set, the least recently used
+ * unreferenced page goes. */
+struct wsclock {
+	const struct policy_env *env;
+	uint64_t now;
+	uint64_t tau;
+	uint64_t *last; /* virtual time of the last observed reference */
+	int hand;
+};
+
+static void * wsclock_create(const struct policy_env *env) /* {{{ */
+{
+	struct wsclock *w = calloc(1, sizeof(*w));
+	if(!w) return NULL;
+	w->env = env;
+	w->tau = env->nframes;
+	w->last = policy_calloc(env->nframes, sizeof(w->last[0]));
+	if(!w->last) {
+		free(w);
+		return NULL;
+	}
+	return w;
+} /* }}} */
+
+static void wsclock_destroy(void *st) /* {{{ */
+{
+	struct wsclock *w = st;
+	free(w->last);
+	free(w);
+} /* }}} */
+
+static void wsclock_fault(void *st, int frame, uint64_t key) /* {{{ */
+{
+	struct wsclock *w = st;
+	uint64_t now = __atomic_add_fetch(&w->now, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->last[frame], now, __ATOMIC_RELAXED);
+} /* }}} */
+
+static void wsclock_access(void *st, int frame) /* {{{ */
+{
+	struct wsclock *w = st;
+	uint64_t now = __atomic_load_n(&w->now, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->last[frame], now, __ATOMIC_RELAXED);
+} /* }}} */
+
+static int wsclock_choose(void *st) /* {{{ */
+{
+	struct wsclock *w = st;
+	const struct policy_env *env = w->env;
+	int dirty_old = -1;
+	int oldest = -1;
+	uint64_t oldest_last = 0;
+	for(int i = 0; i < 2 * env->nframes; i++) {
+		int frame = w->hand;
+		w->hand = (w->hand + 1) % env->nframes;
+		if(!env->evictable(frame)) continue;
+		uint64_t last = __atomic_load_n(&w->last[frame], __ATOMIC_RELAXED);
+		if(env->test_and_clear_ref(frame)) {
+			__atomic_store_n(&w->last[frame], w->now, __ATOMIC_RELAXED);
+			continue;
+		}
+		if(w->now - last > w->tau) {
+			if(!env->dirty(frame)) return frame;
+			if(dirty_old == -1) dirty_old = frame;
+		}
+		if(oldest == -1 || last < oldest_last) {
+			oldest = frame;
+			oldest_last = last;
+		}
+	}
+	return dirty_old != -1 ? dirty_old : oldest;
+} /* }}} */
+
+/*****************************************************************************
+ * clockpro
+ ****************************************************************************/
+/* CLOCK-Pro splits resident pages into hot and cold.  A cold page starts a
+ * test period when loaded; if it is referenced again during the test, or
+ * faults back in while its key is still remembered after eviction, its
+ * reuse distance is short and it becomes hot.  Victims are always cold;
+ * the hot hand demotes unreferenced hot pages to keep at least
+ * `cold_target` frames cold.  The target grows when evicted test pages
+ * come back and shrinks when tests expire unused.
+ *
+ * This follows the structure of the original algorithm with separate
+ * sweeps per hand instead of one shared list; non-resident test pages
+ * are kept in a FIFO of at most nframes keys. */
+struct clockpro {
+	const struct policy_env *env;
+	uint64_t *key;
+	uint8_t *hot;
+	uint8_t *test;
+	int nhot;
+	int cold_target;
+	int hand_cold;
+	int hand_hot;
+	struct ghost ghosts;
+};
+
+static void * clockpro_create(const struct policy_env *env) /* {{{ */
+{
+	struct clockpro *c = calloc(1, sizeof(*c));
+	if(!c) return NULL;
+	c->env = env;
+	c->cold_target = env->nframes / 4 > 1 ? env->nframes / 4 : 1;
+	c->key = policy_calloc(env->nframes, sizeof(c->key[0]));
+	c->hot = policy_calloc(env->nframes, sizeof(c->hot[0]));
+	c->test = policy_calloc(env->nframes, sizeof(c->test[0]));
+	if(!c->key || !c->hot || !c->test) goto out_free;
+	if(ghost_init(&c->ghosts, env->nframes)) goto out_free;
+	return c;
+
+out_free:
+	free(c->key);
+	free(c->hot);
+	free(c->test);
+	free(c);
+	return NULL;
+} /* }}} */
+
+static void clockpro_destroy(void *st) /* {{{ */
+{
+	struct clockpro *c = st;
+	free(c->key);
+	free(c->hot);
+	free(c->test);
+	free(c->ghosts.keys);
+	free(c);
+} /* }}} */
+
+static void clockpro_adapt(struct clockpro *c, int delta)
+{
+	c->cold_target += delta;
+	if(c->cold_target < 1) c->cold_target = 1;
+	if(c->cold_target > c->env->nframes - 1)
+		c->cold_target = c->env->nframes > 1 ? c->env->nframes - 1 : 1;
+}
+
+static void clockpro_promote(struct clockpro *c, int frame)
+{
+	c->hot[frame] = 1;
+	c->test[frame] = 0;
+	c->nhot++;
+}
+
+/* Advances the hot hand until it demotes one hot page.  Cold pages it
+ * passes end their test period.  Returns the demoted frame or -1. */
+static int clockpro_run_hot(struct clockpro *c) /* {{{ */
+{
+	const struct policy_env *env = c->env;
+	for(int i = 0; i < 2 * env->nframes; i++) {
+		int frame = c->hand_hot;
+		c->hand_hot = (c->hand_hot + 1) % env->nframes;
+		if(!env->evictable(frame)) continue;
+		if(!c->hot[frame]) {
+			if(c->test[frame]) {
+				c->test[frame] = 0;
+				clockpro_adapt(c, -1);
+			}
+			continue;
+		}
+		if(env->test_and_clear_ref(frame)) continue;
+		c->hot[frame] = 0;
+		c->nhot--;
+		return frame;
+	}
+	return -1;
+} /* }}} */
+
+static void clockpro_fault(void *st, int frame, uint64_t key) /* {{{ */
+{
+	struct clockpro *c = st;
+	c->key[frame] = key;
+	c->hot[frame] = 0;
+	c->test[frame] = 1;
+	if(ghost_take(&c->ghosts, key)) {
+		clockpro_adapt(c, +1);
+		clockpro_promote(c, frame);
+	}
+} /* }}} */
+
+static void clockpro_evict(void *st, int frame) /* {{{ */
+{
+	struct clockpro *c = st;
+	if(c->hot[frame]) {
+		c->nhot--;
+	} else if(c->test[frame]) {
+		if(ghost_push(&c->ghosts, c->key[frame])) clockpro_adapt(c, -1);
+	}
+	c->hot[frame] = 0;
+	c->test[frame] = 0;
+} /* }}} */
+
+static int clockpro_choose(void *st) /* {{{ */
+{
+	struct clockpro *c = st;
+	const struct policy_env *env = c->env;
+	while(c->nhot > env->nframes - c->cold_target) {
+		if(clockpro_run_hot(c) == -1) break;
+	}
+	for(int i = 0; i < 2 * env->nframes; i++) {
+		int frame = c->hand_cold;
+		c->hand_cold = (c->hand_cold + 1) % env->nframes;
+		if(!env->evictable(frame) || c->hot[frame]) continue;
+		if(!env->test_and_clear_ref(frame)) return frame;
+		if(c->test[frame]) {
+			clockpro_promote(c, frame);
+			if(c->nhot > env->nframes - c->cold_target)
+				clockpro_run_hot(c);
+		} else {
+			c->test[frame] = 1;
+		}
+	}
+	/* Every evictable page is hot or keeps being referenced. */
+	return clockpro_run_hot(c);
+} /* }}} */
+
+/*****************************************************************************
+ * arc
+ ****************************************************************************/
+/* ARC balances recency (T1, pages seen once) against frequency (T2, pages
+ * seen at least twice) using ghost lists B1 and B2 of recently evicted
+ * keys: a fault on a key in B1 means T1 was too small, one in B2 means T2
+ * was.  Exact ARC moves pages on every hit, which the pager cannot see
+ * without a fault, so this is CAR (Bansal and Modha), which runs ARC's
+ * adaptation over two clocks driven by reference bits. */
+#define ARC_NONE 0
+#define ARC_T1 1
+#define ARC_T2 2
+
+struct arc_list {
+	int head; /* clock hand; the tail is head's predecessor */
+	int n;
+};
+
+struct arc {
+	const struct policy_env *env;
+	int *next;
+	int *prev;
+	uint8_t *list;
+	uint64_t *key;
+	struct arc_list t[3]; /* indexed by ARC_T1 and ARC_T2 */
+	struct ghost b1;
+	struct ghost b2;
+	int p; /* target size of T1 */
+};
+
+static void arc_insert(struct arc *a, int l, int frame)
+{
+	struct arc_list *t = &a->t[l];
+	if(t->head == -1) {
+		t->head = frame;
+		a->next[frame] = a->prev[frame] = frame;
+	} else {
+		int tail = a->prev[t->head];
+		a->next[tail] = frame;
+		a->prev[frame] = tail;
+		a->next[frame] = t->head;
+		a->prev[t->head] = frame;
+	}
+	a->list[frame] = l;
+	t->n++;
+}
+
+static void arc_remove(struct arc *a, int frame)
+{
+	struct arc_list *t = &a->t[a->list[frame]];
+	if(a->next[frame] == frame) {
+		t->head = -1;
+	} else {
+		a->next[a->prev[frame]] = a->next[frame];
+		a->prev[a->next[frame]] = a->prev[frame];
+		if(t->head == frame) t->head = a->next[frame];
+	}
+	a->list[frame] = ARC_NONE;
+	t->n--;
+}
+
+static void * arc_create(const struct policy_env *env) /* {{{ */
+{
+	struct arc *a = calloc(1, sizeof(*a));
+	if(!a) return NULL;
+	a->env = env;
+	a->t[ARC_T1].head = a->t[ARC_T2].head = -1;
+	a->next = policy_calloc(env->nframes, sizeof(a->next[0]));
+	a->prev = policy_calloc(env->nframes, sizeof(a->prev[0]));
+	a->list = policy_calloc(env->nframes, sizeof(a->list[0]));
+	a->key = policy_calloc(env->nframes, sizeof(a->key[0]));
+	if(!a->next || !a->prev || !a->list || !a->key) goto out_free;
+	if(ghost_init(&a->b1, env->nframes)) goto out_free;
+	if(ghost_init(&a->b2, env->nframes)) goto out_free;
+	return a;
+
+out_free:
+	free(a->b1.keys);
+	free(a->next);
+	free(a->prev);
+	free(a->list);
+	free(a->key);
+	free(a);
+	return NULL;
+} /* }}} */
+
+static void arc_destroy(void *st) /* {{{ */
+{
+	struct arc *a = st;
+	free(a->b1.keys);
+	free(a->b2.keys);
+	free(a->next);
+	free(a->prev);
+	free(a->list);
+	free(a->key);
+	free(a);
+} /* }}} */
+
+static void arc_fault(void *st, int frame, uint64_t key) /* {{{ */
+{
+	struct arc *a = st;
+	int c = a->env->nframes;
+	int nb1 = a->b1.n, nb2 = a->b2.n;
+	a->key[frame] = key;
+	if(ghost_take(&a->b1, key)) {
+		int delta = nb2 / nb1 > 1 ? nb2 / nb1 : 1;
+		a->p = a->p + delta < c ? a->p + delta : c;
+		arc_insert(a, ARC_T2, frame);
+	} else if(ghost_take(&a->b2, key)) {
+		int delta = nb1 / nb2 > 1 ? nb1 / nb2 : 1;
+		a->p = a->p - delta > 0 ? a->p - delta : 0;
+		arc_insert(a, ARC_T2, frame);
+	} else {
+		/* Keep the directory within 2c entries. */
+		if(a->t[ARC_T1].n + nb1 >= c) {
+			ghost_drop_oldest(&a->b1);
+		} else if(a->t[ARC_T1].n + a->t[ARC_T2].n + nb1 + nb2 >= 2 * c) {
+			ghost_drop_oldest(&a->b2);
+		}
+		arc_insert(a, ARC_T1, frame);
+	}
+} /* }}} */
+
+static void arc_evict(void *st, int frame) /* {{{ */
+{
+	struct arc *a = st;
+	int l = a->list[frame];
+	if(l == ARC_NONE) return;
+	arc_remove(a, frame);
+	ghost_push(l == ARC_T1 ? &a->b1 : &a->b2, a->key[frame]);
+} /* }}} */
+
+static int arc_choose(void *st) /* {{{ */
+{
+	struct arc *a = st;
+	const struct policy_env *env = a->env;
+	struct arc_list *t1 = &a->t[ARC_T1], *t2 = &a->t[ARC_T2];
+	/* Consecutive non-evictable heads seen in each list.  Once a whole
+	 * lap of one list is skipped, take the candidate from the other. */
+	int skipped[3] = {0, 0, 0};
+	for(int i = 0; i < 4 * env->nframes; i++) {
+		int l = (t1->n >= (a->p > 1 ? a->p : 1) || t2->n == 0) ?
+				ARC_T1 : ARC_T2;
+		if(skipped[l] >= a->t[l].n) l = (l == ARC_T1) ? ARC_T2 : ARC_T1;
+		struct arc_list *t = &a->t[l];
+		if(skipped[l] >= t->n) return -1;
+		int frame = t->head;
+		if(!env->evictable(frame)) {
+			t->head = a->next[frame];
+			skipped[l]++;
+			continue;
+		}
+		skipped[l] = 0;
+		if(!env->test_and_clear_ref(frame)) return frame;
+		if(l == ARC_T1) {
+			arc_remove(a, frame);
+			arc_insert(a, ARC_T2, frame);
+		} else {
+			t->head = a->next[frame];
+		}
+	}
+	return -1;
+} /* }}} */
+
+/*****************************************************************************
+ * policy function implementations
+ ****************************************************************************/
+static const struct policy_ops policies[] = {
+	{ "clock", clock_create, clock_destroy, policy_noop_fault,
+			policy_noop_frame, policy_noop_frame, clock_choose },
+	{ "lru", aging_create, aging_destroy, aging_fault,
+			policy_noop_frame, policy_noop_frame, aging_choose },
+	{ "wsclock", wsclock_create, wsclock_destroy, wsclock_fault,
+			wsclock_access, policy_noop_frame, wsclock_choose },
+	{ "clockpro", clockpro_create, clockpro_destroy, clockpro_fault,
+			policy_noop_frame, clockpro_evict, clockpro_choose },
+	{ "arc", arc_create, arc_destroy, arc_fault,
+			policy_noop_frame, arc_evict, arc_choose },
+};
+
+const struct policy_ops * policy_find(const char *name) /* {{{ */
+{
+	for(unsigned i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+		if(strcmp(policies[i].name, name) == 0) return &policies[i];
+	}
+	return NULL;
+} /* }}} */
@@ -0,0 +1,57 @@
+/* This module implements page-replacement policies for the pager.  A
+ * policy only ranks frames; the pager owns frame state, reference bits and
+ * protection changes, and reaches policies through `struct policy_ops`.
+ *
+ * Reference bits are emulated: the pager sets a frame's bit when its page
+ * faults, and `test_and_clear_ref` revokes the page's access so the next
+ * touch faults and sets the bit again.  Every policy pays one protection
+ * fault per cleared bit, so policies that clear bits more often see more
+ * faults on resident pages.
+ *
+ * Except for `on_access`, policy functions are called with the pager's
+ * clock lock held and need no locking of their own.  `on_access` runs
+ * concurrently with everything else and may only make atomic per-frame
+ * updates. */
+
+#ifndef __POLICY_HEADER__
+#define __POLICY_HEADER__
+
+#include <stdint.h>
+
+/* Services the pager offers to policies.  Frames are numbered from 0 to
+ * =nframes= - 1. */
+struct policy_env {
+	int nframes;
+	/* Returns nonzero if =frame= holds a page that may be evicted now. */
+	int (*evictable)(int frame);
+	/* Returns the reference bit of =frame= and clears it. */
+	int (*test_and_clear_ref)(int frame);
+	/* Returns nonzero if the page in =frame= must be written back before
+	 * the frame can be reused.  This is a hint and may be stale. */
+	int (*dirty)(int frame);
+};
+
+struct policy_ops {
+	const char *name;
+	/* Returns the policy state, or NULL if memory cannot be allocated.
+	 * =env= must stay valid until =destroy=. */
+	void * (*create)(const struct policy_env *env);
+	void (*destroy)(void *st);
+	/* The page identified by =key= is being loaded into =frame=.  The
+	 * frame becomes evictable once the load completes. */
+	void (*on_fault)(void *st, int frame, uint64_t key);
+	/* The resident page in =frame= was referenced again. */
+	void (*on_access)(void *st, int frame);
+	/* The page in =frame= left memory, evicted or freed. */
+	void (*on_evict)(void *st, int frame);
+	/* Returns an evictable frame to replace, or -1 if none is evictable
+	 * right now. */
+	int (*choose_victim)(void *st);
+};
+
+/* This function returns the policy called =name=, or NULL if there is no
+ * such policy.  Available policies are "clock" (second chance), "lru"
+ * (aging), "wsclock", "clockpro" and "arc". */
+const struct policy_ops * policy_find(const char *name);
+
+#endif
@@ -0,0 +1,125 @@
+/* Microbenchmark for the uvm remap path.  Remaps 16 pages of a window
+ * over 64 memfd frames, as REMAP_REP does, and touches each page after
+ * remapping it.  Compares the old munmap + mmap + mprotect sequence, a
+ * single MAP_FIXED mmap and, for a page remapped to the frame it
+ * already maps, a plain mprotect.  Each is run alone and with another
+ * thread reading a page of the same mm, and the TLB shootdowns counted
+ * in /proc/interrupts are reported. */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PAGESIZE 4096
+#define NFRAMES 64
+#define NWINDOW 16
+#define NREMAPS 200000
+
+enum { REMAP_OLD, REMAP_FIXED, REMAP_MPROTECT, NMETHODS };
+
+static const char *method_names[] = {"munmap+mmap+mprotect",
+		"MAP_FIXED mmap", "mprotect (same frame)"};
+static int pmem_fd;
+static char *window;
+static volatile int stop;
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}/*}}}*/
+
+static long tlb_shootdowns(void)/*{{{*/
+{
+	FILE *f = fopen("/proc/interrupts", "r");
+	if(!f) return -1;
+	char line[4096];
+	long sum = 0;
+	while(fgets(line, sizeof(line), f)) {
+		if(!strstr(line, "TLB shootdowns")) continue;
+		char *p = strchr(line, ':') + 1;
+		for(;;) {
+			char *end;
+			long v = strtol(p, &end, 10);
+			if(end == p) break;
+			sum += v;
+			p = end;
+		}
+	}
+	fclose(f);
+	return sum;
+}/*}}}*/
+
+static void *reader(void *arg)/*{{{*/
+{
+	(void)arg;
+	volatile long sum = 0;
+	while(!stop) sum += ((volatile char *)window)[NWINDOW * PAGESIZE];
+	return NULL;
+}/*}}}*/
+
+static void remap(int method, int i)/*{{{*/
+{
+	char *addr = window + (i % NWINDOW) * PAGESIZE;
+	off_t off = (off_t)((i * 7) % NFRAMES) * PAGESIZE;
+	int rw = PROT_READ | PROT_WRITE;
+	switch(method) {
+	case REMAP_OLD:
+		munmap(addr, PAGESIZE);
+		mmap(addr, PAGESIZE, rw, MAP_SHARED, pmem_fd, off);
+		mprotect(addr, PAGESIZE, rw);
+		break;
+	case REMAP_FIXED:
+		mmap(addr, PAGESIZE, rw, MAP_SHARED | MAP_FIXED, pmem_fd, off);
+		break;
+	case REMAP_MPROTECT:
+		mprotect(addr, PAGESIZE, (i & NWINDOW) ? PROT_READ : rw);
+		break;
+	}
+	/* Only touch for writing what is writable. */
+	if(method != REMAP_MPROTECT || !(i & NWINDOW)) addr[1]++;
+	else (void)*(volatile char *)addr;
+}/*}}}*/
+
+static void run(int method, int with_reader)/*{{{*/
+{
+	pthread_t th;
+	stop = 0;
+	if(with_reader && pthread_create(&th, NULL, reader, NULL)) {
+		exit(EXIT_FAILURE);
+	}
+	long tlb = tlb_shootdowns();
+	double t = now();
+	for(int i = 0; i < NREMAPS; i++) remap(method, i);
+	t = now() - t;
+	tlb = tlb_shootdowns() - tlb;
+	stop = 1;
+	if(with_reader) pthread_join(th, NULL);
+	printf("%-22s %-8s %8.2f us/remap %8ld TLB shootdowns\n",
+			method_names[method], with_reader ? "+reader" : "alone",
+			t / NREMAPS * 1e6, tlb);
+}/*}}}*/
+
+int main(void)/*{{{*/
+{
+	pmem_fd = memfd_create("remapbench", 0);
+	if(pmem_fd == -1 || ftruncate(pmem_fd, NFRAMES * PAGESIZE)) {
+		perror("memfd");
+		exit(EXIT_FAILURE);
+	}
+	window = mmap(NULL, (NWINDOW + 1) * PAGESIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED, pmem_fd, 0);
+	if(window == MAP_FAILED) exit(EXIT_FAILURE);
+
+	for(int m = 0; m < NMETHODS; m++) {
+		run(m, 0);
+		run(m, 1);
+	}
+	return 0;
+}/*}}}*/
@@ -0,0 +1,131 @@
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+/*****************************************************************************
+ * helpers
+ ****************************************************************************/
+/* Busy-wait iterations before sleeping.  Spinning only helps when the
+ * other side can run at the same time. */
+#define RING_SPIN 256
+/* Sleeps are bounded so a close that races with going to sleep is noticed
+ * quickly even if its wakeup is lost, and so readers can check whether the
+ * other side is still alive. */
+#define RING_SLEEP_NS 100000000L
+
+static int ring_spin = -1;
+
+static inline uint32_t ring_load(const uint32_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+static inline void ring_store(uint32_t *p, uint32_t v)
+{
+	__atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+static void ring_futex_wake(uint32_t *word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Sleeps until *word changes from =val=.  =waiters= tells the other side
+ * it needs to issue a wakeup. */
+static void ring_sleep(struct ring *r, uint32_t *word, uint32_t *waiters,
+		uint32_t val)
+{
+	ring_store(waiters, 1);
+	if(ring_load(word) == val && !ring_load(&r->closed)) {
+		struct timespec ts = { 0, RING_SLEEP_NS };
+		syscall(SYS_futex, word, FUTEX_WAIT, val, &ts, NULL, 0);
+	}
+	ring_store(waiters, 0);
+}
+
+static void ring_publish(uint32_t *word, uint32_t *waiters, uint32_t val)
+{
+	ring_store(word, val);
+	if(ring_load(waiters)) ring_futex_wake(word);
+}
+
+static int ring_spins(void)
+{
+	if(ring_spin == -1)
+		ring_spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPIN : 0;
+	return ring_spin;
+}
+
+/*****************************************************************************
+ * ring function implementations
+ ****************************************************************************/
+void ring_init(struct ring *r) /* {{{ */
+{
+	memset(r, 0, sizeof(*r) - RING_SIZE);
+} /* }}} */
+
+void ring_close(struct ring *r) /* {{{ */
+{
+	ring_store(&r->closed, 1);
+	ring_futex_wake(&r->head);
+	ring_futex_wake(&r->tail);
+} /* }}} */
+
+int ring_write(struct ring *r, const void *buf, uint32_t len) /* {{{ */
+{
+	uint32_t head = r->head; /* we are the only writer */
+	int spins = ring_spins();
+	while(1) {
+		if(ring_load(&r->closed)) {
+			errno = EPIPE;
+			return -1;
+		}
+		uint32_t tail = ring_load(&r->tail);
+		if(RING_SIZE - (head - tail) >= len) break;
+		if(spins-- > 0) continue;
+		ring_sleep(r, &r->tail, &r->tail_waiters, tail);
+	}
+
+	uint32_t off = head % RING_SIZE;
+	uint32_t first = RING_SIZE - off < len ? RING_SIZE - off : len;
+	memcpy(r->data + off, buf, first);
+	memcpy(r->data, (const char *)buf + first, len - first);
+	ring_publish(&r->head, &r->head_waiters, head + len);
+	return 0;
+} /* }}} */
+
+int ring_read(struct ring *r, void *buf, uint32_t len, int peek) /* {{{ */
+{
+	uint32_t tail = r->tail; /* we are the only reader */
+	int spins = ring_spins();
+	int slept = 0;
+	while(1) {
+		uint32_t head = ring_load(&r->head);
+		if(head - tail >= len) break;
+		if(ring_load(&r->closed)) {
+			errno = EPIPE;
+			return -1;
+		}
+		if(slept) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if(spins-- > 0) continue;
+		ring_sleep(r, &r->head, &r->head_waiters, head);
+		slept = 1;
+	}
+
+	uint32_t off = tail % RING_SIZE;
+	uint32_t first = RING_SIZE - off < len ? RING_SIZE - off : len;
+	memcpy(buf, r->data + off, first);
+	memcpy((char *)buf + first, r->data, len - first);
+	if(!peek) ring_publish(&r->tail, &r->tail_waiters, tail + len);
+	return 0;
+} /* }}} */
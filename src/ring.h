@@ -0,0 +1,47 @@
+/* This module implements a single-producer single-consumer byte ring meant
+ * to live in memory shared between two processes.  Readers and writers spin
+ * briefly and then sleep on a futex, so an idle ring costs no CPU and a busy
+ * one needs no system calls.  Messages are written and read whole; a
+ * message must not be larger than RING_SIZE.
+ *
+ * Exactly one thread (or one thread at a time, if callers serialize) may
+ * write to a ring, and likewise for reading. */
+
+#ifndef __RING_HEADER__
+#define __RING_HEADER__
+
+#include <stdint.h>
+
+#define RING_SIZE (1 << 16)
+
+struct ring {
+	uint32_t head;          /* bytes ever written, advanced by the writer */
+	uint32_t head_waiters;  /* nonzero while the reader sleeps */
+	char pad0[56];
+	uint32_t tail;          /* bytes ever read, advanced by the reader */
+	uint32_t tail_waiters;  /* nonzero while the writer sleeps */
+	char pad1[56];
+	uint32_t closed;
+	char pad2[60];
+	char data[RING_SIZE];
+};
+
+/* This function initializes an empty, open ring. */
+void ring_init(struct ring *r);
+
+/* This function closes the ring and wakes up any sleeping reader or
+ * writer.  Subsequent reads and writes fail. */
+void ring_close(struct ring *r);
+
+/* This function writes =len= bytes from =buf=, waiting for space if
+ * needed.  Returns 0 on success or -1 if the ring is closed. */
+int ring_write(struct ring *r, const void *buf, uint32_t len);
+
+/* This function waits until =len= bytes are available and copies them to
+ * =buf=.  The bytes are consumed unless =peek= is nonzero.  Returns 0 on
+ * success.  Returns -1 and sets =errno= to EPIPE if the ring is closed, or
+ * to ETIMEDOUT if nothing arrived for a while; callers should check the
+ * other side is alive and try again. */
+int ring_read(struct ring *r, void *buf, uint32_t len, int peek);
+
+#endif
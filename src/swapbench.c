@@ -0,0 +1,108 @@
+/* Microbenchmark for the swap I/O primitives.  Writes NBLOCKS blocks in
+ * order and reads them back in a scattered order, as the pager does on
+ * swap-out and swap-in, with the same calls mmu.c uses for each backend:
+ * memcpy into an anonymous MAP_NORESERVE mapping ("mem") or
+ * pwrite/pread on a file, optionally opened with O_DIRECT.  The first
+ * pass warms up; the second is reported. */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PAGESIZE 4096
+#define NFRAMES 64
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}/*}}}*/
+
+static void usage(char **argv)/*{{{*/
+{
+	printf("usage: %s [-d] mem|SWAPFILE NBLOCKS\n", argv[0]);
+	exit(EXIT_FAILURE);
+}/*}}}*/
+
+int main(int argc, char **argv)/*{{{*/
+{
+	int direct = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "d")) != -1) {
+		switch(opt) {
+		case 'd': direct = 1; break;
+		default: usage(argv);
+		}
+	}
+	if(argc - optind != 2) usage(argv);
+	const char *fn = argv[optind];
+	int nblocks = atoi(argv[optind + 1]);
+	if(nblocks <= 0) usage(argv);
+
+	char *pmem = mmap(NULL, NFRAMES * PAGESIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(pmem == MAP_FAILED) exit(EXIT_FAILURE);
+	memset(pmem, 1, NFRAMES * PAGESIZE);
+
+	char *disk = NULL;
+	int fd = -1;
+	size_t size = (size_t)nblocks * PAGESIZE;
+	if(strcmp(fn, "mem") == 0) {
+		disk = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(disk == MAP_FAILED) exit(EXIT_FAILURE);
+	} else {
+		fd = open(fn, O_RDWR | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0),
+				0600);
+		if(fd == -1 || ftruncate(fd, size)) {
+			perror(fn);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	double tout = 0, tin = 0;
+	for(int pass = 0; pass < 2; pass++) {
+		double t = now();
+		for(int b = 0; b < nblocks; b++) {
+			char *frame = pmem + (b % NFRAMES) * PAGESIZE;
+			off_t off = (off_t)b * PAGESIZE;
+			if(disk) {
+				memcpy(disk + off, frame, PAGESIZE);
+			} else if(pwrite(fd, frame, PAGESIZE, off) != PAGESIZE) {
+				perror("pwrite");
+				exit(EXIT_FAILURE);
+			}
+		}
+		tout = now() - t;
+		t = now();
+		for(int i = 0; i < nblocks; i++) {
+			int b = (int)((i * 2654435761u) % nblocks);
+			char *frame = pmem + (i % NFRAMES) * PAGESIZE;
+			off_t off = (off_t)b * PAGESIZE;
+			if(disk) {
+				memcpy(frame, disk + off, PAGESIZE);
+			} else if(pread(fd, frame, PAGESIZE, off) != PAGESIZE) {
+				perror("pread");
+				exit(EXIT_FAILURE);
+			}
+		}
+		tin = now() - t;
+	}
+	if(fd != -1) {
+		close(fd);
+		unlink(fn);
+	}
+
+	printf("%s%s: swap-out %.0f MB/s %.1f us/block, "
+			"swap-in %.0f MB/s %.1f us/block\n",
+			fn, direct ? " (O_DIRECT)" : "",
+			size / tout / 1e6, tout / nblocks * 1e6,
+			size / tin / 1e6, tin / nblocks * 1e6);
+	return 0;
+}/*}}}*/
@@ -0,0 +1,68 @@
+/* Microbenchmark for the binary trace.  Records the same stream of
+ * mmu_resident events twice: printed with fprintf as mmu.c does without
+ * -T, and with mmu_trace().  Both outputs go to files in the directory
+ * given as argument (default /tmp). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "mmutrace.h"
+
+#define NEVENTS 5000000
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}/*}}}*/
+
+static void *event_vaddr(int i)/*{{{*/
+{
+	return (void *)(0x600000000000L + (intptr_t)(i & 255) * 4096);
+}/*}}}*/
+
+static long file_size(const char *fn)/*{{{*/
+{
+	struct stat st;
+	if(stat(fn, &st)) return -1;
+	return st.st_size;
+}/*}}}*/
+
+int main(int argc, char **argv)/*{{{*/
+{
+	const char *dir = argc > 1 ? argv[1] : "/tmp";
+	char txt[256], trc[256];
+	snprintf(txt, sizeof(txt), "%s/tracebench.txt", dir);
+	snprintf(trc, sizeof(trc), "%s/tracebench.trc", dir);
+
+	FILE *f = fopen(txt, "w");
+	if(!f) exit(EXIT_FAILURE);
+	double t = now();
+	for(int i = 0; i < NEVENTS; i++) {
+		fprintf(f, "mmu_resident pid %d vaddr %p prot %d frame %u\n",
+				i & 15, event_vaddr(i), 1, i & 63);
+	}
+	fclose(f);
+	double tprintf = now() - t;
+
+	if(mmu_trace_open(trc, 1ULL << 32)) exit(EXIT_FAILURE);
+	t = now();
+	for(int i = 0; i < NEVENTS; i++) {
+		mmu_trace(MMU_TRACE_RESIDENT, i & 15, event_vaddr(i), i & 63, -1, 1);
+	}
+	mmu_trace_close();
+	double ttrace = now() - t;
+
+	printf("%d mmu_resident events\n", NEVENTS);
+	printf("fprintf: %.1f ns/event, %ld bytes\n",
+			tprintf / NEVENTS * 1e9, file_size(txt));
+	printf("trace:   %.1f ns/event, %ld bytes\n",
+			ttrace / NEVENTS * 1e9, file_size(trc));
+	remove(txt);
+	remove(trc);
+	return 0;
+}/*}}}*/
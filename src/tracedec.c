@@ -0,0 +1,159 @@
+/* Decoder for binary traces recorded with `mmu -T`.  By default prints
+ * the events in the same text format mmu prints without -T.  With -a,
+ * exports the access stream in the trace format read by pagersim; with
+ * -s, prints event counts. */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mmutrace.h"
+
+/* How far past a fault to look for the protection it was granted. */
+#define TRACEDEC_LOOKAHEAD 4096
+
+static int cmpseq(const void *a, const void *b)/*{{{*/
+{
+	const struct mmu_trace_rec *x = a, *y = b;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}/*}}}*/
+
+static void print_text(const struct mmu_trace_rec *r)/*{{{*/
+{
+	char line[MMU_TRACE_LINE_MAX];
+	mmu_trace_format(line, r);
+	fputs(line, stdout);
+}/*}}}*/
+
+/* Only faulting accesses are visible.  A fault counts as a write if
+ * handling it granted write access to the faulting page. */
+static void print_access(const struct mmu_trace_rec *v, size_t n, size_t i)/*{{{*/
+{
+	const struct mmu_trace_rec *r = &v[i];
+	switch(r->op) {
+	case MMU_TRACE_CREATE:
+		printf("c %u\n", r->id);
+		return;
+	case MMU_TRACE_EXTEND:
+		printf("e %u\n", r->id);
+		return;
+	case MMU_TRACE_DESTROY:
+		printf("x %u\n", r->id);
+		return;
+	case MMU_TRACE_SYSLOG:
+		printf("r %u %lx\n", r->id, (unsigned long)r->vaddr);
+		return;
+	case MMU_TRACE_RELEASE:
+		printf("f %u %lx\n", r->id, (unsigned long)r->vaddr);
+		return;
+	case MMU_TRACE_FAULT:
+		break;
+	default:
+		return;
+	}
+	long pagemask = ~(sysconf(_SC_PAGESIZE) - 1);
+	uint64_t page = r->vaddr & pagemask;
+	char op = 'r';
+	for(size_t j = i + 1; j < n && j <= i + TRACEDEC_LOOKAHEAD; j++) {
+		const struct mmu_trace_rec *s = &v[j];
+		if(s->id != r->id) continue;
+		if(s->op == MMU_TRACE_RESIDENT || s->op == MMU_TRACE_CHPROT) {
+			if(s->vaddr != page) continue;
+			if(s->prot & PROT_WRITE) op = 'w';
+			break;
+		}
+		if(s->op <= MMU_TRACE_DESTROY) break; /* next request */
+	}
+	printf("%c %u %lx\n", op, r->id, (unsigned long)r->vaddr);
+}/*}}}*/
+
+void usage(int argc, char **argv) {/*{{{*/
+	printf("usage: %s [-a | -s] TRACEFILE\n", argv[0]);
+	printf("\n");
+	printf("prints events as mmu does without -T\n");
+	printf("-a prints the access stream in pagersim's trace format\n");
+	printf("-s prints event counts\n");
+	exit(EXIT_FAILURE);
+}/*}}}*/
+
+int main(int argc, char **argv) {/*{{{*/
+	int mode = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "as")) != -1) {
+		switch(opt) {
+		case 'a':
+		case 's':
+			mode = opt;
+			break;
+		default:
+			usage(argc, argv);
+		}
+	}
+	if(argc - optind != 1) usage(argc, argv);
+	const char *fn = argv[optind];
+
+	int fd = open(fn, O_RDONLY);
+	struct stat st;
+	if(fd == -1 || fstat(fd, &st) == -1) {
+		perror(fn);
+		exit(EXIT_FAILURE);
+	}
+	size_t hdrsz = sizeof(struct mmu_trace_header);
+	if((size_t)st.st_size < hdrsz) {
+		fprintf(stderr, "%s: not a trace file\n", fn);
+		exit(EXIT_FAILURE);
+	}
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(map == MAP_FAILED) {
+		perror(fn);
+		exit(EXIT_FAILURE);
+	}
+	const struct mmu_trace_header *h = (const void *)map;
+	if(memcmp(h->magic, MMU_TRACE_MAGIC, sizeof(h->magic)) ||
+			h->version != MMU_TRACE_VERSION ||
+			h->recsize != sizeof(struct mmu_trace_rec)) {
+		fprintf(stderr, "%s: not a version %d trace file\n", fn,
+				MMU_TRACE_VERSION);
+		exit(EXIT_FAILURE);
+	}
+
+	size_t nslots = (st.st_size - hdrsz) / sizeof(struct mmu_trace_rec);
+	const struct mmu_trace_rec *slots = (const void *)(map + hdrsz);
+	struct mmu_trace_rec *v = malloc((nslots ? nslots : 1) * sizeof(*v));
+	if(!v) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	size_t n = 0;
+	for(size_t i = 0; i < nslots; i++) {
+		if(slots[i].op != MMU_TRACE_NONE && slots[i].op < MMU_TRACE_NOPS)
+			v[n++] = slots[i];
+	}
+	qsort(v, n, sizeof(*v), cmpseq);
+
+	if(mode == 's') {
+		unsigned long counts[MMU_TRACE_NOPS] = { 0 };
+		for(size_t i = 0; i < n; i++) counts[v[i].op]++;
+		for(int op = 1; op < MMU_TRACE_NOPS; op++)
+			printf("%-16s %lu\n", mmu_trace_opname(op), counts[op]);
+		printf("%-16s %.6f\n", "seconds", n ? v[n-1].ts / 1e9 : 0.0);
+		printf("%-16s %lu\n", "dropped", (unsigned long)h->dropped);
+	} else {
+		for(size_t i = 0; i < n; i++) {
+			if(mode == 'a') print_access(v, n, i);
+			else print_text(&v[i]);
+		}
+	}
+	if(h->dropped)
+		fprintf(stderr, "%s: %lu events were dropped\n", fn,
+				(unsigned long)h->dropped);
+	free(v);
+	munmap(map, st.st_size);
+	close(fd);
+	exit(EXIT_SUCCESS);
+}/*}}}*/
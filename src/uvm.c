@@ -4,15 +4,21 @@
 
 #include "uvm.h"
 
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/un.h>
 
+#include <linux/userfaultfd.h>
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
@@ -29,36 +35,106 @@
 /****************************************************************************
  * structure definitions and static variables
  ***************************************************************************/
+/* Completion slot for a request sent to the MMU; its index is the tag
+ * the reply echoes.  The requesting thread waits on `cond` until `done`
+ * is set.  Faults read from the userfaultfd have nobody waiting here:
+ * `page` is set and their threads sleep in the kernel until
+ * UFFDIO_WAKE. */
+struct uvm_req {/*{{{*/
+	int busy;
+	int done;
+	intptr_t result;
+	uint32_t count;
+	uintptr_t page;
+	pthread_cond_t cond;
+};/*}}}*/
+
+#define UVM_MAX_REQS 64
+
+/* Fault addresses are passed to the MMU unrounded, as with SIGSEGV. */
+#ifdef UFFD_FEATURE_EXACT_ADDRESS
+#define UVM_UFFD_FEATURES UFFD_FEATURE_EXACT_ADDRESS
+#else
+#define UVM_UFFD_FEATURES 0
+#endif
+
+/* State of a page.  Pages are only MISSING under the userfaultfd
+ * backend. */
+#define UVM_PAGE_UNMAPPED 0 /* nothing mapped yet */
+#define UVM_PAGE_MISSING 1 /* empty anonymous page registered for faults */
+#define UVM_PAGE_MAPPED 2 /* frame mapped from `pmem_fd` */
+#define UVM_PAGE_RELEASED 3 /* given back with `uvm_release` */
+#define UVM_PAGE_STATE 3
+#define UVM_PAGE_PENDING 4 /* fault sent to the MMU */
+
 struct uvm_data {/*{{{*/
 	int running;
 	int npages;
 	int sock;
 	pthread_t thread;
 	pthread_mutex_t mutex;
-	pthread_cond_t cond;
 	char *pmem_fn;
 	int pmem_fd;
-	intptr_t result;
+	/* Shared-memory transport, NULL when talking over `sock`.
+	 * `send_lock` keeps a single writer on the request ring. */
+	struct mmu_proto_shm *shm;
+	pthread_mutex_t send_lock;
+	/* Requests waiting for a reply, indexed by tag.  `cond` is
+	 * signaled when a slot is freed. */
+	struct uvm_req reqs[UVM_MAX_REQS];
+	int nreqs;
+	pthread_cond_t cond;
+	/* `pgstate` and `pgoff` keep each page's state and the offset of
+	 * its last frame in `pmem_fd`. */
+	unsigned char *pgstate;
+	off_t *pgoff;
+	/* userfaultfd backend, `uffd` is -1 when faults arrive as SIGSEGV.
+	 * `uffd_stop` is an eventfd telling `fault_thread` to return. */
+	int uffd;
+	int uffd_stop;
+	pthread_t fault_thread;
 };/*}}}*/
 
 static struct uvm_data *uvm = NULL;
 
+static size_t PAGESIZE = 0;
+
 /****************************************************************************
  * static function declarations
  ***************************************************************************/
 static void * uvm_thread(void *data);
+static void * uvm_fault_thread(void *data);
 static void uvm_exit(int status, void *arg);
 static void uvm_segv_action(int signum, siginfo_t *si, void *context);
 
 /* Protocol message handlers assume assume `uvm->mutex` is locked. */
 static void uvm_proto_extend_rep(void);
+static void uvm_proto_extendv_rep(void);
+static void uvm_proto_release_rep(void);
 static void uvm_proto_syslog_rep(void);
 static void uvm_proto_segv_rep(void);
 static void uvm_proto_remap_rep(void);
 static void uvm_proto_chprot_rep(void);
+static void uvm_proto_chprotv_rep(void);
 
 /* Helper functions */
 static void uvm_connect_socket(int sock, const struct sockaddr_un * addr);
+static void uvm_setup_shm(void);
+static int uvm_send(const void *buf, size_t len);
+static int uvm_recv(void *buf, size_t len, int peek);
+static int uvm_open_uffd(uint64_t features);
+static void uvm_setup_uffd(void);
+static void uvm_block_segv(void);
+static uint32_t uvm_req_get(uintptr_t page);
+static void uvm_req_put(uint32_t tag);
+static intptr_t uvm_req_wait(uint32_t tag, uint32_t *count);
+static void uvm_req_done(uint32_t tag, intptr_t result);
+static void uvm_uffd_fault(uintptr_t va);
+static size_t uvm_page_index(uintptr_t va);
+static void uvm_map_missing(uintptr_t va, size_t npages);
+static void uvm_map_frame(uintptr_t va, off_t off, int prot);
+static void uvm_chprot(uintptr_t va, size_t npages, int prot);
+static void uvm_add_pages(uintptr_t va, size_t npages);
 
 #define NUM_CONNECTION_TRIES 3
 
@@ -78,8 +154,19 @@ void uvm_create(void)/*{{{*/
 	assert(uvm == NULL);
 	uvm = malloc(sizeof(*uvm));
 	if(!uvm) prexit();
+	PAGESIZE = sysconf(_SC_PAGESIZE);
+	size_t maxpages = (UVM_MAXADDR - UVM_BASEADDR + 1) / PAGESIZE;
+	uvm->pgstate = calloc(maxpages, sizeof(uvm->pgstate[0]));
+	uvm->pgoff = malloc(maxpages * sizeof(uvm->pgoff[0]));
+	if(!uvm->pgstate || !uvm->pgoff) prexit();
+	for(size_t i = 0; i < maxpages; i++)
+		uvm->pgoff[i] = -1;
 	uvm->running = 1;
 	uvm->npages = 0;
+	uvm->shm = NULL;
+	pthread_mutex_init(&uvm->send_lock, NULL);
+	uvm->nreqs = 0;
+	uvm->uffd = -1;
 
 	logd(LOG_DEBUG, "  connecting unix socket [%s]\n", MMU_PROTO_UNIX_PATH);
 	uvm->sock = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -110,6 +197,14 @@ void uvm_create(void)/*{{{*/
 	if(uvm->pmem_fd == -1)
 		prexit();
 
+	const char *transport = getenv("UVM_TRANSPORT");
+	if(transport && strcmp(transport, "shm") == 0)
+		uvm_setup_shm();
+
+	const char *faults = getenv("UVM_FAULTS");
+	if(faults && strcmp(faults, "uffd") == 0)
+		uvm_setup_uffd();
+
 	logd(LOG_DEBUG, "  setting up SEGV handler\n");
 	struct sigaction new;
 	new.sa_sigaction = uvm_segv_action;
@@ -121,7 +216,13 @@ void uvm_create(void)/*{{{*/
 	logd(LOG_DEBUG, "  starting uvm_thread()\n");
 	pthread_mutex_init(&uvm->mutex, NULL);
 	pthread_cond_init(&uvm->cond, NULL);
+	for(int i = 0; i < UVM_MAX_REQS; i++) {
+		uvm->reqs[i].busy = 0;
+		pthread_cond_init(&uvm->reqs[i].cond, NULL);
+	}
 	pthread_create(&uvm->thread, NULL, uvm_thread, NULL);
+	if(uvm->uffd != -1)
+		pthread_create(&uvm->fault_thread, NULL, uvm_fault_thread, NULL);
 
 	logd(LOG_DEBUG, "  setting up uvm_exit() on_exit()\n");
 	if(on_exit(uvm_exit, NULL)) prexit();
@@ -133,12 +234,75 @@ void * uvm_extend(void) {/*{{{*/
 	pthread_mutex_lock(&uvm->mutex);
 	struct mmu_proto_extend_req req;
 	req.type = MMU_PROTO_EXTEND_REQ;
-	if(send(uvm->sock, &req, sizeof(req), 0) != sizeof(req))
+	req.tag = uvm_req_get(0);
+	if(uvm_send(&req, sizeof(req)) == -1)
 		prexit();
-	pthread_cond_wait(&uvm->cond, &uvm->mutex);
-	if(uvm->result) uvm->npages++;
+	intptr_t vaddr = uvm_req_wait(req.tag, NULL);
+	if(vaddr) uvm_add_pages(vaddr, 1);
 	pthread_mutex_unlock(&uvm->mutex);
-	return (void *)uvm->result;
+	return (void *)vaddr;
+}/*}}}*/
+
+void * uvm_extend_n(size_t npages, size_t *nallocated)/*{{{*/
+{
+	if(nallocated) *nallocated = 0;
+	if(npages == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	pthread_mutex_lock(&uvm->mutex);
+	struct mmu_proto_extendv_req req;
+	req.type = MMU_PROTO_EXTENDV_REQ;
+	req.tag = uvm_req_get(0);
+	req.count = npages < UINT32_MAX ? (uint32_t)npages : UINT32_MAX;
+	req.partial = nallocated != NULL;
+	if(uvm_send(&req, sizeof(req)) == -1)
+		prexit();
+	uint32_t count;
+	intptr_t vaddr = uvm_req_wait(req.tag, &count);
+	if(count) uvm_add_pages(vaddr, count);
+	pthread_mutex_unlock(&uvm->mutex);
+	if(!count) {
+		errno = ENOSPC;
+		return NULL;
+	}
+	if(nallocated) *nallocated = count;
+	return (void *)vaddr;
+}/*}}}*/
+
+int uvm_release(void *addr, size_t npages)/*{{{*/
+{
+	uintptr_t va = (uintptr_t)addr;
+	if(npages == 0 || npages > UINT32_MAX || va % PAGESIZE != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&uvm->mutex);
+	struct mmu_proto_release_req req;
+	req.type = MMU_PROTO_RELEASE_REQ;
+	req.tag = uvm_req_get(0);
+	req.count = (uint32_t)npages;
+	req.addr = va;
+	if(uvm_send(&req, sizeof(req)) == -1)
+		prexit();
+	int rc = (int)uvm_req_wait(req.tag, NULL);
+	if(rc == 0) {
+		/* The MMU already took access away; drop the mappings so
+		 * touching the pages faults as unallocated memory. */
+		if(munmap(addr, npages * PAGESIZE) == -1) prexit();
+		size_t first = uvm_page_index(va);
+		for(size_t i = first; i < first + npages; i++) {
+			uvm->pgstate[i] &= ~UVM_PAGE_STATE;
+			uvm->pgstate[i] |= UVM_PAGE_RELEASED;
+			uvm->pgoff[i] = -1;
+		}
+		while(uvm->npages > 0 && (uvm->pgstate[uvm->npages - 1] &
+				UVM_PAGE_STATE) == UVM_PAGE_RELEASED)
+			uvm->npages--;
+	}
+	pthread_mutex_unlock(&uvm->mutex);
+	if(rc != 0) errno = EINVAL;
+	return rc;
 }/*}}}*/
 
 int uvm_syslog(void *addr, size_t len)/*{{{*/
@@ -146,14 +310,15 @@ int uvm_syslog(void *addr, size_t len)/*{{{*/
 	pthread_mutex_lock(&uvm->mutex);
 	struct mmu_proto_syslog_req req;
 	req.type = MMU_PROTO_SYSLOG_REQ;
+	req.tag = uvm_req_get(0);
 	req.addr = (intptr_t)addr;
 	req.len = len;
-	if(send(uvm->sock, &req, sizeof(req), 0) != sizeof(req))
+	if(uvm_send(&req, sizeof(req)) == -1)
 		prexit();
-	pthread_cond_wait(&uvm->cond, &uvm->mutex);
-	if(uvm->result != 0) errno = EINVAL;
+	int rc = (int)uvm_req_wait(req.tag, NULL);
 	pthread_mutex_unlock(&uvm->mutex);
-	return (int)uvm->result;
+	if(rc != 0) errno = EINVAL;
+	return rc;
 }/*}}}*/
 
 /****************************************************************************
@@ -161,22 +326,25 @@ int uvm_syslog(void *addr, size_t len)/*{{{*/
  ***************************************************************************/
 void * uvm_thread(void *data) {/*{{{*/
 	logd(LOG_DEBUG, "uvm_thread masking SEGV\n");
-	sigset_t sigset;
-	if(sigemptyset(&sigset) == -1) prexit();
-	if(sigaddset(&sigset, SIGSEGV) == -1) prexit();
-	if(sigprocmask(SIG_BLOCK, &sigset, NULL) == -1) prexit();
+	uvm_block_segv();
 
 	while(uvm->running) {
 		logd(LOG_DEBUG, "uvm_thread waiting message\n");
 		uint32_t type;
-		ssize_t c = recv(uvm->sock, &type, sizeof(type), MSG_PEEK);
+		int rc = uvm_recv(&type, sizeof(type), 1);
 		if(!uvm->running) break;
-		if(c != sizeof(type)) prexit();
+		if(rc == -1) prexit();
 		pthread_mutex_lock(&uvm->mutex);
 		switch(type) {
 			case MMU_PROTO_EXTEND_REP:
 				uvm_proto_extend_rep();
 				break;
+			case MMU_PROTO_EXTENDV_REP:
+				uvm_proto_extendv_rep();
+				break;
+			case MMU_PROTO_RELEASE_REP:
+				uvm_proto_release_rep();
+				break;
 			case MMU_PROTO_SYSLOG_REP:
 				uvm_proto_syslog_rep();
 				break;
@@ -189,6 +357,9 @@ void * uvm_thread(void *data) {/*{{{*/
 			case MMU_PROTO_CHPROT_REP:
 				uvm_proto_chprot_rep();
 				break;
+			case MMU_PROTO_CHPROTV_REP:
+				uvm_proto_chprotv_rep();
+				break;
 			case MMU_PROTO_EXIT_REP:
 				uvm->running = 0;
 				break;
@@ -202,19 +373,67 @@ void * uvm_thread(void *data) {/*{{{*/
 	pthread_exit(NULL);
 }/*}}}*/
 
+/* Reads page faults from the userfaultfd and forwards them to the MMU.
+ * The faulting threads stay asleep in the kernel until the SEGV_REP
+ * comes back, so any number of them can wait at once. */
+void * uvm_fault_thread(void *data) {/*{{{*/
+	logd(LOG_DEBUG, "uvm_fault_thread starting\n");
+	uvm_block_segv();
+	struct pollfd pfd[2];
+	pfd[0].fd = uvm->uffd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = uvm->uffd_stop;
+	pfd[1].events = POLLIN;
+	for(;;) {
+		if(poll(pfd, 2, -1) == -1) {
+			if(errno == EINTR) continue;
+			prexit();
+		}
+		if(pfd[1].revents) break;
+		struct uffd_msg msg[16];
+		ssize_t n = read(uvm->uffd, msg, sizeof(msg));
+		if(n == -1) {
+			if(errno == EAGAIN || errno == EINTR) continue;
+			prexit();
+		}
+		pthread_mutex_lock(&uvm->mutex);
+		for(size_t i = 0; i < n / sizeof(msg[0]); i++) {
+			if(msg[i].event != UFFD_EVENT_PAGEFAULT) continue;
+			uvm_uffd_fault((uintptr_t)msg[i].arg.pagefault.address);
+		}
+		pthread_mutex_unlock(&uvm->mutex);
+	}
+	logd(LOG_DEBUG, "uvm_fault_thread exiting\n");
+	pthread_exit(NULL);
+}/*}}}*/
+
 void uvm_exit(int status, void *arg)/*{{{*/
 {
 	logd(LOG_DEBUG, "uvm_exit running\n");
 	struct mmu_proto_exit_req req;
 	req.type = MMU_PROTO_EXIT_REQ;
 	/* socket may have been closed by the MMU, ignore return value: */
-	send(uvm->sock, &req, sizeof(req), 0);
+	uvm_send(&req, sizeof(req));
 	pthread_mutex_unlock(&(uvm->mutex));
 	pthread_join(uvm->thread, NULL);
+	if(uvm->uffd != -1) {
+		uint64_t one = 1;
+		if(write(uvm->uffd_stop, &one, sizeof(one)) != sizeof(one))
+			prexit();
+		pthread_join(uvm->fault_thread, NULL);
+		close(uvm->uffd_stop);
+		close(uvm->uffd);
+	}
+	free(uvm->pgstate);
+	free(uvm->pgoff);
 	close(uvm->sock);
+	if(uvm->shm) munmap(uvm->shm, sizeof(*uvm->shm));
+	pthread_mutex_destroy(&uvm->send_lock);
 
 	pthread_mutex_destroy(&uvm->mutex);
 	pthread_cond_destroy(&uvm->cond);
+	for(int i = 0; i < UVM_MAX_REQS; i++)
+		pthread_cond_destroy(&uvm->reqs[i].cond);
 	free(uvm->pmem_fn);
 	close(uvm->pmem_fd);
 	free(uvm);
@@ -235,8 +454,9 @@ void uvm_segv_action(int signum, siginfo_t *si, void *context)/*{{{*/
 		fprintf(stderr, "(external) segmentation fault\n");
 		exit(EXIT_FAILURE);
 	}
-	size_t pagesz = sysconf(_SC_PAGESIZE);
-	if(va >= UVM_BASEADDR + (uvm->npages * pagesz)) {
+	if(va >= UVM_BASEADDR + (uvm->npages * PAGESIZE) ||
+			(uvm->pgstate[uvm_page_index(va)] & UVM_PAGE_STATE) ==
+			UVM_PAGE_RELEASED) {
 		logd(LOG_DEBUG, "access to unnallocated MMU address.\n");
 		fprintf(stderr, "(internal) segmentation fault.\n");
 		fprintf(stderr, "address %p not allocated.\n", (void *)va);
@@ -245,12 +465,13 @@ void uvm_segv_action(int signum, siginfo_t *si, void *context)/*{{{*/
 
 	struct mmu_proto_segv_req req;
 	req.type = MMU_PROTO_SEGV_REQ;
+	req.tag = uvm_req_get(0);
 	req.addr = (intptr_t)si->si_addr;
 	req.code = si->si_code;
-	if(send(uvm->sock, &req, sizeof(req), 0) != sizeof(req)) prexit();
+	if(uvm_send(&req, sizeof(req)) == -1) prexit();
 
 	logd(LOG_DEBUG, "%s waiting service at condition variable\n", __func__);
-	pthread_cond_wait(&uvm->cond, &uvm->mutex);
+	uvm_req_wait(req.tag, NULL);
 	pthread_mutex_unlock(&uvm->mutex);
 	logd(LOG_DEBUG, "%s returning\n", __func__);
 }/*}}}*/
@@ -262,91 +483,137 @@ void uvm_proto_extend_rep(void)/*{{{*/
 {
 	logd(LOG_DEBUG, "processing EXTEND_REP\n");
 	struct mmu_proto_extend_rep rep;
-	if(recv(uvm->sock, &rep, sizeof(rep), 0) != sizeof(rep))
+	if(uvm_recv(&rep, sizeof(rep), 0) == -1)
 		prexit();
 	assert(rep.type == MMU_PROTO_EXTEND_REP);
-	uvm->result = (intptr_t)rep.vaddr;
-	pthread_cond_signal(&uvm->cond);
+	uvm_req_done(rep.tag, (intptr_t)rep.vaddr);
+}/*}}}*/
+
+void uvm_proto_extendv_rep(void)/*{{{*/
+{
+	logd(LOG_DEBUG, "processing EXTENDV_REP\n");
+	struct mmu_proto_extendv_rep rep;
+	if(uvm_recv(&rep, sizeof(rep), 0) == -1)
+		prexit();
+	assert(rep.type == MMU_PROTO_EXTENDV_REP);
+	uvm_req_done(rep.tag, (intptr_t)rep.vaddr);
+	uvm->reqs[rep.tag].count = rep.count;
+}/*}}}*/
+
+void uvm_proto_release_rep(void)/*{{{*/
+{
+	logd(LOG_DEBUG, "processing RELEASE_REP\n");
+	struct mmu_proto_release_rep rep;
+	if(uvm_recv(&rep, sizeof(rep), 0) == -1)
+		prexit();
+	assert(rep.type == MMU_PROTO_RELEASE_REP);
+	uvm_req_done(rep.tag, (int32_t)rep.retcode);
 }/*}}}*/
 
 void uvm_proto_syslog_rep(void)/*{{{*/
 {
 	logd(LOG_DEBUG, "processing SYSLOG_REP\n");
 	struct mmu_proto_syslog_rep rep;
-	if(recv(uvm->sock, &rep, sizeof(rep), 0) != sizeof(rep))
+	if(uvm_recv(&rep, sizeof(rep), 0) == -1)
 		prexit();
 	assert(rep.type == MMU_PROTO_SYSLOG_REP);
-	uvm->result = (intptr_t)rep.retcode;
-	pthread_cond_signal(&uvm->cond);
+	uvm_req_done(rep.tag, (int32_t)rep.retcode);
 }/*}}}*/
 
 void uvm_proto_segv_rep(void)/*{{{*/
 {
 	logd(LOG_DEBUG, "processing SEGV_REP\n");
 	struct mmu_proto_segv_rep rep;
-	if(recv(uvm->sock, &rep, sizeof(rep), 0) != sizeof(rep))
+	if(uvm_recv(&rep, sizeof(rep), 0) == -1)
 		prexit();
 	assert(rep.type == MMU_PROTO_SEGV_REP);
-	pthread_cond_signal(&uvm->cond);
+	uvm_req_done(rep.tag, 0);
 }/*}}}*/
 
 void uvm_proto_remap_rep(void)/*{{{*/
 {
 	logd(LOG_DEBUG, "processing REMAP_REP\n");
 	struct mmu_proto_remap_rep rep;
-	if(recv(uvm->sock, &rep, sizeof(rep), 0) != sizeof(rep))
+	if(uvm_recv(&rep, sizeof(rep), 0) == -1)
 		prexit();
 	assert(rep.type == MMU_PROTO_REMAP_REP);
-	assert(rep.prot != PROT_NONE);
 
 	assert(rep.vaddr < UINTPTR_MAX);
 	void *addr = (void *)(intptr_t)rep.vaddr;
 	int prot = (int)rep.prot;
 	off_t off = (off_t)rep.offset;
-	size_t pagesz = sysconf(_SC_PAGESIZE);
 	logd(LOG_DEBUG, "remapping %p at offset %llu prot %d\n", rep.vaddr,
 			(unsigned long long)rep.offset, prot);
-	if(((uintptr_t)rep.vaddr % (uintptr_t)pagesz) != 0) {
+	if(((uintptr_t)rep.vaddr % (uintptr_t)PAGESIZE) != 0) {
 		logd(LOG_FATAL, "error: unaligned remap of vaddr %p\n", addr);
 		prexit();
 	}
-	munmap(addr, pagesz);
-	void *r = mmap(addr, pagesz, prot, MAP_SHARED, uvm->pmem_fd, off);
-	if(r != addr)
-		prexit();
-	logd(LOG_DEBUG, "mprotect %p prot %d\n", rep.vaddr, prot);
-	if(mprotect(addr, pagesz, prot) == -1)
-		prexit();
+	if(uvm->uffd != -1 && prot == PROT_NONE) {
+		uvm->pgoff[uvm_page_index(rep.vaddr)] = off;
+		uvm_map_missing(rep.vaddr, 1);
+	} else {
+		uvm_map_frame(rep.vaddr, off, prot);
+	}
 
 	struct mmu_proto_remap_req req;
 	req.type = MMU_PROTO_REMAP_REQ;
-	if(send(uvm->sock, &req, sizeof(req), 0) != sizeof(req)) prexit();
+	if(uvm_send(&req, sizeof(req)) == -1) prexit();
 }/*}}}*/
 
 void uvm_proto_chprot_rep(void)/*{{{*/
 {
 	logd(LOG_DEBUG, "processing CHPROT_REP\n");
 	struct mmu_proto_chprot_rep rep;
-	if(recv(uvm->sock, &rep, sizeof(rep), 0) != sizeof(rep))
+	if(uvm_recv(&rep, sizeof(rep), 0) == -1)
 		prexit();
 	assert(rep.type == MMU_PROTO_CHPROT_REP);
 
 	assert(rep.vaddr < UINTPTR_MAX);
-	void *addr = (void *)(uintptr_t)rep.vaddr;
 	int prot = (int)rep.prot;
-	size_t pagesz = sysconf(_SC_PAGESIZE);
-	logd(LOG_DEBUG, "mprotect %p prot %d\n", addr, prot);
-	if(mprotect(addr, pagesz, prot) == -1)
-		prexit();
+	logd(LOG_DEBUG, "mprotect %p prot %d\n", (void *)(uintptr_t)rep.vaddr,
+			prot);
+	uvm_chprot(rep.vaddr, 1, prot);
 	/* if(prot == PROT_NONE) {
 		logd(LOG_DEBUG, "unmaping %p\n", rep.vaddr);
-		if(munmap(addr, pagesz) == -1)
+		if(munmap(addr, PAGESIZE) == -1)
 			prexit();
 	} */
 
 	struct mmu_proto_chprot_req req;
 	req.type = MMU_PROTO_CHPROT_REQ;
-	if(send(uvm->sock, &req, sizeof(req), 0) != sizeof(req)) prexit();
+	if(uvm_send(&req, sizeof(req)) == -1) prexit();
+}/*}}}*/
+
+/* Applies a batch of protection changes.  Runs of adjacent pages getting
+ * the same protection are changed with a single mprotect. */
+void uvm_proto_chprotv_rep(void)/*{{{*/
+{
+	logd(LOG_DEBUG, "processing CHPROTV_REP\n");
+	struct mmu_proto_chprotv_rep rep;
+	if(uvm_recv(&rep, sizeof(rep), 0) == -1)
+		prexit();
+	assert(rep.type == MMU_PROTO_CHPROTV_REP);
+	assert(rep.count <= MMU_PROTO_CHPROTV_MAX);
+	struct mmu_proto_chprotv_entry v[MMU_PROTO_CHPROTV_MAX];
+	if(uvm_recv(v, rep.count * sizeof(v[0]), 0) == -1)
+		prexit();
+
+	uint32_t i = 0;
+	while(i < rep.count) {
+		uint32_t j = i + 1;
+		while(j < rep.count && v[j].prot == v[i].prot &&
+				v[j].vaddr == v[j-1].vaddr + PAGESIZE)
+			j++;
+		void *addr = (void *)(uintptr_t)v[i].vaddr;
+		logd(LOG_DEBUG, "mprotect %p pages %u prot %d\n", addr,
+				j - i, (int)v[i].prot);
+		uvm_chprot(v[i].vaddr, j - i, (int)v[i].prot);
+		i = j;
+	}
+
+	struct mmu_proto_chprotv_req req;
+	req.type = MMU_PROTO_CHPROTV_REQ;
+	if(uvm_send(&req, sizeof(req)) == -1) prexit();
 }/*}}}*/
 
 /****************************************************************************
@@ -370,3 +637,324 @@ void uvm_connect_socket(int sock, const struct sockaddr_un * addr) {
 		prexit();
 	}
 }
+
+/* Asks the MMU to move this connection to shared memory.  If the MMU
+ * cannot do it we silently keep using the socket. */
+void uvm_setup_shm(void)/*{{{*/
+{
+	logd(LOG_DEBUG, "  sending SHM_REQ\n");
+	struct mmu_proto_shm_req req;
+	req.type = MMU_PROTO_SHM_REQ;
+	if(send(uvm->sock, &req, sizeof(req), 0) != sizeof(req))
+		prexit();
+
+	struct mmu_proto_shm_rep rep;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { &rep, sizeof(rep) };
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	if(recvmsg(uvm->sock, &mh, MSG_CMSG_CLOEXEC) != sizeof(rep)) prexit();
+	assert(rep.type == MMU_PROTO_SHM_REP);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+	if(rep.size == 0 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+		logd(LOG_WARN, "  MMU refused shared memory, using socket\n");
+		return;
+	}
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+	assert(rep.size == sizeof(*uvm->shm));
+	void *shm = mmap(NULL, rep.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	close(fd);
+	if(shm == MAP_FAILED) prexit();
+	uvm->shm = shm;
+	logd(LOG_DEBUG, "  using shared memory transport\n");
+}/*}}}*/
+
+int uvm_send(const void *buf, size_t len)/*{{{*/
+{
+	if(!uvm->shm)
+		return send(uvm->sock, buf, len, 0) == (ssize_t)len ? 0 : -1;
+	pthread_mutex_lock(&uvm->send_lock);
+	int rc = ring_write(&uvm->shm->req, buf, len);
+	pthread_mutex_unlock(&uvm->send_lock);
+	return rc;
+}/*}}}*/
+
+/* Receives exactly `len` bytes from the MMU, leaving them in place if
+ * `peek` is set.  Returns 0 on success and -1 if the MMU went away. */
+int uvm_recv(void *buf, size_t len, int peek)/*{{{*/
+{
+	if(!uvm->shm) {
+		ssize_t c = recv(uvm->sock, buf, len, peek ? MSG_PEEK : MSG_WAITALL);
+		return c == (ssize_t)len ? 0 : -1;
+	}
+	while(ring_read(&uvm->shm->rep, buf, len, peek) == -1) {
+		if(errno != ETIMEDOUT) return -1;
+		/* The MMU never writes to the socket now; EOF means it died. */
+		char byte;
+		if(recv(uvm->sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+			return -1;
+	}
+	return 0;
+}/*}}}*/
+
+/* Opens a userfaultfd with `features`.  Without the privilege to catch
+ * kernel-mode faults we ask for user-mode ones only, which is all this
+ * library needs.  Returns -1 and sets errno on error. */
+int uvm_open_uffd(uint64_t features)/*{{{*/
+{
+	int fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	#ifdef UFFD_USER_MODE_ONLY
+	if(fd == -1 && errno == EPERM)
+		fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK |
+				UFFD_USER_MODE_ONLY);
+	#endif
+	if(fd == -1) return -1;
+	struct uffdio_api api;
+	memset(&api, 0, sizeof(api));
+	api.api = UFFD_API;
+	api.features = features;
+	if(ioctl(fd, UFFDIO_API, &api) == -1) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}/*}}}*/
+
+/* Switches page faults on extended pages to a userfaultfd.  On failure
+ * faults keep arriving as SIGSEGV. */
+void uvm_setup_uffd(void)/*{{{*/
+{
+	logd(LOG_DEBUG, "  opening userfaultfd\n");
+	int fd = uvm_open_uffd(UVM_UFFD_FEATURES);
+	if(fd == -1 && errno == EINVAL && UVM_UFFD_FEATURES)
+		fd = uvm_open_uffd(0);
+	if(fd == -1) goto out_warn;
+	uvm->uffd_stop = eventfd(0, EFD_CLOEXEC);
+	if(uvm->uffd_stop == -1) goto out_close;
+	uvm->uffd = fd;
+	logd(LOG_DEBUG, "  using userfaultfd for page faults\n");
+	return;
+
+	out_close:
+	close(fd);
+	out_warn:
+	loge(LOG_WARN, __FILE__, __LINE__);
+	logd(LOG_WARN, "  userfaultfd unavailable, using SIGSEGV\n");
+}/*}}}*/
+
+void uvm_block_segv(void)/*{{{*/
+{
+	sigset_t sigset;
+	if(sigemptyset(&sigset) == -1) prexit();
+	if(sigaddset(&sigset, SIGSEGV) == -1) prexit();
+	if(sigprocmask(SIG_BLOCK, &sigset, NULL) == -1) prexit();
+}/*}}}*/
+
+/* Takes a free completion slot, waiting for one if all are in use, and
+ * returns its tag.  `page` is the page to wake for userfaultfd faults
+ * and 0 otherwise.  Assumes `uvm->mutex` is locked. */
+uint32_t uvm_req_get(uintptr_t page)/*{{{*/
+{
+	while(uvm->nreqs == UVM_MAX_REQS)
+		pthread_cond_wait(&uvm->cond, &uvm->mutex);
+	uint32_t tag = 0;
+	while(uvm->reqs[tag].busy) tag++;
+	struct uvm_req *r = &uvm->reqs[tag];
+	r->busy = 1;
+	r->done = 0;
+	r->page = page;
+	uvm->nreqs++;
+	return tag;
+}/*}}}*/
+
+void uvm_req_put(uint32_t tag)/*{{{*/
+{
+	uvm->reqs[tag].busy = 0;
+	uvm->nreqs--;
+	pthread_cond_signal(&uvm->cond);
+}/*}}}*/
+
+/* Waits for the reply to request `tag`, frees its slot and returns the
+ * reply's result, and its page count in `count` if not NULL.  Assumes
+ * `uvm->mutex` is locked. */
+intptr_t uvm_req_wait(uint32_t tag, uint32_t *count)/*{{{*/
+{
+	struct uvm_req *r = &uvm->reqs[tag];
+	while(!r->done)
+		pthread_cond_wait(&r->cond, &uvm->mutex);
+	intptr_t result = r->result;
+	if(count) *count = r->count;
+	uvm_req_put(tag);
+	return result;
+}/*}}}*/
+
+/* Completes request `tag` with `result`.  Assumes `uvm->mutex` is
+ * locked. */
+void uvm_req_done(uint32_t tag, intptr_t result)/*{{{*/
+{
+	if(tag >= UVM_MAX_REQS || !uvm->reqs[tag].busy) {
+		logd(LOG_FATAL, "error: reply with unknown tag %u\n", tag);
+		prexit();
+	}
+	struct uvm_req *r = &uvm->reqs[tag];
+	if(!r->page) {
+		r->result = result;
+		r->done = 1;
+		pthread_cond_signal(&r->cond);
+		return;
+	}
+	uvm->pgstate[uvm_page_index(r->page)] &= ~UVM_PAGE_PENDING;
+	struct uffdio_range range;
+	range.start = r->page;
+	range.len = PAGESIZE;
+	if(ioctl(uvm->uffd, UFFDIO_WAKE, &range) == -1)
+		prexit();
+	uvm_req_put(tag);
+}/*}}}*/
+
+/* Forwards a userfaultfd fault at `va` to the MMU.  Threads faulting on
+ * a page that already has a fault in flight share its reply; a fault
+ * read after its page got mapped is woken right away.  Assumes
+ * `uvm->mutex` is locked. */
+void uvm_uffd_fault(uintptr_t va)/*{{{*/
+{
+	uintptr_t page = va & ~(uintptr_t)(PAGESIZE - 1);
+	unsigned char *state = &uvm->pgstate[uvm_page_index(page)];
+	logd(LOG_DEBUG, "uffd fault addr %p state %d\n", (void *)va, *state);
+	if(*state & UVM_PAGE_PENDING) return;
+	if((*state & UVM_PAGE_STATE) != UVM_PAGE_MISSING) {
+		struct uffdio_range range;
+		range.start = page;
+		range.len = PAGESIZE;
+		if(ioctl(uvm->uffd, UFFDIO_WAKE, &range) == -1) prexit();
+		return;
+	}
+	*state |= UVM_PAGE_PENDING;
+	struct mmu_proto_segv_req req;
+	req.type = MMU_PROTO_SEGV_REQ;
+	req.tag = uvm_req_get(page);
+	req.addr = va;
+	req.code = SEGV_MAPERR;
+	if(uvm_send(&req, sizeof(req)) == -1) prexit();
+}/*}}}*/
+
+size_t uvm_page_index(uintptr_t va)/*{{{*/
+{
+	size_t i = (va - UVM_BASEADDR) / PAGESIZE;
+	assert(va >= UVM_BASEADDR && va <= UVM_MAXADDR);
+	return i;
+}/*}}}*/
+
+/* Replaces `npages` pages at `va` with empty anonymous memory registered
+ * with the userfaultfd, so the next access to them is read by
+ * `uvm_fault_thread`. */
+void uvm_map_missing(uintptr_t va, size_t npages)/*{{{*/
+{
+	size_t len = npages * PAGESIZE;
+	void *addr = (void *)va;
+	void *r = mmap(addr, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	if(r != addr) prexit();
+	struct uffdio_register reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.range.start = va;
+	reg.range.len = len;
+	reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+	if(ioctl(uvm->uffd, UFFDIO_REGISTER, &reg) == -1) prexit();
+	size_t first = uvm_page_index(va);
+	for(size_t i = first; i < first + npages; i++) {
+		uvm->pgstate[i] &= ~UVM_PAGE_STATE;
+		uvm->pgstate[i] |= UVM_PAGE_MISSING;
+	}
+}/*}}}*/
+
+/* Maps the frame at offset `off` of `pmem_fd` over the page at `va`.
+ * MAP_FIXED replaces whatever was there in one call; if the page
+ * already maps that frame only its protection changes. */
+void uvm_map_frame(uintptr_t va, off_t off, int prot)/*{{{*/
+{
+	void *addr = (void *)va;
+	size_t i = uvm_page_index(va);
+	if((uvm->pgstate[i] & UVM_PAGE_STATE) == UVM_PAGE_MAPPED &&
+			uvm->pgoff[i] == off) {
+		if(mprotect(addr, PAGESIZE, prot) == -1) prexit();
+		return;
+	}
+	void *r = mmap(addr, PAGESIZE, prot, MAP_SHARED | MAP_FIXED,
+			uvm->pmem_fd, off);
+	if(r != addr) prexit();
+	uvm->pgoff[i] = off;
+	uvm->pgstate[i] &= ~UVM_PAGE_STATE;
+	uvm->pgstate[i] |= UVM_PAGE_MAPPED;
+}/*}}}*/
+
+/* Changes the protection of `npages` pages at `va`.  With the
+ * userfaultfd, PROT_NONE pages are replaced by missing pages (a present
+ * page never faults into the userfaultfd) and giving access back maps
+ * the page's frame again. */
+void uvm_chprot(uintptr_t va, size_t npages, int prot)/*{{{*/
+{
+	if(uvm->uffd == -1) {
+		if(mprotect((void *)va, npages * PAGESIZE, prot) == -1)
+			prexit();
+		return;
+	}
+	if(prot == PROT_NONE) {
+		uvm_map_missing(va, npages);
+		return;
+	}
+	size_t i = 0;
+	while(i < npages) {
+		uintptr_t addr = va + i * PAGESIZE;
+		size_t k = uvm_page_index(addr);
+		size_t j = i + 1;
+		if((uvm->pgstate[k] & UVM_PAGE_STATE) == UVM_PAGE_MAPPED) {
+			while(j < npages && (uvm->pgstate[k + j - i] &
+					UVM_PAGE_STATE) == UVM_PAGE_MAPPED)
+				j++;
+			if(mprotect((void *)addr, (j - i) * PAGESIZE, prot) == -1)
+				prexit();
+		} else if(uvm->pgoff[k] != -1) {
+			uvm_map_frame(addr, uvm->pgoff[k], prot);
+		} else {
+			logd(LOG_WARN, "chprot of unmapped page %p\n", (void *)addr);
+		}
+		i = j;
+	}
+}/*}}}*/
+
+/* Accounts for `npages` new pages at `va`, which may have been
+ * released before, and, with the userfaultfd, registers those the MMU
+ * has not mapped yet.  Concurrent extends may
+ * be answered out of order.  Assumes `uvm->mutex` is locked. */
+void uvm_add_pages(uintptr_t va, size_t npages)/*{{{*/
+{
+	int last = (va - UVM_BASEADDR) / PAGESIZE + npages;
+	if(last > uvm->npages) uvm->npages = last;
+	size_t first = uvm_page_index(va);
+	for(size_t i = first; i < first + npages; i++) {
+		if((uvm->pgstate[i] & UVM_PAGE_STATE) == UVM_PAGE_RELEASED)
+			uvm->pgstate[i] &= ~UVM_PAGE_STATE; /* UNMAPPED */
+	}
+	if(uvm->uffd == -1) return;
+	size_t i = 0;
+	while(i < npages) {
+		if(uvm->pgstate[first + i] != UVM_PAGE_UNMAPPED) {
+			i++;
+			continue;
+		}
+		size_t j = i + 1;
+		while(j < npages && uvm->pgstate[first + j] == UVM_PAGE_UNMAPPED)
+			j++;
+		uvm_map_missing(va + i * PAGESIZE, j - i);
+		i = j;
+	}
+}/*}}}*/
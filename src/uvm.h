@@ -10,7 +10,19 @@
 /* `uvm_create` should be called when a program starts to bind it to
  * the memory management infrastructure.  This function sets up
  * a UNIX socket to communicate with the memory management
- * infrastructure and installs a signal handler for SIGSEGV. */
+ * infrastructure and installs a signal handler for SIGSEGV.
+ *
+ * If the environment variable UVM_TRANSPORT is set to "shm", the
+ * socket is only used for setup and all later messages go through
+ * rings in memory shared with the MMU, which avoids system calls on
+ * the page fault path.
+ *
+ * If the environment variable UVM_FAULTS is set to "uffd", faults on
+ * pages without access are read from a userfaultfd by a service
+ * thread instead of being caught by the SIGSEGV handler, so several
+ * threads can wait on faults at once.  Write faults on read-only pages
+ * and faults outside allocated memory still raise SIGSEGV.  If the
+ * kernel refuses the userfaultfd, SIGSEGV is used for every fault. */
 void uvm_create(void);
 
 /* `uvm_extend` allocates a new page for the calling process and
@@ -22,6 +34,26 @@ void uvm_create(void);
  * system page size is given by `sysconf(_SC_PAGESIZE)`. */
 void * uvm_extend(void);
 
+/* `uvm_extend_n` allocates `npages` consecutive pages with a single
+ * request to the memory management infrastructure and returns the
+ * address of the first one.  If `nallocated` is NULL, either all
+ * pages are allocated or none is; otherwise fewer pages may be
+ * allocated if swap runs out, and their number is stored in
+ * `*nallocated`.  Fails, returns NULL, and sets `errno` to ENOSPC if
+ * no page was allocated. */
+void * uvm_extend_n(size_t npages, size_t *nallocated);
+
+/* `uvm_release` gives the `npages` pages starting at `addr` back to
+ * the memory management infrastructure, which frees their memory
+ * frames and swap blocks right away.  `addr` must be page-aligned and
+ * the pages allocated with `uvm_extend` or `uvm_extend_n`; pages in
+ * the range that were already released are skipped.  Accessing a
+ * released page is a segmentation fault, as for memory never
+ * allocated.  If the released pages are the last ones, later calls to
+ * `uvm_extend` reuse their addresses.  Returns 0 on success; on
+ * failure, returns -1 and sets `errno` to EINVAL. */
+int uvm_release(void *addr, size_t npages);
+
 /* `uvm_syslog` requests the memory infrastructure to write the
  * string at `addr` with `len` bytes.  Memory at `addr` must be
  * managed by the memory infrastructure (i.e., allocated with
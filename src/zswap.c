@@ -0,0 +1,365 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "zswap.h"
+
+/*****************************************************************************
+ * compressor
+ ****************************************************************************/
+/* A byte-oriented LZ77 in the style of LZ4's block format: each sequence
+ * is a token byte holding the literal count and match length (minus
+ * LZ_MINMATCH) in its high and low nibbles, extra length bytes when a
+ * nibble is 15, the literals, and a 16-bit little-endian match offset.
+ * The last sequence has literals only.  Pages are at most 64 KiB, so
+ * offsets and hash table positions fit in 16 bits. */
+#define LZ_MINMATCH 4
+#define LZ_HASH_BITS 12
+
+static inline uint32_t lz_read32(const unsigned char *p)/*{{{*/
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}/*}}}*/
+
+static inline unsigned lz_hash(uint32_t v)/*{{{*/
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}/*}}}*/
+
+/* Returns how many bytes at =ip= and =ref= match, up to =end=.  Compares
+ * a word at a time. */
+static size_t lz_count(const unsigned char *ip, const unsigned char *ref,/*{{{*/
+		const unsigned char *end)
+{
+	const unsigned char *start = ip;
+	while(ip + sizeof(uint64_t) <= end) {
+		uint64_t a, b;
+		memcpy(&a, ip, sizeof(a));
+		memcpy(&b, ref, sizeof(b));
+		if(a != b) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			return ip - start + (__builtin_ctzll(a ^ b) >> 3);
+#else
+			return ip - start + (__builtin_clzll(a ^ b) >> 3);
+#endif
+		}
+		ip += sizeof(a);
+		ref += sizeof(b);
+	}
+	while(ip < end && *ip == *ref) {
+		ip++;
+		ref++;
+	}
+	return ip - start;
+}/*}}}*/
+
+static unsigned char * lz_putlen(unsigned char *op, size_t len)/*{{{*/
+{
+	for(; len >= 255; len -= 255) *op++ = 255;
+	*op++ = (unsigned char)len;
+	return op;
+}/*}}}*/
+
+/* Emits a sequence of =nlit= literals from =lit= followed, if =mlen= is
+ * not zero, by a match.  Returns NULL if it does not fit before =oend=. */
+static unsigned char * lz_emit(unsigned char *op, unsigned char *oend,/*{{{*/
+		const unsigned char *lit, size_t nlit, size_t off, size_t mlen)
+{
+	size_t need = 1 + nlit + nlit / 255 + 1 + (mlen ? 2 + mlen / 255 + 1 : 0);
+	if(need > (size_t)(oend - op)) return NULL;
+	size_t mcode = mlen ? mlen - LZ_MINMATCH : 0;
+	*op++ = (unsigned char)(((nlit < 15 ? nlit : 15) << 4) |
+			(mcode < 15 ? mcode : 15));
+	if(nlit >= 15) op = lz_putlen(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if(!mlen) return op;
+	*op++ = (unsigned char)(off & 0xff);
+	*op++ = (unsigned char)(off >> 8);
+	if(mcode >= 15) op = lz_putlen(op, mcode - 15);
+	return op;
+}/*}}}*/
+
+/* Compresses the =n= bytes at =src= into at most =max= bytes at =dst=.
+ * Returns the compressed size, or 0 if it would exceed =max=. */
+static size_t lz_compress(const unsigned char *src, size_t n,/*{{{*/
+		unsigned char *dst, size_t max)
+{
+	uint16_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+	const unsigned char *ip = src + 1;
+	const unsigned char *anchor = src;
+	const unsigned char *end = src + n;
+	unsigned char *op = dst;
+	unsigned char *oend = dst + max;
+	while(ip + LZ_MINMATCH <= end) {
+		uint32_t v = lz_read32(ip);
+		unsigned h = lz_hash(v);
+		const unsigned char *ref = src + table[h];
+		table[h] = (uint16_t)(ip - src);
+		if(lz_read32(ref) != v) {
+			/* Skip faster through data that does not match. */
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+		const unsigned char *mstart = ip;
+		size_t off = ip - ref;
+		ip += LZ_MINMATCH + lz_count(ip + LZ_MINMATCH, ref + LZ_MINMATCH,
+				end);
+		op = lz_emit(op, oend, anchor, mstart - anchor, off, ip - mstart);
+		if(!op) return 0;
+		anchor = ip;
+	}
+	op = lz_emit(op, oend, anchor, end - anchor, 0, 0);
+	return op ? (size_t)(op - dst) : 0;
+}/*}}}*/
+
+static int lz_getlen(const unsigned char **ip, const unsigned char *iend,/*{{{*/
+		size_t *len)
+{
+	unsigned b;
+	do {
+		if(*ip >= iend) return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while(b == 255);
+	return 0;
+}/*}}}*/
+
+/* Decompresses the =n= bytes at =src= into exactly =out= bytes at =dst=.
+ * Returns 0 on success or -1 if the input is malformed. */
+static int lz_decompress(const unsigned char *src, size_t n,/*{{{*/
+		unsigned char *dst, size_t out)
+{
+	const unsigned char *ip = src;
+	const unsigned char *iend = src + n;
+	unsigned char *op = dst;
+	unsigned char *oend = dst + out;
+	while(ip < iend) {
+		unsigned token = *ip++;
+		size_t nlit = token >> 4;
+		if(nlit == 15 && lz_getlen(&ip, iend, &nlit) == -1) return -1;
+		if(nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+		if(ip == iend) break;
+		if(iend - ip < 2) return -1;
+		size_t off = ip[0] | (size_t)ip[1] << 8;
+		ip += 2;
+		size_t mlen = token & 15;
+		if(mlen == 15 && lz_getlen(&ip, iend, &mlen) == -1) return -1;
+		mlen += LZ_MINMATCH;
+		if(off == 0 || off > (size_t)(op - dst) ||
+				mlen > (size_t)(oend - op))
+			return -1;
+		/* Overlapping matches repeat the last =off= bytes; each copy
+		 * doubles the span that can be copied at once. */
+		const unsigned char *ref = op - off;
+		while(mlen > 0) {
+			size_t c = (size_t)(op - ref) < mlen ? (size_t)(op - ref) : mlen;
+			memcpy(op, ref, c);
+			op += c;
+			mlen -= c;
+		}
+	}
+	return op == oend ? 0 : -1;
+}/*}}}*/
+
+/*****************************************************************************
+ * pool
+ ****************************************************************************/
+/* A page in the pool.  Pages of a single repeated byte have `len` zero
+ * and keep the byte in `fill`. */
+struct zswap_entry {
+	struct zswap_entry *prev;   /* LRU list, most recently used first */
+	struct zswap_entry *next;
+	int block;
+	uint32_t len;
+	unsigned char fill;
+	unsigned char data[];
+};
+
+/* Everything but the constant fields is protected by `lock`. */
+struct zswap {
+	size_t budget;
+	int nblocks;
+	size_t pagesize;
+	zswap_spill_fn spill;
+	void *arg;
+	pthread_mutex_t lock;
+	struct zswap_entry **entries;   /* indexed by block */
+	struct zswap_entry *lru_head;
+	struct zswap_entry *lru_tail;
+	char *bounce;                   /* page-aligned spill buffer */
+	struct zswap_stats stats;
+};
+
+static inline size_t zswap_cost(const struct zswap_entry *e)/*{{{*/
+{
+	return sizeof(*e) + e->len;
+}/*}}}*/
+
+static void zswap_lru_unlink(struct zswap *z, struct zswap_entry *e)/*{{{*/
+{
+	if(e->prev) e->prev->next = e->next;
+	else z->lru_head = e->next;
+	if(e->next) e->next->prev = e->prev;
+	else z->lru_tail = e->prev;
+}/*}}}*/
+
+static void zswap_lru_push(struct zswap *z, struct zswap_entry *e)/*{{{*/
+{
+	e->prev = NULL;
+	e->next = z->lru_head;
+	if(z->lru_head) z->lru_head->prev = e;
+	else z->lru_tail = e;
+	z->lru_head = e;
+}/*}}}*/
+
+/* Called with z->lock. */
+static void zswap_drop(struct zswap *z, struct zswap_entry *e)/*{{{*/
+{
+	zswap_lru_unlink(z, e);
+	z->entries[e->block] = NULL;
+	z->stats.npages--;
+	z->stats.pool_bytes -= zswap_cost(e);
+	free(e);
+}/*}}}*/
+
+/* Called with z->lock. */
+static void zswap_unpack(const struct zswap_entry *e, char *page,/*{{{*/
+		size_t pagesize)
+{
+	if(e->len == 0) {
+		memset(page, e->fill, pagesize);
+	} else if(lz_decompress(e->data, e->len, (unsigned char *)page,
+			pagesize) == -1) {
+		logea(__FILE__, __LINE__, "corrupt compressed page");
+	}
+}/*}}}*/
+
+/* Spills least recently used pages, other than =keep=, until the pool
+ * fits the budget.  Called with z->lock. */
+static void zswap_shrink(struct zswap *z, struct zswap_entry *keep)/*{{{*/
+{
+	while(z->stats.pool_bytes > z->budget && z->lru_tail &&
+			z->lru_tail != keep) {
+		struct zswap_entry *e = z->lru_tail;
+		zswap_unpack(e, z->bounce, z->pagesize);
+		z->spill(z->arg, e->block, z->bounce);
+		z->stats.spills++;
+		zswap_drop(z, e);
+	}
+}/*}}}*/
+
+/*****************************************************************************
+ * zswap function implementations
+ ****************************************************************************/
+struct zswap * zswap_create(size_t budget, int nblocks, size_t pagesize, /* {{{ */
+		zswap_spill_fn spill, void *arg)
+{
+	struct zswap *z = calloc(1, sizeof(*z));
+	if(!z) return NULL;
+	z->budget = budget;
+	z->nblocks = nblocks;
+	z->pagesize = pagesize;
+	z->spill = spill;
+	z->arg = arg;
+	pthread_mutex_init(&z->lock, NULL);
+	z->entries = calloc(nblocks, sizeof(z->entries[0]));
+	if(!z->entries) goto out_free;
+	if(posix_memalign((void **)&z->bounce, pagesize, pagesize))
+		goto out_entries;
+	return z;
+
+out_entries:
+	free(z->entries);
+out_free:
+	pthread_mutex_destroy(&z->lock);
+	free(z);
+	return NULL;
+} /* }}} */
+
+void zswap_destroy(struct zswap *z) /* {{{ */
+{
+	while(z->lru_head) zswap_drop(z, z->lru_head);
+	pthread_mutex_destroy(&z->lock);
+	free(z->entries);
+	free(z->bounce);
+	free(z);
+} /* }}} */
+
+int zswap_store(struct zswap *z, int block, const char *page) /* {{{ */
+{
+	/* Compress before locking; the pool only sees the result. */
+	struct zswap_entry *e;
+	size_t len = 0;
+	if(memcmp(page, page + 1, z->pagesize - 1) == 0) {
+		e = malloc(sizeof(*e));
+		if(e) e->fill = (unsigned char)page[0];
+	} else {
+		size_t max = z->pagesize * 3 / 4;
+		e = malloc(sizeof(*e) + max);
+		if(e) len = lz_compress((const unsigned char *)page, z->pagesize,
+				e->data, max);
+		if(e && len == 0) {
+			free(e);
+			e = NULL;
+		} else if(e) {
+			struct zswap_entry *small = realloc(e, sizeof(*e) + len);
+			if(small) e = small;
+		}
+	}
+
+	pthread_mutex_lock(&z->lock);
+	if(z->entries[block]) zswap_drop(z, z->entries[block]);
+	if(!e || sizeof(*e) + len > z->budget) {
+		z->stats.rejects++;
+		pthread_mutex_unlock(&z->lock);
+		free(e);
+		return -1;
+	}
+	e->block = block;
+	e->len = (uint32_t)len;
+	z->entries[block] = e;
+	zswap_lru_push(z, e);
+	z->stats.stores++;
+	if(len == 0) z->stats.same++;
+	z->stats.stored_bytes += z->pagesize;
+	z->stats.packed_bytes += len;
+	z->stats.npages++;
+	z->stats.pool_bytes += zswap_cost(e);
+	zswap_shrink(z, e);
+	pthread_mutex_unlock(&z->lock);
+	return 0;
+} /* }}} */
+
+int zswap_load(struct zswap *z, int block, char *page) /* {{{ */
+{
+	pthread_mutex_lock(&z->lock);
+	struct zswap_entry *e = z->entries[block];
+	if(!e) {
+		z->stats.misses++;
+		pthread_mutex_unlock(&z->lock);
+		return -1;
+	}
+	zswap_unpack(e, page, z->pagesize);
+	zswap_lru_unlink(z, e);
+	zswap_lru_push(z, e);
+	z->stats.hits++;
+	pthread_mutex_unlock(&z->lock);
+	return 0;
+} /* }}} */
+
+void zswap_get_stats(struct zswap *z, struct zswap_stats *s) /* {{{ */
+{
+	pthread_mutex_lock(&z->lock);
+	*s = z->stats;
+	pthread_mutex_unlock(&z->lock);
+} /* }}} */
@@ -0,0 +1,60 @@
+/* This module keeps swapped-out pages compressed in memory, in front of
+ * the swap blocks.  Pages written to a block are compressed into a pool
+ * and reads of the block are served from it; the pool is bounded by a
+ * byte budget, and when a store would exceed it the least recently used
+ * pages are written to their blocks on disk ("spilled") and dropped.
+ * Pages made of a single repeated byte, such as freshly zero-filled
+ * ones, take no space beyond their entry.  Pages that do not compress to
+ * at most three quarters of their size are rejected and should be
+ * written to disk by the caller.
+ *
+ * All functions are thread-safe.  Spills happen with the pool locked,
+ * so a block is never both missing from the pool and not yet on disk. */
+
+#ifndef __ZSWAP_HEADER__
+#define __ZSWAP_HEADER__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* This function writes =page= to block =block= on disk.  =page= is
+ * aligned to the page size. */
+typedef void (*zswap_spill_fn)(void *arg, int block, const char *page);
+
+struct zswap_stats {
+	uint64_t stores;        /* pages put in the pool */
+	uint64_t same;          /* of which were a single repeated byte */
+	uint64_t rejects;       /* pages that did not compress */
+	uint64_t hits;          /* reads served from the pool */
+	uint64_t misses;        /* reads of blocks not in the pool */
+	uint64_t spills;        /* pages written to disk to fit the budget */
+	uint64_t stored_bytes;  /* uncompressed bytes of all stores */
+	uint64_t packed_bytes;  /* compressed bytes of all stores */
+	uint64_t npages;        /* pages in the pool now */
+	uint64_t pool_bytes;    /* bytes used by the pool now */
+};
+
+struct zswap;
+
+/* This function creates a pool of at most =budget= bytes for the
+ * =nblocks= blocks of =pagesize= bytes each.  =spill= is called with
+ * =arg= to write pages evicted from the pool.  Returns NULL on error. */
+struct zswap * zswap_create(size_t budget, int nblocks, size_t pagesize,
+		zswap_spill_fn spill, void *arg);
+
+/* This function frees the pool without spilling it. */
+void zswap_destroy(struct zswap *z);
+
+/* This function stores =page= as the contents of block =block=.  Any
+ * older copy of the block in the pool is dropped.  Returns 0 if the page
+ * was stored or -1 if it was rejected and must go to disk. */
+int zswap_store(struct zswap *z, int block, const char *page);
+
+/* This function copies the contents of block =block= to =page= if the
+ * block is in the pool.  Returns 0 on a hit and -1 on a miss. */
+int zswap_load(struct zswap *z, int block, char *page);
+
+/* This function copies the counters to =s=. */
+void zswap_get_stats(struct zswap *z, struct zswap_stats *s);
+
+#endif
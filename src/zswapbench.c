@@ -0,0 +1,86 @@
+/* Microbenchmark for the zswap codec.  Stores and loads the same page
+ * repeatedly for a few kinds of contents and prints the cost per page
+ * and the pool space it takes.  Pages start filled with '0', as
+ * mmu_zero_fill leaves them. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "zswap.h"
+
+#define PAGESIZE 4096
+#define NBLOCKS 64
+#define NOPS 100000
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}/*}}}*/
+
+static void spill(void *arg, int block, const char *page)/*{{{*/
+{
+	(void)arg;
+	(void)block;
+	(void)page;
+}/*}}}*/
+
+static void fill(char *page, int kind)/*{{{*/
+{
+	memset(page, '0', PAGESIZE);
+	srand(2);
+	switch(kind) {
+	case 1: /* a few bytes written */
+		for(int i = 0; i < 20; i++) page[rand() % PAGESIZE] = rand();
+		break;
+	case 2: /* text-like, eight symbols */
+		for(int i = 0; i < PAGESIZE; i++) page[i] = "abcdefgh"[rand() % 8];
+		break;
+	case 3: /* incompressible */
+		for(int i = 0; i < PAGESIZE; i++) page[i] = rand();
+		break;
+	}
+}/*}}}*/
+
+int main(void)/*{{{*/
+{
+	static const char *kinds[] = {"'0'-filled", "20 bytes set", "8 symbols",
+			"random"};
+	static char page[PAGESIZE], out[PAGESIZE];
+
+	printf("%-14s %10s %10s %12s\n", "page", "store us", "load us",
+			"pool B/page");
+	for(int kind = 0; kind < 4; kind++) {
+		struct zswap *z = zswap_create(1 << 20, NBLOCKS, PAGESIZE, spill,
+				NULL);
+		if(!z) exit(EXIT_FAILURE);
+		fill(page, kind);
+		int stored = 0;
+		double t = now();
+		for(int i = 0; i < NOPS; i++) {
+			stored += zswap_store(z, i % NBLOCKS, page) == 0;
+		}
+		double tstore = (now() - t) / NOPS * 1e6;
+		double tload = 0;
+		if(stored) {
+			t = now();
+			for(int i = 0; i < NOPS; i++) zswap_load(z, i % NBLOCKS, out);
+			tload = (now() - t) / NOPS * 1e6;
+			if(memcmp(page, out, PAGESIZE)) printf("%s: bad load\n", kinds[kind]);
+		}
+		struct zswap_stats s;
+		zswap_get_stats(z, &s);
+		if(stored) {
+			printf("%-14s %10.2f %10.2f %12llu\n", kinds[kind], tstore, tload,
+					(unsigned long long)(s.pool_bytes / s.npages));
+		} else {
+			printf("%-14s %10.2f %10s %12s\n", kinds[kind], tstore, "-",
+					"rejected");
+		}
+		zswap_destroy(z);
+	}
+	return 0;
+}/*}}}*/